@@ -0,0 +1,444 @@
+/* alu6502.c -- exhaustive test of lib6502's arithmetic and logic	-*- C -*- */
+
+/* Copyright (c) 2005 Ian Piumarta
+ *
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the 'Software'),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, provided that the above copyright notice(s) and this
+ * permission notice appear in all copies of the Software and that both the
+ * above copyright notice(s) and this permission notice appear in supporting
+ * documentation.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS'.  USE ENTIRELY AT YOUR OWN RISK.
+ */
+
+/* Every opcode that M6502_disassemble names as an arithmetic, logical,
+ * compare, bit test, shift, rotate, increment or decrement instruction is
+ * executed with every combination of register (A, or X or Y for the
+ * instructions that use them), operand, carry and decimal flags: 2^18
+ * cases per opcode.  The other flags and the index registers vary from
+ * case to case too, so indexed and indirect operands land all over zero
+ * page and across page boundaries.  Each case is run by M6502_step on an
+ * instance without a trace (the switch interpreter), by M6502_run on
+ * another (the computed-goto interpreter, stopped by a JMP to a call
+ * callback after the instruction), by the traced interpreter, and eight
+ * at a time by the lanes of a batch (which execute most of these insns in
+ * lockstep), and the registers, the operand in memory and the next PC
+ * are compared with what the model below predicts.
+ *
+ * The model is written from the 65C02 data sheet rather than from
+ * lib6502.c, and computes decimal arithmetic digit by digit instead of
+ * with the binary corrections the emulator uses.  The opcodes are shared
+ * among one thread per processor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <unistd.h>
+
+#include "lib6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+enum { N= 0x80, V= 0x40, D= 0x08, I= 0x04, Z= 0x02, C= 0x01 };
+
+enum {
+  ADC, SBC, AND, ORA, EOR, CMP, CPX, CPY, BIT, TSB, TRB,
+  ASL, LSR, ROL, ROR, INC, DEC, ASLA, LSRA, ROLA, RORA,
+  INA, DEA, INX, INY, DEX, DEY, OPERATIONS
+};
+
+static const char *names[OPERATIONS]= {
+  "adc", "sbc", "and", "ora", "eor", "cmp", "cpx", "cpy", "bit", "tsb", "trb",
+  "asl", "lsr", "rol", "ror", "inc", "dec", "asla", "lsra", "rola", "rora",
+  "ina", "dea", "inx", "iny", "dex", "dey"
+};
+
+enum { implied, immediate, zp, zpx, abs_, absx, absy, indx, indy, indzp };
+
+struct opcode
+{
+  byte	opcode;
+  int	operation;
+  int	mode;
+  int	length;
+  char	text[64];	/* as disassembled */
+};
+
+struct state
+{
+  byte	a, x, y, p, m;
+};
+
+static struct opcode opcodes[256];
+static int	     nopcodes= 0;
+static int	     next= 0;		/* the next opcode for a thread to take */
+static unsigned long failures= 0;
+
+static pthread_mutex_t lock= PTHREAD_MUTEX_INITIALIZER;
+
+#define CODE	0x0200	/* where each case's instruction is */
+#define POINTER	0x40	/* zero page pointer for the indirect modes */
+#define STOP	0xFF00	/* the JMP after it goes here to end M6502_run */
+#define LOST	0xFF10	/* and BRK here, if the instruction went astray */
+#define LANES	8	/* cases run together by M6502_runBatch */
+
+static __thread jmp_buf stopped;
+
+
+static byte nz(byte r, byte p)
+{
+  return (p & ~(N | Z)) | (r & N) | (r ? 0 : Z);
+}
+
+
+/* shift or rotate v as the operation (ASL etc.) does */
+
+static byte shift(int operation, byte v, byte *p)
+{
+  int  in= *p & C, out;
+  byte r;
+
+  switch (operation)
+    {
+    case ASL:	r= v << 1;		out= v >> 7;	break;
+    case LSR:	r= v >> 1;		out= v & 1;	break;
+    case ROL:	r= (v << 1) | in;	out= v >> 7;	break;
+    default:	r= (v >> 1) | (in << 7);	out= v & 1;	break;
+    }
+  *p= nz(r, (*p & ~C) | out);
+  return r;
+}
+
+
+/* what the 65C02 does */
+
+static void model(int operation, int mode, struct state *s)
+{
+  byte m= s->m;
+  int  c= s->p & C;
+  int  t;
+
+  switch (operation)
+    {
+    case ADC:
+      t= s->a + m + c;
+      s->p= (s->p & ~(V | C)) | ((~(s->a ^ m) & (s->a ^ t) & 0x80) ? V : 0) | (t > 0xff);
+      if (s->p & D)
+	{
+	  /* one digit at a time; V is from the high digit before it is
+	   * corrected, and invalid digits are corrected all the same */
+	  int lo= (s->a & 15) + (m & 15) + c;
+	  int hi= (s->a >> 4) + (m >> 4);
+	  if (lo > 9) lo += 6;
+	  hi += lo > 15;
+	  s->p= (s->p & ~(V | C)) | ((~(s->a ^ m) & (s->a ^ (hi << 4)) & 0x80) ? V : 0);
+	  if (hi > 9) hi += 6;
+	  s->p |= hi > 15;
+	  t= (hi << 4) | (lo & 15);
+	}
+      s->a= t;
+      s->p= nz(s->a, s->p);
+      break;
+
+    case SBC:
+      t= s->a - m - !c;
+      s->p= (s->p & ~(V | C)) | (((s->a ^ m) & (s->a ^ t) & 0x80) ? V : 0) | (t >= 0);
+      if (s->p & D)
+	{
+	  /* one digit at a time, each corrected by 6 if it borrowed; with
+	   * invalid digits the correction of the low digit can itself
+	   * borrow from the high one */
+	  int lo=  (s->a & 15) - (m & 15) - !c;
+	  int hi=  (s->a >> 4) - (m >> 4) - (lo < 0);
+	  int fix= hi < 0;
+	  if (lo < 0)
+	    {
+	      lo= (lo & 15) - 6;
+	      if (lo < 0) lo += 16, --hi;
+	    }
+	  if (fix) hi -= 6;
+	  t= ((hi & 15) << 4) | lo;
+	}
+      s->a= t;
+      s->p= nz(s->a, s->p);
+      break;
+
+    case AND:	s->a &= m;  s->p= nz(s->a, s->p);  break;
+    case ORA:	s->a |= m;  s->p= nz(s->a, s->p);  break;
+    case EOR:	s->a ^= m;  s->p= nz(s->a, s->p);  break;
+
+    case CMP:	s->p= nz(s->a - m, (s->p & ~C) | (s->a >= m));  break;
+    case CPX:	s->p= nz(s->x - m, (s->p & ~C) | (s->x >= m));  break;
+    case CPY:	s->p= nz(s->y - m, (s->p & ~C) | (s->y >= m));  break;
+
+    case BIT:
+      if (mode == immediate)
+	s->p= (s->p & ~Z) | ((s->a & m) ? 0 : Z);
+      else
+	s->p= (s->p & ~(N | V | Z)) | (m & (N | V)) | ((s->a & m) ? 0 : Z);
+      break;
+
+    case TSB:	s->p= (s->p & ~Z) | ((s->a & m) ? 0 : Z);  s->m= m | s->a;   break;
+    case TRB:	s->p= (s->p & ~Z) | ((s->a & m) ? 0 : Z);  s->m= m & ~s->a;  break;
+
+    case ASL:  case LSR:  case ROL:  case ROR:
+      s->m= shift(operation, m, &s->p);
+      break;
+    case ASLA: case LSRA: case ROLA: case RORA:
+      s->a= shift(operation - ASLA + ASL, s->a, &s->p);
+      break;
+
+    case INC:	++s->m;  s->p= nz(s->m, s->p);  break;
+    case DEC:	--s->m;  s->p= nz(s->m, s->p);  break;
+    case INA:	++s->a;  s->p= nz(s->a, s->p);  break;
+    case DEA:	--s->a;  s->p= nz(s->a, s->p);  break;
+    case INX:	++s->x;  s->p= nz(s->x, s->p);  break;
+    case INY:	++s->y;  s->p= nz(s->y, s->p);  break;
+    case DEX:	--s->x;  s->p= nz(s->x, s->p);  break;
+    case DEY:	--s->y;  s->p= nz(s->y, s->p);  break;
+    }
+}
+
+
+/* find the opcodes to test, and their addressing modes, by disassembling
+ * each one with operand bytes 12 34 */
+
+static void findOpcodes(void)
+{
+  M6502 *mpu= M6502_new(0, 0, 0);
+  int	 op;
+
+  for (op= 0;  op < 256;  ++op)
+    {
+      struct opcode *o= &opcodes[nopcodes];
+      char	     name[64], *operand;
+      int	     i;
+
+      mpu->memory[CODE]= op;
+      mpu->memory[CODE + 1]= 0x12;
+      mpu->memory[CODE + 2]= 0x34;
+      o->length= M6502_disassemble(mpu, CODE, o->text);
+      strcpy(name, o->text);
+      if ((operand= strchr(name, ' ')))
+	*operand++= '\0';
+      for (i= 0;  i < OPERATIONS && strcmp(name, names[i]);  ++i);
+      if (i == OPERATIONS)
+	continue;
+      o->opcode= op;
+      o->operation= i;
+      if	(!operand || !*operand)		o->mode= implied;
+      else if (!strcmp(operand, "#12"))		o->mode= immediate;
+      else if (!strcmp(operand, "12"))		o->mode= zp;
+      else if (!strcmp(operand, "12,X"))	o->mode= zpx;
+      else if (!strcmp(operand, "3412"))	o->mode= abs_;
+      else if (!strcmp(operand, "3412,X"))	o->mode= absx;
+      else if (!strcmp(operand, "3412,Y"))	o->mode= absy;
+      else if (!strcmp(operand, "(12,X)"))	o->mode= indx;
+      else if (!strcmp(operand, "(12),Y"))	o->mode= indy;
+      else if (!strcmp(operand, "(12)"))	o->mode= indzp;
+      else
+	{
+	  fprintf(stderr, "alu6502: %02X: unexpected operand: %s\n", op, o->text);
+	  exit(1);
+	}
+      ++nopcodes;
+    }
+  M6502_delete(mpu);
+}
+
+
+/* set up one case in mpu: the instruction at CODE, the operand where it
+ * will find it, and the registers.  returns the operand's address. */
+
+static word setUp(M6502 *mpu, struct opcode *o, struct state *s)
+{
+  byte *memory= mpu->memory;
+  word	ea= 0;
+
+  memory[CODE]= o->opcode;
+  switch (o->mode)
+    {
+    case implied:				break;
+    case immediate: ea= CODE + 1;		break;
+    case zp:	    ea= 0x70;			break;
+    case zpx:	    ea= (byte)(0x70 + s->x);	break;
+    case abs_:	    ea= 0x1234;			break;
+    case absx:	    ea= 0x12f0 + s->x;		break;
+    case absy:	    ea= 0x12f0 + s->y;		break;
+    case indx:	    ea= 0x3456;  memory[(byte)(POINTER + s->x)]= 0x56;  memory[(byte)(POINTER + s->x + 1)]= 0x34;  break;
+    case indy:	    ea= 0x33f0 + s->y;  memory[POINTER]= 0xf0;  memory[POINTER + 1]= 0x33;  break;
+    case indzp:	    ea= 0x3456;  memory[POINTER]= 0x56;  memory[POINTER + 1]= 0x34;  break;
+    }
+  switch (o->mode)
+    {
+    case zp:  case zpx:  case indx:  case indy:  case indzp:  memory[CODE + 1]= (o->mode == zp || o->mode == zpx) ? 0x70 : POINTER;  break;
+    case abs_:				memory[CODE + 1]= 0x34;  memory[CODE + 2]= 0x12;  break;
+    case absx:  case absy:		memory[CODE + 1]= 0xf0;  memory[CODE + 2]= 0x12;  break;
+    }
+  memory[ea]= s->m;
+  mpu->registers->a=  s->a;
+  mpu->registers->x=  s->x;
+  mpu->registers->y=  s->y;
+  mpu->registers->p=  s->p;
+  mpu->registers->s=  0xff;
+  mpu->registers->pc= CODE;
+  return ea;
+}
+
+
+static int check(M6502 *mpu, const char *engine, struct opcode *o, struct state *in, struct state *out, word ea)
+{
+  M6502_Registers *r= mpu->registers;
+  char		   text[128];
+
+  if (r->a == out->a && r->x == out->x && r->y == out->y && r->p == out->p
+      && r->s == 0xff && r->pc == CODE + o->length && mpu->memory[ea] == out->m)
+    return 0;
+  pthread_mutex_lock(&lock);
+  if (failures++ < 20)
+    {
+      sprintf(text, "%02X %s", o->opcode, o->text);
+      printf("%-16s %-6s A=%02X X=%02X Y=%02X P=%02X M=%02X: expected A=%02X X=%02X Y=%02X P=%02X M=%02X PC=%04X,"
+	     " got A=%02X X=%02X Y=%02X P=%02X M=%02X PC=%04X\n",
+	     text, engine, in->a, in->x, in->y, in->p, in->m,
+	     out->a, out->x, out->y, out->p, out->m, CODE + o->length,
+	     r->a, r->x, r->y, r->p, mpu->memory[ea], r->pc);
+    }
+  pthread_mutex_unlock(&lock);
+  return 1;
+}
+
+
+static int stop(M6502 *mpu, uint16_t address, uint8_t data)
+{
+  longjmp(stopped, address);
+}
+
+
+/* run the instruction set up in mpu with M6502_run, which only returns by
+ * way of a callback.  the JMP to STOP planted after the instruction is
+ * reached only if it left PC there, so put PC back where the JMP was. */
+
+static void run(M6502 *mpu, struct opcode *o)
+{
+  word next= CODE + o->length;
+
+  mpu->memory[next]= 0x4C;
+  mpu->memory[(word)(next + 1)]= STOP & 0xff;
+  mpu->memory[(word)(next + 2)]= STOP >> 8;
+  if (!setjmp(stopped))
+    M6502_run(mpu);
+  else if (STOP == mpu->registers->pc)
+    mpu->registers->pc= next;
+}
+
+
+static void *worker(void *arg)
+{
+  M6502 *step=	M6502_new(0, 0, 0);	/* M6502_step without a trace: the switch interpreter */
+  M6502 *jump=	M6502_new(0, 0, 0);	/* M6502_run without one: the computed-goto interpreter */
+  M6502 *trace= M6502_new(0, 0, 0);	/* M6502_run with one: the traced interpreter */
+  M6502_Batch *batch= M6502_newBatch(step, LANES);	/* lanes, mostly in lockstep */
+  int	 n;
+
+  M6502_setCallback(jump, call, STOP, stop);
+  M6502_setCallback(jump, call, LOST, stop);
+  M6502_setVector(jump, IRQ, LOST);
+  M6502_trace(trace);
+  while ((n= __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < nopcodes)
+    {
+      struct opcode *o= &opcodes[n];
+      unsigned	     i, k, bad= 0;
+      struct state   ins[LANES], outs[LANES];
+      word	     eas[LANES];
+
+      for (i= 0;  i < (1 << 18) && bad < 4;  ++i)
+	{
+	  /* the register under test, the operand, C and D are enumerated;
+	   * the rest come from a hash of the case */
+	  unsigned     h= (i * 0x9e3779b1u) >> 8;
+	  byte	       r= i, m= i >> 8;
+	  struct state in, out;
+	  word	       ea;
+
+	  in.a= h;
+	  in.x= h >> 8;
+	  in.y= h >> 16;
+	  in.p= 0x30 | ((i >> 16) & C) | ((i >> 14) & D) | (h & (N | V | Z | I));
+	  in.m= m;
+	  switch (o->operation)
+	    {
+	    case CPX:  case INX:  case DEX:	in.x= r;  break;
+	    case CPY:  case INY:  case DEY:	in.y= r;  break;
+	    default:				in.a= r;  break;
+	    }
+	  out= in;
+	  model(o->operation, o->mode, &out);
+
+	  ea= setUp(step, o, &in);
+	  M6502_step(step);
+	  bad += check(step, "step", o, &in, &out, ea);
+
+	  ea= setUp(jump, o, &in);
+	  run(jump, o);
+	  bad += check(jump, "run", o, &in, &out, ea);
+
+	  ea= setUp(trace, o, &in);
+	  M6502_traceEngine(trace, 1);
+	  bad += check(trace, "traced", o, &in, &out, ea);
+
+	  /* the batch runs a case in each lane once it has one for all */
+	  k= i % LANES;
+	  ins[k]= in;
+	  outs[k]= out;
+	  eas[k]= setUp(M6502_lane(batch, k), o, &in);
+	  M6502_lane(batch, k)->trace->limit= M6502_lane(batch, k)->trace->insns + 1;
+	  if (k == LANES - 1)
+	    {
+	      M6502_runBatch(batch);
+	      for (k= 0;  k < LANES;  ++k)
+		bad += check(M6502_lane(batch, k), "batch", o, &ins[k], &outs[k], eas[k]);
+	    }
+	}
+    }
+  M6502_delete(step);
+  M6502_delete(jump);
+  M6502_delete(trace);
+  M6502_deleteBatch(batch);
+  return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  long	     ncpus= sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t *threads;
+  long	     i;
+
+  findOpcodes();
+  if (ncpus < 1) ncpus= 1;
+  if (ncpus > nopcodes) ncpus= nopcodes;
+  threads= calloc(ncpus, sizeof(pthread_t));
+  for (i= 0;  i < ncpus;  ++i)
+    if (pthread_create(&threads[i], 0, worker, 0))
+      {
+	perror("pthread_create");
+	exit(1);
+      }
+  for (i= 0;  i < ncpus;  ++i)
+    pthread_join(threads[i], 0);
+
+  printf("alu6502: %d opcodes, %u cases each: %s\n", nopcodes, 1 << 18,
+	 failures ? "FAILED" : "passed");
+  return !!failures;
+}
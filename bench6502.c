@@ -0,0 +1,1017 @@
+/* bench6502.c -- measure the speed of the interpreters	-*- C -*- */
+
+/* Copyright (c) 2005 Ian Piumarta
+ *
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the 'Software'),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, provided that the above copyright notice(s) and this
+ * permission notice appear in all copies of the Software and that both the
+ * above copyright notice(s) and this permission notice appear in supporting
+ * documentation.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS'.  USE ENTIRELY AT YOUR OWN RISK.
+ */
+
+/* 'make bench' runs each of the workloads below with each way lib6502
+ * has of executing instructions and prints millions of instructions per
+ * second:
+ *
+ *   step    M6502_step in a loop (the switch interpreter)
+ *   run     M6502_run without a trace (threaded code where the compiler
+ *           allows it), left by longjmp from the exit callback
+ *   traced  M6502_run with a trace, which counts and checks the limit
+ *   batch   M6502_runBatch with LANES lanes (their instructions summed)
+ *
+ * Every workload is loaded at 0400 and finishes by jumping to FFF0 (EXIT),
+ * where a call callback stops it.  The number of instructions each one
+ * executes is counted once, with a trace, and every run must then leave
+ * memory and registers exactly as that one did.
+ *
+ * The process is pinned to one processor (by default the last one it is
+ * allowed to use) and each measurement is repeated, after one run to warm
+ * the caches, and the median reported.
+ *
+ * With -o the samples are also written to a file as JSON, with the commit
+ * given by -k and the compiler that built bench6502, along with the
+ * processor's cycles, branch misses and L1 data cache misses for each run
+ * if perf_event_open lets us count them.  With -b the samples are
+ * compared with those in a file written earlier: a combination whose
+ * median is more than -t percent (default 5) lower than the baseline's,
+ * and which a one-sided Mann-Whitney U test says is slower with p < 0.01,
+ * is a regression, and bench6502 then exits with status 1.  'make
+ * bench-baseline' and 'make bench-check' do both with 15 repeats.
+ *
+ * 'bench6502 -s workload' writes the workload's code to stdout so that
+ * other programs (run6502 -l 400 file -R 400 -X FFF0) can run it too.
+ *
+ *   bench6502 [-c cpu] [-r repeats] [-w workload] [-v variant] [-l]
+ *             [-k commit] [-o file] [-b file] [-t percent] [-s workload]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+#endif
+
+#include "lib6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+#define ORIGIN	0x0400
+#define EXIT	0xFFF0
+#define LANES	8
+
+#if defined(__clang__)
+# define COMPILER	"clang " __clang_version__
+#elif defined(__GNUC__)
+# define COMPILER	"gcc " __VERSION__
+#else
+# define COMPILER	"unknown"
+#endif
+
+/* the workloads, hand assembled */
+
+static const byte alu[]= {	/* 16-bit multiply-add and flag-heavy folding */
+  0xA9,0x00,                    /* 0400 lda #0 */
+  0x85,0x16,                    /* 0402 sta count */
+  0xA9,0x0A,                    /* 0404 lda #10 */
+  0x85,0x17,                    /* 0406 sta count+1 */
+  0xA0,0x00,                    /* 0408 ldy #0 */
+  0xA5,0x10,                    /* 040A loop: lda seed */
+  0x85,0x12,                    /* 040C sta tmp */
+  0xA5,0x11,                    /* 040E lda seed+1 */
+  0x85,0x13,                    /* 0410 sta tmp+1 */
+  0x06,0x12,                    /* 0412 asl tmp */
+  0x26,0x13,                    /* 0414 rol tmp+1 */
+  0x06,0x12,                    /* 0416 asl tmp */
+  0x26,0x13,                    /* 0418 rol tmp+1 */
+  0x18,                         /* 041A clc */
+  0xA5,0x10,                    /* 041B lda seed */
+  0x65,0x12,                    /* 041D adc tmp */
+  0x85,0x10,                    /* 041F sta seed */
+  0xA5,0x11,                    /* 0421 lda seed+1 */
+  0x65,0x13,                    /* 0423 adc tmp+1 */
+  0x85,0x11,                    /* 0425 sta seed+1 */
+  0xE6,0x10,                    /* 0427 inc seed */
+  0xD0,0x02,                    /* 0429 bne mix */
+  0xE6,0x11,                    /* 042B inc seed+1 */
+  0xA5,0x11,                    /* 042D mix: lda seed+1 */
+  0x45,0x14,                    /* 042F eor sum */
+  0x29,0x7F,                    /* 0431 and #$7F */
+  0x09,0x01,                    /* 0433 ora #$01 */
+  0xC9,0x40,                    /* 0435 cmp #$40 */
+  0x6A,                         /* 0437 ror */
+  0x85,0x14,                    /* 0438 sta sum */
+  0x88,                         /* 043A dey */
+  0xD0,0xCD,                    /* 043B bne loop */
+  0xC6,0x16,                    /* 043D dec count */
+  0xD0,0xC9,                    /* 043F bne loop */
+  0xC6,0x17,                    /* 0441 dec count+1 */
+  0xD0,0xC5,                    /* 0443 bne loop */
+  0x4C,0xF0,0xFF,               /* 0445 jmp EXIT */
+};
+
+static const byte memcpy_[]= {	/* (zp),Y and absolute,X copies of 8K */
+  0xA9,0xC8,                    /* 0400 lda #200 */
+  0x85,0x15,                    /* 0402 sta count */
+  0xA9,0x00,                    /* 0404 copy: lda #$00 */
+  0x85,0x10,                    /* 0406 sta src */
+  0x85,0x12,                    /* 0408 sta dst */
+  0xA9,0x20,                    /* 040A lda #$20 */
+  0x85,0x11,                    /* 040C sta src+1 */
+  0xA9,0x60,                    /* 040E lda #$60 */
+  0x85,0x13,                    /* 0410 sta dst+1 */
+  0xA9,0x20,                    /* 0412 lda #32 */
+  0x85,0x14,                    /* 0414 sta pages */
+  0xA0,0x00,                    /* 0416 ldy #0 */
+  0xB1,0x10,                    /* 0418 byte: lda (src),y */
+  0x91,0x12,                    /* 041A sta (dst),y */
+  0xC8,                         /* 041C iny */
+  0xD0,0xF9,                    /* 041D bne byte */
+  0xE6,0x11,                    /* 041F inc src+1 */
+  0xE6,0x13,                    /* 0421 inc dst+1 */
+  0xC6,0x14,                    /* 0423 dec pages */
+  0xD0,0xF1,                    /* 0425 bne byte */
+  0xA2,0x00,                    /* 0427 ldx #0 */
+  0xBD,0x00,0x60,               /* 0429 back: lda $6000,x */
+  0x9D,0x00,0x20,               /* 042C sta $2000,x */
+  0xE8,                         /* 042F inx */
+  0xD0,0xF7,                    /* 0430 bne back */
+  0xC6,0x15,                    /* 0432 dec count */
+  0xD0,0xCE,                    /* 0434 bne copy */
+  0x4C,0xF0,0xFF,               /* 0436 jmp EXIT */
+};
+
+static const byte bcd[]= {	/* decimal adds and subtracts across 4 bytes */
+  0xA9,0x00,                    /* 0400 lda #0 */
+  0x85,0x18,                    /* 0402 sta count */
+  0xA9,0x04,                    /* 0404 lda #4 */
+  0x85,0x19,                    /* 0406 sta count+1 */
+  0xA2,0x00,                    /* 0408 ldx #0 */
+  0xF8,                         /* 040A sed */
+  0x18,                         /* 040B loop: clc */
+  0xA5,0x10,                    /* 040C lda up */
+  0x69,0x01,                    /* 040E adc #$01 */
+  0x85,0x10,                    /* 0410 sta up */
+  0xA5,0x11,                    /* 0412 lda up+1 */
+  0x69,0x00,                    /* 0414 adc #$00 */
+  0x85,0x11,                    /* 0416 sta up+1 */
+  0xA5,0x12,                    /* 0418 lda up+2 */
+  0x69,0x00,                    /* 041A adc #$00 */
+  0x85,0x12,                    /* 041C sta up+2 */
+  0xA5,0x13,                    /* 041E lda up+3 */
+  0x69,0x00,                    /* 0420 adc #$00 */
+  0x85,0x13,                    /* 0422 sta up+3 */
+  0x38,                         /* 0424 sec */
+  0xA5,0x14,                    /* 0425 lda down */
+  0xE9,0x34,                    /* 0427 sbc #$34 */
+  0x85,0x14,                    /* 0429 sta down */
+  0xA5,0x15,                    /* 042B lda down+1 */
+  0xE9,0x12,                    /* 042D sbc #$12 */
+  0x85,0x15,                    /* 042F sta down+1 */
+  0xA5,0x16,                    /* 0431 lda down+2 */
+  0xE9,0x00,                    /* 0433 sbc #$00 */
+  0x85,0x16,                    /* 0435 sta down+2 */
+  0xCA,                         /* 0437 dex */
+  0xD0,0xD1,                    /* 0438 bne loop */
+  0xC6,0x18,                    /* 043A dec count */
+  0xD0,0xCD,                    /* 043C bne loop */
+  0xC6,0x19,                    /* 043E dec count+1 */
+  0xD0,0xC9,                    /* 0440 bne loop */
+  0xD8,                         /* 0442 cld */
+  0x4C,0xF0,0xFF,               /* 0443 jmp EXIT */
+};
+
+static const byte recurse[]= {	/* fib(18) and a 60-deep descent, by jsr/rts */
+  0xA9,0x28,                    /* 0400 lda #40 */
+  0x85,0x11,                    /* 0402 sta count */
+  0xA9,0x12,                    /* 0404 loop: lda #18 */
+  0x20,0x15,0x04,               /* 0406 jsr fib */
+  0xA9,0x3C,                    /* 0409 lda #60 */
+  0x20,0x2F,0x04,               /* 040B jsr deep */
+  0xC6,0x11,                    /* 040E dec count */
+  0xD0,0xF2,                    /* 0410 bne loop */
+  0x4C,0xF0,0xFF,               /* 0412 jmp EXIT */
+  0xC9,0x02,                    /* 0415 fib: cmp #2 */
+  0x90,0x15,                    /* 0417 bcc done */
+  0xE9,0x01,                    /* 0419 sbc #1 */
+  0x48,                         /* 041B pha */
+  0x20,0x15,0x04,               /* 041C jsr fib */
+  0xAA,                         /* 041F tax */
+  0x68,                         /* 0420 pla */
+  0xDA,                         /* 0421 phx */
+  0x38,                         /* 0422 sec */
+  0xE9,0x01,                    /* 0423 sbc #1 */
+  0x20,0x15,0x04,               /* 0425 jsr fib */
+  0x85,0x10,                    /* 0428 sta tmp */
+  0x68,                         /* 042A pla */
+  0x18,                         /* 042B clc */
+  0x65,0x10,                    /* 042C adc tmp */
+  0x60,                         /* 042E done: rts */
+  0xC9,0x00,                    /* 042F deep: cmp #0 */
+  0xF0,0x0D,                    /* 0431 beq deeper */
+  0x48,                         /* 0433 pha */
+  0x38,                         /* 0434 sec */
+  0xE9,0x01,                    /* 0435 sbc #1 */
+  0x20,0x2F,0x04,               /* 0437 jsr deep */
+  0x85,0x10,                    /* 043A sta tmp */
+  0x68,                         /* 043C pla */
+  0x18,                         /* 043D clc */
+  0x65,0x10,                    /* 043E adc tmp */
+  0x60,                         /* 0440 deeper: rts */
+};
+
+static const byte callbacks[]= {	/* IN (FE00) and OUT (FE01) have callbacks */
+  0xA9,0x00,                    /* 0400 lda #0 */
+  0x85,0x10,                    /* 0402 sta count */
+  0xA9,0x08,                    /* 0404 lda #8 */
+  0x85,0x11,                    /* 0406 sta count+1 */
+  0xA2,0x00,                    /* 0408 ldx #0 */
+  0xAD,0x00,0xFE,               /* 040A loop: lda IN */
+  0x49,0x55,                    /* 040D eor #$55 */
+  0x8D,0x01,0xFE,               /* 040F sta OUT */
+  0xAD,0x00,0xFE,               /* 0412 lda IN */
+  0x6D,0x00,0xFE,               /* 0415 adc IN */
+  0x8D,0x01,0xFE,               /* 0418 sta OUT */
+  0xCA,                         /* 041B dex */
+  0xD0,0xEC,                    /* 041C bne loop */
+  0xC6,0x10,                    /* 041E dec count */
+  0xD0,0xE8,                    /* 0420 bne loop */
+  0xC6,0x11,                    /* 0422 dec count+1 */
+  0xD0,0xE4,                    /* 0424 bne loop */
+  0x4C,0xF0,0xFF,               /* 0426 jmp EXIT */
+};
+
+static const byte traps[]= {	/* OS calls by illegal instruction, as run6502 -T */
+  0xA9,0x00,                    /* 0400 lda #0 */
+  0x85,0x10,                    /* 0402 sta count */
+  0xA9,0x08,                    /* 0404 lda #8 */
+  0x85,0x11,                    /* 0406 sta count+1 */
+  0xA2,0x00,                    /* 0408 ldx #0 */
+  0x20,0x1E,0x04,               /* 040A loop: jsr OSRDCH */
+  0x20,0x20,0x04,               /* 040D jsr OSWRCH */
+  0xCA,                         /* 0410 dex */
+  0xD0,0xF7,                    /* 0411 bne loop */
+  0xC6,0x10,                    /* 0413 dec count */
+  0xD0,0xF3,                    /* 0415 bne loop */
+  0xC6,0x11,                    /* 0417 dec count+1 */
+  0xD0,0xEF,                    /* 0419 bne loop */
+  0x4C,0xF0,0xFF,               /* 041B jmp EXIT */
+  0x43,                         /* 041E OSRDCH: .byte $43 */
+  0x60,                         /* 041F rts */
+  0x33,                         /* 0420 OSWRCH: .byte $33 */
+  0x60,                         /* 0421 rts */
+};
+
+static const byte basic[]= {	/* a token interpreter running a counting loop */
+  0xA9,0xC6,                    /* 0400 lda #<prog */
+  0x85,0x10,                    /* 0402 sta ip */
+  0xA9,0x04,                    /* 0404 lda #>prog */
+  0x85,0x11,                    /* 0406 sta ip+1 */
+  0xA9,0x00,                    /* 0408 lda #0 */
+  0x85,0x12,                    /* 040A sta sp */
+  0xA0,0x00,                    /* 040C next: ldy #0 */
+  0xB1,0x10,                    /* 040E lda (ip),y */
+  0xE6,0x10,                    /* 0410 inc ip */
+  0xD0,0x02,                    /* 0412 bne dispatch */
+  0xE6,0x11,                    /* 0414 inc ip+1 */
+  0xAA,                         /* 0416 dispatch: tax */
+  0x7C,0x1A,0x04,               /* 0417 jmp (table,x) */
+  0x33,0x04,0x36,0x04,0x48,0x04,0x5E,0x04,0x74,0x04,0x89,0x04,0x9E,0x04,/* 041A table: .word tend, tlit, tload, tstore, tadd, tsub, tjnz */
+  0xA0,0x00,                    /* 0428 fetchb: ldy #0 */
+  0xB1,0x10,                    /* 042A lda (ip),y */
+  0xE6,0x10,                    /* 042C inc ip */
+  0xD0,0x02,                    /* 042E bne fetched */
+  0xE6,0x11,                    /* 0430 inc ip+1 */
+  0x60,                         /* 0432 fetched: rts */
+  0x4C,0xF0,0xFF,               /* 0433 tend: jmp EXIT */
+  0xA6,0x12,                    /* 0436 tlit: ldx sp */
+  0x20,0x28,0x04,               /* 0438 jsr fetchb */
+  0x95,0x80,                    /* 043B sta stklo,x */
+  0x20,0x28,0x04,               /* 043D jsr fetchb */
+  0x95,0xA0,                    /* 0440 sta stkhi,x */
+  0xE8,                         /* 0442 inx */
+  0x86,0x12,                    /* 0443 stx sp */
+  0x4C,0x0C,0x04,               /* 0445 jmp next */
+  0x20,0x28,0x04,               /* 0448 tload: jsr fetchb */
+  0xA8,                         /* 044B tay */
+  0xA6,0x12,                    /* 044C ldx sp */
+  0xB9,0x20,0x00,               /* 044E lda var,y */
+  0x95,0x80,                    /* 0451 sta stklo,x */
+  0xB9,0x21,0x00,               /* 0453 lda var+1,y */
+  0x95,0xA0,                    /* 0456 sta stkhi,x */
+  0xE8,                         /* 0458 inx */
+  0x86,0x12,                    /* 0459 stx sp */
+  0x4C,0x0C,0x04,               /* 045B jmp next */
+  0x20,0x28,0x04,               /* 045E tstore: jsr fetchb */
+  0xA8,                         /* 0461 tay */
+  0xA6,0x12,                    /* 0462 ldx sp */
+  0xCA,                         /* 0464 dex */
+  0xB5,0x80,                    /* 0465 lda stklo,x */
+  0x99,0x20,0x00,               /* 0467 sta var,y */
+  0xB5,0xA0,                    /* 046A lda stkhi,x */
+  0x99,0x21,0x00,               /* 046C sta var+1,y */
+  0x86,0x12,                    /* 046F stx sp */
+  0x4C,0x0C,0x04,               /* 0471 jmp next */
+  0xA6,0x12,                    /* 0474 tadd: ldx sp */
+  0xCA,                         /* 0476 dex */
+  0x18,                         /* 0477 clc */
+  0xB5,0x7F,                    /* 0478 lda stklo-1,x */
+  0x75,0x80,                    /* 047A adc stklo,x */
+  0x95,0x7F,                    /* 047C sta stklo-1,x */
+  0xB5,0x9F,                    /* 047E lda stkhi-1,x */
+  0x75,0xA0,                    /* 0480 adc stkhi,x */
+  0x95,0x9F,                    /* 0482 sta stkhi-1,x */
+  0x86,0x12,                    /* 0484 stx sp */
+  0x4C,0x0C,0x04,               /* 0486 jmp next */
+  0xA6,0x12,                    /* 0489 tsub: ldx sp */
+  0xCA,                         /* 048B dex */
+  0x38,                         /* 048C sec */
+  0xB5,0x7F,                    /* 048D lda stklo-1,x */
+  0xF5,0x80,                    /* 048F sbc stklo,x */
+  0x95,0x7F,                    /* 0491 sta stklo-1,x */
+  0xB5,0x9F,                    /* 0493 lda stkhi-1,x */
+  0xF5,0xA0,                    /* 0495 sbc stkhi,x */
+  0x95,0x9F,                    /* 0497 sta stkhi-1,x */
+  0x86,0x12,                    /* 0499 stx sp */
+  0x4C,0x0C,0x04,               /* 049B jmp next */
+  0xA6,0x12,                    /* 049E tjnz: ldx sp */
+  0xCA,                         /* 04A0 dex */
+  0x86,0x12,                    /* 04A1 stx sp */
+  0xB5,0x80,                    /* 04A3 lda stklo,x */
+  0x15,0xA0,                    /* 04A5 ora stkhi,x */
+  0xF0,0x0F,                    /* 04A7 beq skip */
+  0x20,0x28,0x04,               /* 04A9 jsr fetchb */
+  0x48,                         /* 04AC pha */
+  0x20,0x28,0x04,               /* 04AD jsr fetchb */
+  0x85,0x11,                    /* 04B0 sta ip+1 */
+  0x68,                         /* 04B2 pla */
+  0x85,0x10,                    /* 04B3 sta ip */
+  0x4C,0x0C,0x04,               /* 04B5 jmp next */
+  0x18,                         /* 04B8 skip: clc */
+  0xA5,0x10,                    /* 04B9 lda ip */
+  0x69,0x02,                    /* 04BB adc #2 */
+  0x85,0x10,                    /* 04BD sta ip */
+  0x90,0x02,                    /* 04BF bcc skipped */
+  0xE6,0x11,                    /* 04C1 inc ip+1 */
+  0x4C,0x0C,0x04,               /* 04C3 skipped: jmp next */
+  0x02,0x00,0x00,0x06,0x00,     /* 04C6 prog: .byte LIT, 0, 0, STORE, S */
+  0x02,0x60,0xEA,0x06,0x02,     /* 04CB .byte LIT, <60000, >60000, STORE, I */
+  0x04,0x00,0x04,0x02,0x08,0x06,0x00,/* 04D0 l20: .byte LOAD, S, LOAD, I, ADD, STORE, S */
+  0x04,0x02,0x02,0x01,0x00,0x0A,0x06,0x02,/* 04D7 .byte LOAD, I, LIT, 1, 0, SUB, STORE, I */
+  0x04,0x02,0x0C,0xD0,0x04,     /* 04DF .byte LOAD, I, JNZ, <l20, >l20 */
+  0x00,                         /* 04E4 .byte END */
+};
+
+
+/* the devices and OS calls the workloads use */
+
+static byte device= 0;
+static byte keys= 0;
+
+static int readIn(M6502 *mpu, word address, byte data)	{ return device++; }
+static int writeOut(M6502 *mpu, word address, byte data)	{ device ^= data;  return 0; }
+
+static int osrdch(M6502 *mpu, word address, byte data)
+{
+  mpu->registers->a= "PRINT \"HELLO WORLD\"\r"[keys++ % 20];
+  return 0;
+}
+
+static int oswrch(M6502 *mpu, word address, byte data)
+{
+  keys ^= mpu->registers->a;
+  return 0;
+}
+
+static void setUpDevices(M6502 *mpu)
+{
+  device= 0;
+  M6502_setCallback(mpu, read,  0xFE00, readIn);
+  M6502_setCallback(mpu, write, 0xFE01, writeOut);
+}
+
+static void setUpTraps(M6502 *mpu)
+{
+  keys= 0;
+  M6502_setCallback(mpu, illegal_instruction, 0x43, osrdch);
+  M6502_setCallback(mpu, illegal_instruction, 0x33, oswrch);
+}
+
+
+static struct workload
+{
+  const char  *name;
+  const byte  *code;
+  size_t       size;
+  void	     (*setUp)(M6502 *mpu);
+  uint64_t     insns;		/* counted by calibrate() */
+  uint32_t     sum;		/* of the final memory and registers */
+} workloads[]= {
+#define workload(NAME, CODE, SETUP)	{ NAME, CODE, sizeof(CODE), SETUP, 0, 0 }
+  workload("alu",	alu,		0),
+  workload("memcpy",	memcpy_,	0),
+  workload("bcd",	bcd,		0),
+  workload("recurse",	recurse,	0),
+  workload("callbacks",	callbacks,	setUpDevices),
+  workload("traps",	traps,		setUpTraps),
+  workload("basic",	basic,		0),
+#undef workload
+};
+
+#define WORKLOADS	(sizeof(workloads) / sizeof(*workloads))
+
+
+static const char *program= 0;
+
+static void fail(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s: ", program);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+
+/* each variant runs mpu to EXIT and answers the number of instructions
+ * it executed, or 0 if it cannot know */
+
+static jmp_buf	finish;
+static int	finished;
+static int	threaded;	/* M6502_run without a trace has no other way out */
+
+static int doExit(M6502 *mpu, word address, byte data)
+{
+  finished= 1;
+  if (mpu->trace)
+    mpu->trace->limit= 0;
+  else if (threaded)
+    longjmp(finish, 1);
+  return 0;
+}
+
+static uint64_t runStep(M6502 *mpu)
+{
+  finished= 0;
+  while (!finished)
+    M6502_step(mpu);
+  return 0;
+}
+
+static uint64_t runThreaded(M6502 *mpu)
+{
+  threaded= 1;
+  if (!setjmp(finish))
+    M6502_run(mpu);
+  threaded= 0;
+  return 0;
+}
+
+static uint64_t runTraced(M6502 *mpu)
+{
+  M6502_trace(mpu)->limit= ~(uint64_t)0;
+  M6502_run(mpu);
+  return mpu->trace->insns;
+}
+
+static M6502_Batch *batch= 0;
+
+static uint64_t runBatch(M6502 *mpu)
+{
+  uint64_t insns= 0;
+  unsigned k;
+
+  M6502_runBatch(batch);
+  for (k= 0;  k < LANES;  ++k)
+    insns += M6502_lane(batch, k)->trace->insns;
+  return insns;
+}
+
+static struct variant
+{
+  const char *name;
+  uint64_t  (*run)(M6502 *mpu);
+  unsigned    lanes;
+} variants[]= {
+  { "step",	runStep,	1 },
+  { "run",	runThreaded,	1 },
+  { "traced",	runTraced,	1 },
+  { "batch",	runBatch,	LANES },
+};
+
+#define VARIANTS	(sizeof(variants) / sizeof(*variants))
+
+
+static M6502 *load(struct workload *w)
+{
+  M6502 *mpu= M6502_new(0, 0, 0);
+
+  if (!mpu)
+    fail("out of memory");
+  memcpy(mpu->memory + ORIGIN, w->code, w->size);
+  M6502_setCallback(mpu, call, EXIT, doExit);
+  if (w->setUp)
+    w->setUp(mpu);
+  mpu->registers->pc= ORIGIN;
+  mpu->registers->s=  0xFF;
+  mpu->registers->p=  0x34;
+  return mpu;
+}
+
+
+static uint32_t checksum(M6502 *mpu)
+{
+  M6502_Registers *r= mpu->registers;
+  uint32_t	   sum= 2166136261u;
+  unsigned	   i;
+
+  for (i= 0;  i < 0x10000;  ++i)
+    sum= (sum ^ mpu->memory[i]) * 16777619u;
+  return sum ^ (r->a << 24) ^ (r->x << 16) ^ (r->y << 8) ^ r->p ^ (r->s << 4) ^ (r->pc << 12);
+}
+
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* hardware counters, where the kernel allows them */
+
+enum { CYCLES, BRANCH_MISSES, L1D_MISSES, COUNTERS };
+
+static const char *counterNames[COUNTERS]= { "cycles", "branch-misses", "l1d-misses" };
+static int	   counters[COUNTERS]= { -1, -1, -1 };
+
+static void openCounters(void)
+{
+#if defined(__linux__)
+  static const struct { uint32_t type;  uint64_t config; } events[COUNTERS]= {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+			  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  };
+  int i;
+
+  for (i= 0;  i < COUNTERS;  ++i)
+    {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size= sizeof(attr);
+      attr.type= events[i].type;
+      attr.config= events[i].config;
+      attr.disabled= 1;
+      attr.exclude_kernel= 1;
+      attr.exclude_hv= 1;
+      counters[i]= syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+static void startCounters(void)
+{
+#if defined(__linux__)
+  int i;
+  for (i= 0;  i < COUNTERS;  ++i)
+    if (counters[i] >= 0)
+      {
+	ioctl(counters[i], PERF_EVENT_IOC_RESET, 0);
+	ioctl(counters[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+}
+
+static void stopCounters(uint64_t counts[COUNTERS])
+{
+  int i;
+  for (i= 0;  i < COUNTERS;  ++i)
+    {
+      counts[i]= 0;
+#if defined(__linux__)
+      if (counters[i] >= 0)
+	{
+	  ioctl(counters[i], PERF_EVENT_IOC_DISABLE, 0);
+	  if (read(counters[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i]))
+	    counts[i]= 0;
+	}
+#endif
+    }
+}
+
+
+struct sample
+{
+  double   mips;
+  uint64_t counts[COUNTERS];
+};
+
+
+/* run w once with v, check where it finished, and answer how fast it got
+ * there */
+
+static struct sample measure(struct workload *w, struct variant *v)
+{
+  M6502	       *mpu= load(w);
+  struct sample sample;
+  uint64_t      insns;
+  double	start;
+
+  if (v->run == runBatch)
+    {
+      M6502_trace(mpu)->limit= ~(uint64_t)0;
+      batch= M6502_newBatch(mpu, LANES);
+    }
+  startCounters();
+  start= now();
+  insns= v->run(mpu);
+  start= now() - start;
+  stopCounters(sample.counts);
+  sample.mips= w->insns * v->lanes / start / 1e6;
+  if (batch)
+    {
+      unsigned k;
+      /* the lanes share the devices, whose state then depends on the
+       * order in which the lanes reach them */
+      for (k= 0;  k < LANES && !w->setUp;  ++k)
+	if (checksum(M6502_lane(batch, k)) != w->sum)
+	  fail("%s: lane %u of the batch finished differently", w->name, k);
+      M6502_deleteBatch(batch);
+      batch= 0;
+      insns /= LANES;
+    }
+  else if (checksum(mpu) != w->sum)
+    fail("%s: %s finished differently", w->name, v->name);
+  if (insns && insns != w->insns)
+    fail("%s: %s executed %llu instructions instead of %llu",
+	 w->name, v->name, (unsigned long long)insns, (unsigned long long)w->insns);
+  M6502_delete(mpu);
+  return sample;
+}
+
+
+static void calibrate(struct workload *w)
+{
+  M6502 *mpu= load(w);
+
+  w->insns= runTraced(mpu);
+  w->sum= checksum(mpu);
+  if (mpu->registers->pc != EXIT)
+    fail("%s: stopped at %04X", w->name, mpu->registers->pc);
+  M6502_delete(mpu);
+}
+
+
+static int compareDoubles(const void *a, const void *b)
+{
+  double x= *(const double *)a, y= *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double median(double *values, int count)
+{
+  qsort(values, count, sizeof(double), compareDoubles);
+  return (count & 1) ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+
+/* the samples for each combination of workload and variant, measured
+ * now or read from the baseline */
+
+struct samples
+{
+  int	  count;
+  double *mips;
+  uint64_t (*counts)[COUNTERS];
+};
+
+static struct samples results[WORKLOADS][VARIANTS];
+static struct samples baseline[WORKLOADS][VARIANTS];
+static char	      baselineKey[256]= "unknown";
+
+
+static void writeResults(const char *path, const char *commit, int cpu)
+{
+  FILE	  *file= fopen(path, "w");
+  unsigned i, j;
+  int	   r, c, first= 1;
+
+  if (!file)
+    fail("%s: cannot create", path);
+  fprintf(file, "{\n  \"commit\": \"%s\",\n  \"compiler\": \"%s\",\n  \"cpu\": %d,\n  \"results\": [\n",
+	  commit, COMPILER, cpu);
+  for (i= 0;  i < WORKLOADS;  ++i)
+    for (j= 0;  j < VARIANTS;  ++j)
+      {
+	struct samples *s= &results[i][j];
+	if (!s->count)
+	  continue;
+	fprintf(file, "%s    { \"workload\": \"%s\", \"variant\": \"%s\", \"insns\": %llu, \"mips\": [",
+		first ? "" : ",\n", workloads[i].name, variants[j].name, (unsigned long long)workloads[i].insns);
+	first= 0;
+	for (r= 0;  r < s->count;  ++r)
+	  fprintf(file, "%s%.3f", r ? ", " : "", s->mips[r]);
+	fprintf(file, "]");
+	for (c= 0;  c < COUNTERS;  ++c)
+	  if (counters[c] >= 0)
+	    {
+	      fprintf(file, ", \"%s\": [", counterNames[c]);
+	      for (r= 0;  r < s->count;  ++r)
+		fprintf(file, "%s%llu", r ? ", " : "", (unsigned long long)s->counts[r][c]);
+	      fprintf(file, "]");
+	    }
+	fprintf(file, " }");
+      }
+  fprintf(file, "\n  ]\n}\n");
+  if (fclose(file))
+    fail("%s: cannot write", path);
+}
+
+
+/* read the results a previous -o wrote (one combination per line) */
+
+static void readBaseline(const char *path)
+{
+  FILE *file= fopen(path, "r");
+  char	line[65536], *p;
+  char	name[64], variant[64];
+  int	commitSeen= 0;
+
+  if (!file)
+    fail("%s: cannot open", path);
+  while (fgets(line, sizeof(line), file))
+    {
+      unsigned i, j;
+      struct samples *s;
+
+      if ((p= strstr(line, "\"commit\": \"")) && !commitSeen)
+	{
+	  sscanf(p + 11, "%200[^\"]", baselineKey);
+	  commitSeen= 1;
+	}
+      if ((p= strstr(line, "\"compiler\": \"")))
+	{
+	  size_t n= strlen(baselineKey);
+	  snprintf(baselineKey + n, sizeof(baselineKey) - n, ", ");
+	  sscanf(p + 13, "%50[^\"]", baselineKey + n + 2);
+	}
+      if (!(p= strstr(line, "\"workload\": \""))
+	  || sscanf(p, "\"workload\": \"%63[^\"]\", \"variant\": \"%63[^\"]\"", name, variant) != 2
+	  || !(p= strstr(line, "\"mips\": [")))
+	continue;
+      for (i= 0;  i < WORKLOADS && strcmp(name, workloads[i].name);  ++i);
+      for (j= 0;  j < VARIANTS  && strcmp(variant, variants[j].name);  ++j);
+      if (i == WORKLOADS || j == VARIANTS)
+	continue;
+      s= &baseline[i][j];
+      p += 9;
+      while (*p && *p != ']')
+	{
+	  char *end;
+	  double mips= strtod(p, &end);
+	  if (end == p)
+	    break;
+	  s->mips= realloc(s->mips, sizeof(double) * (s->count + 1));
+	  s->mips[s->count++]= mips;
+	  for (p= end;  *p == ',' || *p == ' ';  ++p);
+	}
+    }
+  fclose(file);
+}
+
+
+/* the probability that samples y (now) would be this much slower than x
+ * (the baseline) if they came from the same distribution: a one-sided
+ * Mann-Whitney U test, using the normal approximation with a correction
+ * for ties and for continuity */
+
+static double slowerChance(double *x, int n1, double *y, int n2)
+{
+  double  u= 0, mean= n1 * n2 / 2.0, ties= 0, sd;
+  double *all= malloc(sizeof(double) * (n1 + n2));
+  int	  i, j, n= n1 + n2;
+
+  for (i= 0;  i < n1;  ++i)
+    for (j= 0;  j < n2;  ++j)
+      u += (y[j] < x[i]) + 0.5 * (y[j] == x[i]);
+  memcpy(all, x, sizeof(double) * n1);
+  memcpy(all + n1, y, sizeof(double) * n2);
+  qsort(all, n, sizeof(double), compareDoubles);
+  for (i= 0;  i < n;  i= j)
+    {
+      for (j= i + 1;  j < n && all[j] == all[i];  ++j);
+      ties += (double)(j - i) * (j - i) * (j - i) - (j - i);
+    }
+  free(all);
+  sd= sqrt(n1 * n2 / 12.0 * ((n + 1) - ties / ((double)n * (n - 1))));
+  if (sd == 0)
+    return 0.5;
+  return 0.5 * erfc((u - mean - 0.5) / sd / sqrt(2));
+}
+
+
+static int compare(double threshold)
+{
+  unsigned i, j;
+  int	   regressions= 0, compared= 0;
+  double   logRatios= 0;
+
+  printf("\ncompared with %s:\n", baselineKey);
+  for (i= 0;  i < WORKLOADS;  ++i)
+    for (j= 0;  j < VARIANTS;  ++j)
+      {
+	struct samples *now= &results[i][j], *then= &baseline[i][j];
+	double		before, after, change, p;
+	if (!now->count || !then->count)
+	  continue;
+	p= slowerChance(then->mips, then->count, now->mips, now->count);
+	before= median(then->mips, then->count);
+	after=  median(now->mips, now->count);
+	change= (after - before) / before * 100;
+	logRatios += log(after / before);
+	++compared;
+	printf("%-10s %-8s %8.1f -> %8.1f  %+6.1f%%  p=%.4f", workloads[i].name, variants[j].name, before, after, change, p);
+	if (change < -threshold && p < 0.01)
+	  {
+	    printf("  REGRESSION");
+	    ++regressions;
+	  }
+	printf("\n");
+      }
+  if (compared)
+    printf("%-19s %24s  %+6.1f%%\n", "geometric mean", "", (exp(logRatios / compared) - 1) * 100);
+  fflush(stdout);
+  return regressions;
+}
+
+
+static int pin(int cpu)
+{
+  cpu_set_t set;
+  int	    i;
+
+  if (sched_getaffinity(0, sizeof(set), &set))
+    return -1;
+  if (cpu < 0)
+    for (i= 0;  i < CPU_SETSIZE;  ++i)
+      if (CPU_ISSET(i, &set))
+	cpu= i;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set))
+    return -1;
+  return cpu;
+}
+
+
+static void usage(int status)
+{
+  FILE	  *stream= status ? stderr : stdout;
+  unsigned i;
+
+  fprintf(stream, "usage: %s [option ...]\n", program);
+  fprintf(stream, "  -b file      -- compare with the results in file\n");
+  fprintf(stream, "  -c cpu       -- run on cpu (default: the last one allowed)\n");
+  fprintf(stream, "  -h           -- print this message\n");
+  fprintf(stream, "  -k commit    -- record the results as those of commit\n");
+  fprintf(stream, "  -l           -- list the workloads and variants\n");
+  fprintf(stream, "  -o file      -- write the results to file as JSON\n");
+  fprintf(stream, "  -r repeats   -- measure each combination repeats times (default 5)\n");
+  fprintf(stream, "  -s workload  -- write the code of workload (for 0400) to stdout\n");
+  fprintf(stream, "  -t percent   -- slowdown that -b counts as a regression (default 5)\n");
+  fprintf(stream, "  -v variant   -- measure only variant (may be repeated)\n");
+  fprintf(stream, "  -w workload  -- measure only workload (may be repeated)\n");
+  fprintf(stream, "workloads:");
+  for (i= 0;  i < WORKLOADS;  ++i)  fprintf(stream, " %s", workloads[i].name);
+  fprintf(stream, "\nvariants: ");
+  for (i= 0;  i < VARIANTS;  ++i)  fprintf(stream, " %s", variants[i].name);
+  fprintf(stream, "\n");
+  exit(status);
+}
+
+
+int main(int argc, char **argv)
+{
+  int	      cpu= -1, repeats= 5;
+  int	      selectedW[WORKLOADS]= { 0 }, selectedV[VARIANTS]= { 0 }, anyW= 0, anyV= 0;
+  const char *commit= "unknown", *output= 0, *base= 0;
+  double      threshold= 5, *mips;
+  unsigned    i, j;
+  int	      r;
+
+  program= argv[0];
+
+  for (++argv, --argc;  argc > 0;  ++argv, --argc)
+    {
+      if	(!strcmp(*argv, "-h"))	usage(0);
+      else if (!strcmp(*argv, "-l"))	usage(0);
+      else if (argc < 2)		usage(1);
+      else if (!strcmp(*argv, "-b"))	base= *++argv, --argc;
+      else if (!strcmp(*argv, "-c"))	cpu= atoi(*++argv), --argc;
+      else if (!strcmp(*argv, "-k"))	commit= *++argv, --argc;
+      else if (!strcmp(*argv, "-o"))	output= *++argv, --argc;
+      else if (!strcmp(*argv, "-r"))	repeats= atoi(*++argv), --argc;
+      else if (!strcmp(*argv, "-t"))	threshold= atof(*++argv), --argc;
+      else if (!strcmp(*argv, "-s"))
+	{
+	  for (i= 0;  i < WORKLOADS && strcmp(argv[1], workloads[i].name);  ++i);
+	  if (i == WORKLOADS) fail("%s: no such workload", argv[1]);
+	  fwrite(workloads[i].code, 1, workloads[i].size, stdout);
+	  return 0;
+	}
+      else if (!strcmp(*argv, "-w"))
+	{
+	  for (i= 0;  i < WORKLOADS && strcmp(argv[1], workloads[i].name);  ++i);
+	  if (i == WORKLOADS) fail("%s: no such workload", argv[1]);
+	  selectedW[i]= anyW= 1;
+	  ++argv, --argc;
+	}
+      else if (!strcmp(*argv, "-v"))
+	{
+	  for (i= 0;  i < VARIANTS && strcmp(argv[1], variants[i].name);  ++i);
+	  if (i == VARIANTS) fail("%s: no such variant", argv[1]);
+	  selectedV[i]= anyV= 1;
+	  ++argv, --argc;
+	}
+      else
+	usage(1);
+    }
+  if (repeats < 1)
+    fail("repeats must be at least 1");
+  if (base)
+    readBaseline(base);
+
+  if ((cpu= pin(cpu)) < 0)
+    fail("cannot pin to a processor");
+  openCounters();
+  mips= calloc(repeats, sizeof(double));
+
+  printf("%-10s %10s", "workload", "insns");
+  for (j= 0;  j < VARIANTS;  ++j)
+    if (!anyV || selectedV[j])
+      printf(" %8s", variants[j].name);
+  printf("   (MIPS, median of %d on cpu %d)\n", repeats, cpu);
+
+  for (i= 0;  i < WORKLOADS;  ++i)
+    {
+      struct workload *w= &workloads[i];
+      if (anyW && !selectedW[i])
+	continue;
+      calibrate(w);
+      printf("%-10s %10llu", w->name, (unsigned long long)w->insns);
+      fflush(stdout);
+      for (j= 0;  j < VARIANTS;  ++j)
+	{
+	  struct variant *v= &variants[j];
+	  struct samples *s= &results[i][j];
+	  if (anyV && !selectedV[j])
+	    continue;
+	  s->count= repeats;
+	  s->mips= calloc(repeats, sizeof(double));
+	  s->counts= calloc(repeats, sizeof(*s->counts));
+	  measure(w, v);
+	  for (r= 0;  r < repeats;  ++r)
+	    {
+	      struct sample sample= measure(w, v);
+	      s->mips[r]= mips[r]= sample.mips;
+	      memcpy(s->counts[r], sample.counts, sizeof(sample.counts));
+	    }
+	  printf(" %8.1f", median(mips, repeats));
+	  fflush(stdout);
+	}
+      printf("\n");
+    }
+
+  if (output)
+    writeResults(output, commit, cpu);
+  if (base && compare(threshold))
+    fail("slower than %s", baselineKey);
+
+  return 0;
+}
@@ -0,0 +1,438 @@
+/* check6502.c -- differential checking of lib6502 interpreters	-*- C -*- */
+
+/* Copyright (c) 2005 Ian Piumarta
+ *
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the 'Software'),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, provided that the above copyright notice(s) and this
+ * permission notice appear in all copies of the Software and that both the
+ * above copyright notice(s) and this permission notice appear in supporting
+ * documentation.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS'.  USE ENTIRELY AT YOUR OWN RISK.
+ */
+
+/* M6502_check runs an mpu much as M6502_run would, with its own callbacks,
+ * while a shadow copy follows it one interval at a time using another
+ * engine (any function that executes exactly the number of instructions
+ * it is given).  The callbacks the mpu makes during an interval are
+ * recorded: what each returned, the registers it left (which the
+ * interpreter reloads after calls and illegal instructions) and the bytes
+ * of memory it changed.  The shadow's callbacks replay the record rather
+ * than doing anything, so both see the same callback stream and nothing
+ * outside the processor happens twice.  A shadow that makes a callback the
+ * mpu did not (or misses one it did) has diverged.
+ *
+ * The registers and memory are compared after each interval.  On a
+ * mismatch the interval is bisected: two more instances start from the
+ * copy of the mpu taken at its beginning, one running the traced
+ * interpreter (which is what ran the mpu) and one the candidate engine,
+ * both replaying the record, until the instruction after which they
+ * first differ is found.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+struct event			/* a callback made by the mpu */
+{
+  int		  kind;		/* M6502_ReadCallback etc. */
+  word		  address;
+  byte		  data;
+  int		  result;
+  M6502_Registers registers;	/* as it left them */
+  unsigned	  first;	/* the memory it changed, in changes[] */
+  unsigned	  count;
+};
+
+struct change
+{
+  word		  address;
+  byte		  value;
+};
+
+struct shadow			/* an instance replaying the callbacks */
+{
+  M6502		 *mpu;
+  unsigned	  next;		/* the event it expects next */
+  char		  diverged[128];	/* how its callbacks differed from the record, if they did */
+};
+
+struct _M6502_Check
+{
+  M6502		 *mpu;		/* running for real ... */
+  M6502_Callbacks *callbacks;	/* ... its own callbacks, while it runs with these instead */
+  M6502_Callbacks *recorders;
+  struct event	 *events;	/* what they did during this interval */
+  unsigned	  nevents, maxEvents;
+  struct change	 *changes;
+  unsigned	  nchanges, maxChanges;
+  byte		  before[0x10000];	/* memory as the current callback found it */
+  byte		  stale[0x100];		/* pages of before that might be out of date,
+					 * besides those in the trace's dirty map */
+  byte		  held[0x100];		/* the dirty map as the client left it, while
+					 * the trace marks only pages written since
+					 * the last callback */
+  byte		  start[0x10000];	/* memory at the start of the interval */
+  M6502_Registers registers;		/* ... and registers */
+  struct shadow	  shadow;		/* follows the mpu with the candidate engine */
+  struct shadow	  reference;		/* these two replay an interval to bisect it */
+  struct shadow	  candidate;
+};
+
+static const char *kinds[]= { "read", "write", "call", "illegal" };
+
+
+static void *allocate(void *p, size_t size)
+{
+  if (!(p= p ? realloc(p, size) : calloc(1, size)))
+    {
+      fflush(stdout);
+      fprintf(stderr, "\nout of memory\n");
+      abort();
+    }
+  return p;
+}
+
+
+void M6502_stepEngine(M6502 *mpu, unsigned insns)
+{
+  while (insns--)
+    M6502_step(mpu);
+}
+
+
+void M6502_traceEngine(M6502 *mpu, unsigned insns)
+{
+  M6502_Trace *trace= M6502_trace(mpu);
+  uint64_t     limit= trace->limit;
+  int	     (*expired)(M6502 *)= trace->expired;
+
+  trace->limit= trace->insns + insns;
+  trace->expired= 0;
+  M6502_run(mpu);
+  trace->limit= limit;
+  trace->expired= expired;
+}
+
+
+/* the mpu's callbacks */
+
+static int record(M6502 *mpu, int kind, M6502_Callback callback, word address, byte data)
+{
+  M6502_Check  *check= mpu->check;
+  M6502_Trace  *trace= mpu->trace;
+  struct event *event;
+  unsigned      page, i;
+  int		result;
+
+  /* bring before up to date where memory has changed since the last
+   * callback, and give the callback the client's dirty map */
+  for (page= 0;  page < 0x100;  ++page)
+    {
+      if (trace->dirty[page] || check->stale[page])
+	{
+	  memcpy(check->before + (page << 8), mpu->memory + (page << 8), 0x100);
+	  check->stale[page]= 0;
+	}
+      trace->dirty[page] |= check->held[page];
+    }
+  result= callback(mpu, address, data);
+
+  if (check->nevents == check->maxEvents)
+    {
+      check->maxEvents= check->maxEvents ? check->maxEvents * 2 : 256;
+      check->events= allocate(check->events, check->maxEvents * sizeof(struct event));
+    }
+  event= &check->events[check->nevents++];
+  event->kind=	    kind;
+  event->address=   address;
+  event->data=	    data;
+  event->result=    result;
+  event->registers= *mpu->registers;
+  event->first=	    check->nchanges;
+
+  /* it can have changed only the pages now in the dirty map (callbacks that
+   * store into memory directly mark them) and the byte it was given to write */
+  if (kind == M6502_WriteCallback)
+    trace->dirty[address >> 8]= 1;
+  for (page= 0;  page < 0x100;  ++page)
+    if (trace->dirty[page] && memcmp(mpu->memory + (page << 8), check->before + (page << 8), 0x100))
+      {
+	check->stale[page]= 1;
+	for (i= page << 8;  i < (page << 8) + 0x100;  ++i)
+	  if (mpu->memory[i] != check->before[i])
+	    {
+	      if (check->nchanges == check->maxChanges)
+		{
+		  check->maxChanges= check->maxChanges ? check->maxChanges * 2 : 256;
+		  check->changes= allocate(check->changes, check->maxChanges * sizeof(struct change));
+		}
+	      check->changes[check->nchanges].address= i;
+	      check->changes[check->nchanges].value=   mpu->memory[i];
+	      ++check->nchanges;
+	    }
+      }
+  event->count= check->nchanges - event->first;
+
+  for (page= 0;  page < 0x100;  ++page)
+    check->held[page] |= trace->dirty[page];
+  memset(trace->dirty, 0, sizeof(trace->dirty));
+  return result;
+}
+
+static int recordRead(M6502 *mpu, word address, byte data)	{ return record(mpu, M6502_ReadCallback,    mpu->check->callbacks->read[address],		address, data); }
+static int recordWrite(M6502 *mpu, word address, byte data)	{ return record(mpu, M6502_WriteCallback,   mpu->check->callbacks->write[address],		address, data); }
+static int recordIllegal(M6502 *mpu, word address, byte data)	{ return record(mpu, M6502_IllegalCallback, mpu->check->callbacks->illegal_instruction[data], address, data); }
+
+/* brk passes its own address, not that of the handler it is calling */
+
+static int recordCall(M6502 *mpu, word address, byte data)
+{
+  M6502_Callback *call= mpu->check->callbacks->call;
+  return record(mpu, M6502_CallCallback, call[address] ? call[address] : call[M6502_getVector(mpu, IRQ)], address, data);
+}
+
+
+/* the shadows' callbacks */
+
+static int replay(M6502 *mpu, int kind, word address, byte data)
+{
+  M6502_Check	*check= mpu->check;
+  struct shadow *shadow= (mpu == check->shadow.mpu)    ? &check->shadow
+		       : (mpu == check->reference.mpu) ? &check->reference
+		       :				 &check->candidate;
+  struct event	*event;
+  unsigned	 i;
+
+  if (*shadow->diverged)
+    return 0;
+  if (shadow->next == check->nevents)
+    {
+      sprintf(shadow->diverged, "made an extra callback (%s %04X, data %02X)", kinds[kind], address, data);
+      return 0;
+    }
+  event= &check->events[shadow->next++];
+  if (event->kind != kind || event->address != address || event->data != data)
+    {
+      sprintf(shadow->diverged, "made a callback (%s %04X, data %02X) where the mpu made (%s %04X, data %02X)",
+	      kinds[kind], address, data, kinds[event->kind], event->address, event->data);
+      return 0;
+    }
+  for (i= event->first;  i < event->first + event->count;  ++i)
+    mpu->memory[check->changes[i].address]= check->changes[i].value;
+  if (kind == M6502_CallCallback || kind == M6502_IllegalCallback)
+    *mpu->registers= event->registers;
+  return event->result;
+}
+
+static int replayRead(M6502 *mpu, word address, byte data)	{ return replay(mpu, M6502_ReadCallback,    address, data); }
+static int replayWrite(M6502 *mpu, word address, byte data)	{ return replay(mpu, M6502_WriteCallback,   address, data); }
+static int replayCall(M6502 *mpu, word address, byte data)	{ return replay(mpu, M6502_CallCallback,    address, data); }
+static int replayIllegal(M6502 *mpu, word address, byte data)	{ return replay(mpu, M6502_IllegalCallback, address, data); }
+
+
+/* fill callbacks with the given functions wherever the mpu has its own */
+
+static void intercept(M6502_Callbacks *callbacks, M6502_Callbacks *own,
+		      M6502_Callback read, M6502_Callback write, M6502_Callback call, M6502_Callback illegal)
+{
+  unsigned i;
+  for (i= 0;  i < 0x10000;  ++i)
+    {
+      callbacks->read [i]= own->read [i] ? read  : 0;
+      callbacks->write[i]= own->write[i] ? write : 0;
+      callbacks->call [i]= own->call [i] ? call  : 0;
+    }
+  for (i= 0;  i < 0x100;  ++i)
+    callbacks->illegal_instruction[i]= own->illegal_instruction[i] ? illegal : 0;
+}
+
+
+static void newShadow(M6502_Check *check, struct shadow *shadow)
+{
+  shadow->mpu= M6502_new(0, 0, 0);
+  shadow->mpu->check= check;
+  intercept(shadow->mpu->callbacks, check->callbacks, replayRead, replayWrite, replayCall, replayIllegal);
+}
+
+
+/* start a shadow from the mpu's state at the beginning of the interval */
+
+static void restart(M6502_Check *check, struct shadow *shadow)
+{
+  memcpy(shadow->mpu->memory, check->start, sizeof(check->start));
+  *shadow->mpu->registers= check->registers;
+  shadow->next= 0;
+  *shadow->diverged= '\0';
+}
+
+
+static int differ(M6502 *a, M6502 *b)
+{
+  M6502_Registers *r= a->registers, *s= b->registers;
+  return r->a != s->a || r->x != s->x || r->y != s->y || r->p != s->p || r->s != s->s || r->pc != s->pc
+      || memcmp(a->memory, b->memory, 0x10000);
+}
+
+
+static int differAfter(M6502_Check *check, M6502_Engine engine, unsigned insns)
+{
+  restart(check, &check->reference);
+  restart(check, &check->candidate);
+  M6502_traceEngine(check->reference.mpu, insns);
+  engine(check->candidate.mpu, insns);
+  return *check->reference.diverged || *check->candidate.diverged
+      || check->reference.next != check->candidate.next
+      || differ(check->reference.mpu, check->candidate.mpu);
+}
+
+
+static void report(M6502_Check *check, M6502_Engine engine, unsigned insns, uint64_t number, FILE *stream)
+{
+  M6502	  *reference= check->reference.mpu, *candidate= check->candidate.mpu;
+  char	   state[64], insn[64];
+  word	   pc;
+  int	   size, i;
+  unsigned address, shown= 0;
+
+  differAfter(check, engine, insns - 1);
+  pc= reference->registers->pc;
+  size= M6502_disassemble(reference, pc, insn);
+  M6502_dump(reference, state);
+  fprintf(stream, "engines diverge at instruction %llu\n", (unsigned long long)number);
+  fprintf(stream, "  before:    %s\n", state);
+  fprintf(stream, "  executing: %04X ", pc);
+  for (i= 0;  i < 3;  ++i)
+    fprintf(stream, (i < size) ? " %02X" : "   ", reference->memory[(word)(pc + i)]);
+  fprintf(stream, "  %s\n", insn);
+
+  differAfter(check, engine, insns);
+  M6502_dump(reference, state);
+  fprintf(stream, "  reference: %s\n", state);
+  M6502_dump(candidate, state);
+  fprintf(stream, "  candidate: %s\n", state);
+  for (address= 0;  address < 0x10000;  ++address)
+    if (reference->memory[address] != candidate->memory[address] && shown++ < 8)
+      fprintf(stream, "  memory:    %04X reference %02X candidate %02X\n",
+	      address, reference->memory[address], candidate->memory[address]);
+  if (shown > 8)
+    fprintf(stream, "  memory:    ... %u bytes differ in all\n", shown);
+  if (*check->reference.diverged)
+    fprintf(stream, "  reference %s\n", check->reference.diverged);
+  if (*check->candidate.diverged)
+    fprintf(stream, "  candidate %s\n", check->candidate.diverged);
+  if (check->reference.next != check->candidate.next)
+    fprintf(stream, "  callbacks: reference made %u, candidate %u\n", check->reference.next, check->candidate.next);
+}
+
+
+/* the engines agree after no instructions of the interval and not after
+ * all of them: find the first instruction after which they differ */
+
+static uint64_t bisect(M6502_Check *check, M6502_Engine engine, unsigned insns, uint64_t base, FILE *stream)
+{
+  unsigned agree= 0, disagree= insns;
+  while (disagree - agree > 1)
+    {
+      unsigned middle= agree + (disagree - agree) / 2;
+      if (differAfter(check, engine, middle))
+	disagree= middle;
+      else
+	agree= middle;
+    }
+  if (stream)
+    report(check, engine, disagree, base + disagree, stream);
+  return base + disagree;
+}
+
+
+uint64_t M6502_check(M6502 *mpu, M6502_Engine engine, unsigned interval, FILE *stream)
+{
+  M6502_Trace *trace= M6502_trace(mpu);
+  M6502_Check *check= allocate(0, sizeof(M6502_Check));
+  uint64_t     diverged= 0;
+  unsigned     page;
+
+  check->mpu=	    mpu;
+  check->callbacks= mpu->callbacks;
+  check->recorders= allocate(0, sizeof(M6502_Callbacks));
+  intercept(check->recorders, check->callbacks, recordRead, recordWrite, recordCall, recordIllegal);
+  newShadow(check, &check->shadow);
+  newShadow(check, &check->reference);
+  newShadow(check, &check->candidate);
+  memcpy(check->shadow.mpu->memory, mpu->memory, 0x10000);
+  *check->shadow.mpu->registers= *mpu->registers;
+  memset(check->stale, 1, sizeof(check->stale));
+  if (!interval)
+    interval= 1;
+
+  while (!diverged)
+    {
+      uint64_t base=  trace->insns;
+      uint64_t limit= trace->limit;
+      uint64_t end;
+      int    (*expired)(M6502 *)= trace->expired;
+      unsigned insns;
+
+      if (base >= limit)
+	{
+	  if (!expired || !expired(mpu))
+	    break;
+	  /* which may have changed anything, so the shadow starts again */
+	  memcpy(check->shadow.mpu->memory, mpu->memory, 0x10000);
+	  *check->shadow.mpu->registers= *mpu->registers;
+	  memset(check->stale, 1, sizeof(check->stale));
+	  continue;
+	}
+
+      memcpy(check->start, mpu->memory, sizeof(check->start));
+      check->registers= *mpu->registers;
+      check->nevents= check->nchanges= 0;
+      check->shadow.next= 0;
+      memcpy(check->held, trace->dirty, sizeof(check->held));
+      memset(trace->dirty, 0, sizeof(trace->dirty));
+
+      end= base + ((limit - base < interval) ? limit - base : interval);
+      trace->limit=   end;
+      trace->expired= 0;
+      mpu->callbacks= check->recorders;
+      mpu->check=     check;
+      M6502_run(mpu);
+      mpu->callbacks= check->callbacks;
+      mpu->check=     0;
+      for (page= 0;  page < 0x100;  ++page)
+	{
+	  check->stale[page] |= trace->dirty[page];
+	  trace->dirty[page] |= check->held[page];
+	}
+      if (trace->limit == end)		/* unless a callback moved it */
+	trace->limit= limit;
+      trace->expired= expired;
+      insns= trace->insns - base;
+
+      engine(check->shadow.mpu, insns);
+      if (*check->shadow.diverged || check->shadow.next != check->nevents || differ(mpu, check->shadow.mpu))
+	diverged= bisect(check, engine, insns, base, stream);
+    }
+
+  M6502_delete(check->shadow.mpu);
+  M6502_delete(check->reference.mpu);
+  M6502_delete(check->candidate.mpu);
+  free(check->recorders);
+  free(check->events);
+  free(check->changes);
+  free(check);
+  return diverged;
+}
@@ -0,0 +1,135 @@
+/* cover6502.c -- execution coverage for lib6502	-*- C -*- */
+
+/* Copyright (c) 2005 Ian Piumarta
+ *
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the 'Software'),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, provided that the above copyright notice(s) and this
+ * permission notice appear in all copies of the Software and that both the
+ * above copyright notice(s) and this permission notice appear in supporting
+ * documentation.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS'.  USE ENTIRELY AT YOUR OWN RISK.
+ */
+
+/* Coverage is gathered by the traced interpreter (see runTraced in
+ * lib6502.c), which sets a bit for each opcode it executes and for each
+ * outcome of each branch, jump and call.  Saved coverage is just those
+ * three bitmaps after a short header, so coverage from any number of
+ * runs is merged by ORing them together (M6502_loadCoverage does this
+ * into the coverage it is given).  The text form lists runs of executed
+ * addresses and, per branch, the number of times it was taken and not
+ * taken; its lines are independent and can be merged by summing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lib6502.h"
+
+static const char magic[8]= "6502cov1";
+
+#define bit(MAP, ADDR)	(((MAP)[(ADDR) >> 3] >> ((ADDR) & 7)) & 1)
+
+
+static void *allocate(size_t size)
+{
+  void *p= calloc(1, size);
+  if (!p)
+    {
+      fflush(stdout);
+      fprintf(stderr, "\nout of memory\n");
+      abort();
+    }
+  return p;
+}
+
+
+M6502_Coverage *M6502_coverage(M6502 *mpu, int flags)
+{
+  M6502_Trace *trace= M6502_trace(mpu);
+
+  if (!trace->coverage)
+    trace->coverage= allocate(sizeof(M6502_Coverage));
+  if ((flags & M6502_CoverCounts) && !trace->coverage->counts)
+    trace->coverage->counts= allocate(0x10000 * sizeof(*trace->coverage->counts));
+  if ((flags & M6502_CoverEdges) && !trace->coverage->edges)
+    trace->coverage->edges= allocate(0x10000);
+  return trace->coverage;
+}
+
+
+int M6502_saveCoverage(M6502_Coverage *coverage, const char *path)
+{
+  FILE *file= fopen(path, "wb");
+  int   ok;
+  if (!file)
+    return 0;
+  ok= (   (1 == fwrite(magic,		     sizeof(magic),		 1, file))
+       && (1 == fwrite(coverage->executed, sizeof(coverage->executed), 1, file))
+       && (1 == fwrite(coverage->taken,	     sizeof(coverage->taken),	 1, file))
+       && (1 == fwrite(coverage->notTaken, sizeof(coverage->notTaken), 1, file)));
+  return !fclose(file) && ok;
+}
+
+
+int M6502_loadCoverage(M6502_Coverage *coverage, const char *path)
+{
+  FILE	 *file= fopen(path, "rb");
+  uint8_t header[sizeof(magic)], bits[3][0x2000];
+  int	  i, ok;
+
+  if (!file)
+    return 0;
+  ok= (   (1 == fread(header, sizeof(header), 1, file))
+       && (1 == fread(bits,   sizeof(bits),   1, file)));
+  fclose(file);
+  if (ok && memcmp(header, magic, sizeof(magic)))
+    {
+      errno= EINVAL;
+      ok= 0;
+    }
+  if (!ok)
+    return 0;
+
+  for (i= 0;  i < 0x2000;  ++i)
+    {
+      coverage->executed[i] |= bits[0][i];
+      coverage->taken	[i] |= bits[1][i];
+      coverage->notTaken[i] |= bits[2][i];
+    }
+  return 1;
+}
+
+
+void M6502_printCoverage(M6502_Coverage *coverage, FILE *stream)
+{
+  unsigned addr, first;
+
+  for (addr= 0;  addr < 0x10000;  )
+    if (bit(coverage->executed, addr))
+      {
+	for (first= addr;  addr < 0x10000 && bit(coverage->executed, addr);  ++addr)
+	  ;
+	fprintf(stream, "X %04X %04X\n", first, addr - 1);
+      }
+    else
+      ++addr;
+
+  for (addr= 0;  addr < 0x10000;  ++addr)
+    if (bit(coverage->taken, addr) || bit(coverage->notTaken, addr))
+      {
+	if (coverage->counts)
+	  fprintf(stream, "B %04X %lu %lu\n", addr,
+		  (unsigned long)coverage->counts[addr][1], (unsigned long)coverage->counts[addr][0]);
+	else
+	  fprintf(stream, "B %04X %d %d\n", addr, bit(coverage->taken, addr), bit(coverage->notTaken, addr));
+      }
+}
@@ -0,0 +1,821 @@
+/* debug6502.c -- breakpoints, watchpoints and history for lib6502	-*- C -*- */
+
+/* Copyright (c) 2005 Ian Piumarta
+ *
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the 'Software'),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, provided that the above copyright notice(s) and this
+ * permission notice appear in all copies of the Software and that both the
+ * above copyright notice(s) and this permission notice appear in supporting
+ * documentation.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS'.  USE ENTIRELY AT YOUR OWN RISK.
+ */
+
+/* Everything here is built from the ordinary callback tables, so the
+ * interpreter never tests for a breakpoint: only the addresses being
+ * watched leave the fast path.
+ *
+ *   - a breakpoint replaces the opcode at its address with
+ *     M6502_BreakOpcode, whose illegal_instruction callback runs the
+ *     handler and then single-steps the original instruction;
+ *   - read and write callbacks on a breakpoint address hide the planted
+ *     opcode from the program and keep track of writes to it;
+ *   - a watchpoint is a read or write callback that completes the access
+ *     (through any callback it displaced) and then calls the handler.
+ *
+ * History (for reverse execution) is a series of checkpoints taken by the
+ * traced interpreter every `interval' instructions.  The first holds all
+ * of memory, the others only the pages written since the one before.
+ * Everything else the program depends on comes from callbacks, so while
+ * history is kept every client callback runs through invoke(), which logs
+ * the value it returned and the registers and memory it changed.  Going
+ * backwards restores the nearest earlier checkpoint and replays forwards
+ * to the target, answering callbacks from the log instead of calling
+ * them.  When the checkpoints outgrow their budget the oldest two are
+ * merged (and the log before them discarded).
+ *
+ * BUGS:
+ *   - addressing modes read operands and pointers directly from memory,
+ *     so they see the planted opcode rather than the original byte
+ *   - direct writes to memory (by the stack, or by clients) do not update
+ *     the byte hidden under a breakpoint
+ *   - callbacks installed over a watched address after the watchpoint
+ *     was set silently replace it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+struct _M6502_Debug
+{
+  M6502_CallbackTable exec;		/* breakpoint handlers */
+  M6502_CallbackTable read;		/* read watchpoint handlers */
+  M6502_CallbackTable write;		/* write watchpoint handlers */
+  M6502_CallbackTable oldRead;		/* callbacks displaced by the above */
+  M6502_CallbackTable oldWrite;
+  M6502_CallbackTable oldCall;		/* call callbacks logged for history */
+  M6502_IllegalInstructionCallbackTable oldIllegal;
+  byte		      original[0x10000];	/* opcodes hidden by breakpoints */
+  byte		      armed[0x10000];	/* non-zero where an opcode is hidden */
+  int		      busy;		/* non-zero while a handler runs */
+  unsigned	      current;		/* breakpoint whose handler runs, plus one */
+  struct history     *history;		/* for reverse execution, if any */
+};
+
+typedef struct
+{
+  byte number;
+  byte data[0x100];
+} Page;
+
+struct checkpoint
+{
+  uint64_t	  insns;	/* instructions executed before it was taken */
+  M6502_Registers registers;
+  size_t	  logpos;	/* callbacks logged before it was taken */
+  int		  npages;
+  Page		 *pages;	/* written since the previous checkpoint */
+};
+
+struct event
+{
+  uint64_t	  insns;	/* instruction that made the callback */
+  word		  address;
+  int		  value;	/* returned by the callback */
+  M6502_Registers registers;	/* as the callback left them */
+  int		  npages;
+  Page		 *pages;	/* changed by the callback */
+};
+
+struct history
+{
+  unsigned	     interval;	/* instructions between checkpoints */
+  size_t	     budget;	/* bytes of pages to keep */
+  size_t	     used;
+  struct checkpoint *checkpoints;
+  int		     ncheckpoints, maxcheckpoints;
+  struct event	    *log;
+  size_t	     loglen, logpos, logmax;
+  uint64_t	     next;	/* insns at the next checkpoint */
+  uint64_t	     target;	/* insns at which a replay stops */
+  uint64_t	     resume;	/* insns reached by the last reverse step */
+  int		     seeking;	/* non-zero while replaying */
+  int		     hits;	/* breakpoints and watchpoints passed while seeking */
+  uint64_t	     lastHit;
+  uint64_t	     limit;	/* the client's trace limit */
+  uint64_t	     ours;	/* what the trace limit was last set to */
+  int		   (*expired)(M6502 *mpu);	/* the client's expiry handler */
+  byte		     shadow[0x10000];	/* memory before a live callback */
+  byte		     stale[0x100];	/* pages of shadow that might be out of date,
+					 * besides those in trace->dirty */
+};
+
+/* memory has changed somewhere other than in the interpreter (which
+ * M6502_check, finding what a callback changed, learns from the trace) */
+#define touched(MPU, ADDRESS)								\
+  ((MPU)->trace ? (void)((MPU)->trace->dirty[(ADDRESS) >> 8]= 1) : (void)0,			\
+   (MPU)->debug->history ? (void)((MPU)->debug->history->stale[(ADDRESS) >> 8]= 1) : (void)0)
+
+
+static int debugTrap(M6502 *mpu, word address, byte data);
+
+
+static void outOfMemory(void)
+{
+  fflush(stdout);
+  fprintf(stderr, "\nout of memory\n");
+  abort();
+}
+
+
+static void *allocate(size_t size)
+{
+  void *p= calloc(1, size);
+  if (!p) outOfMemory();
+  return p;
+}
+
+
+static M6502_Debug *debug(M6502 *mpu)
+{
+  M6502_Debug *d= mpu->debug;
+  if (!d)
+    {
+      d= allocate(sizeof(M6502_Debug));
+      d->oldIllegal[M6502_BreakOpcode]= mpu->callbacks->illegal_instruction[M6502_BreakOpcode];
+      mpu->callbacks->illegal_instruction[M6502_BreakOpcode]= debugTrap;
+      mpu->debug= d;
+    }
+  return d;
+}
+
+
+static void arm(M6502 *mpu, word address)
+{
+  M6502_Debug *d= mpu->debug;
+  d->original[address]= mpu->memory[address];
+  mpu->memory[address]= M6502_BreakOpcode;
+  touched(mpu, address);
+  d->armed[address]= 1;
+}
+
+
+static void disarm(M6502 *mpu, word address)
+{
+  M6502_Debug *d= mpu->debug;
+  mpu->memory[address]= d->original[address];
+  d->armed[address]= 0;
+  touched(mpu, address);
+}
+
+
+/* copy a page of memory without the opcodes planted by breakpoints */
+
+static void savePage(M6502 *mpu, Page *page, int number)
+{
+  M6502_Debug *d= mpu->debug;
+  unsigned address= number << 8, i;
+
+  page->number= number;
+  memcpy(page->data, mpu->memory + address, 0x100);
+  for (i= 0;  i < 0x100;  ++i)
+    if (d->armed[address + i])
+      page->data[i]= d->original[address + i];
+}
+
+
+/* put a page back into memory, replanting the opcodes */
+
+static void loadPage(M6502 *mpu, Page *page)
+{
+  M6502_Debug *d= mpu->debug;
+  unsigned address= page->number << 8, i;
+
+  memcpy(mpu->memory + address, page->data, 0x100);
+  touched(mpu, address);
+  for (i= 0;  i < 0x100;  ++i)
+    if (d->armed[address + i])
+      arm(mpu, address + i);
+}
+
+
+static void forget(struct history *h, size_t from)
+{
+  size_t i;
+  for (i= from;  i < h->loglen;  ++i)
+    {
+      h->used -= h->log[i].npages * sizeof(Page);
+      free(h->log[i].pages);
+    }
+  h->loglen= from;
+}
+
+
+/* call a client callback, logging its effects (or replaying them) when
+ * history is being kept */
+
+static int invoke(M6502 *mpu, M6502_Callback callback, word address, byte data)
+{
+  struct history *h= mpu->debug->history;
+  M6502_Trace	 *trace= mpu->trace;
+  struct event	 *e;
+  byte		  changed[0x100];
+  int		  i, n= 0, value;
+
+  if (!h)
+    return callback(mpu, address, data);
+
+  if (h->logpos < h->loglen)
+    {
+      e= &h->log[h->logpos];
+      if (e->insns == trace->insns && e->address == address)
+	{
+	  ++h->logpos;
+	  *mpu->registers= e->registers;
+	  for (i= 0;  i < e->npages;  ++i)
+	    {
+	      loadPage(mpu, &e->pages[i]);
+	      trace->dirty[e->pages[i].number]= 1;
+	    }
+	  return e->value;
+	}
+      forget(h, h->logpos);	/* the program has taken another path */
+    }
+
+  /* bring the shadow up to date where memory might have changed since the
+   * last callback; the comparison afterwards then finds what this one
+   * changed (it can write anywhere, directly, so every page is looked at) */
+  for (i= 0;  i < 0x100;  ++i)
+    if (trace->dirty[i] || h->stale[i])
+      {
+	memcpy(h->shadow + (i << 8), mpu->memory + (i << 8), 0x100);
+	h->stale[i]= 0;
+      }
+  value= callback(mpu, address, data);
+
+  if (h->loglen == h->logmax)
+    {
+      h->logmax= h->logmax ? h->logmax * 2 : 1024;
+      if (!(h->log= realloc(h->log, h->logmax * sizeof(struct event))))
+	outOfMemory();
+    }
+  e= &h->log[h->loglen];
+  e->insns= trace->insns;
+  e->address= address;
+  e->value= value;
+  e->registers= *mpu->registers;
+  e->npages= 0;
+  e->pages= 0;
+  for (i= 0;  i < 0x100;  ++i)
+    if (memcmp(h->shadow + (i << 8), mpu->memory + (i << 8), 0x100))
+      changed[n++]= i;
+  if (n)
+    e->pages= allocate(n * sizeof(Page));
+  for (i= 0;  i < n;  ++i)
+    {
+      savePage(mpu, &e->pages[e->npages++], changed[i]);
+      trace->dirty[changed[i]]= 1;
+      h->stale[changed[i]]= 1;
+    }
+  h->used += e->npages * sizeof(Page);
+  h->logpos= ++h->loglen;
+
+  return value;
+}
+
+
+/* a breakpoint or watchpoint has been reached: answer whether its handler
+ * should be called */
+
+static int hit(M6502 *mpu)
+{
+  M6502_Debug	 *d= mpu->debug;
+  struct history *h= d->history;
+
+  if (h && h->seeking)
+    {
+      ++h->hits;
+      h->lastHit= mpu->trace->insns;
+      return 0;
+    }
+  if (h && h->resume == mpu->trace->insns)
+    return 0;
+  return !d->busy;
+}
+
+
+static int watched(M6502 *mpu, M6502_Callback handler, word address, byte data)
+{
+  M6502_Debug *d= mpu->debug;
+  if (hit(mpu))
+    {
+      d->busy= 1;
+      handler(mpu, address, data);
+      d->busy= 0;
+    }
+  return 0;
+}
+
+
+static int debugRead(M6502 *mpu, word address, byte data)
+{
+  M6502_Debug *d= mpu->debug;
+  int value;
+
+  if	  (d->oldRead[address])	value= invoke(mpu, d->oldRead[address], address, data);
+  else if (d->armed[address])	value= d->original[address];
+  else				value= mpu->memory[address];
+
+  if (d->read[address])
+    watched(mpu, d->read[address], address, value);
+
+  return value;
+}
+
+
+static int debugWrite(M6502 *mpu, word address, byte data)
+{
+  M6502_Debug *d= mpu->debug;
+
+  if (d->oldWrite[address])
+    {
+      /* let the displaced callback see (and modify) the real byte */
+      int armed= d->armed[address];
+      if (armed) disarm(mpu, address);
+      invoke(mpu, d->oldWrite[address], address, data);
+      if (armed) arm(mpu, address);
+    }
+  else if (d->armed[address])
+    d->original[address]= data;
+  else
+    mpu->memory[address]= data;
+  touched(mpu, address);
+
+  if (d->write[address])
+    watched(mpu, d->write[address], address, data);
+
+  return 0;
+}
+
+
+static int debugCall(M6502 *mpu, word address, byte data)
+{
+  return invoke(mpu, mpu->debug->oldCall[address], address, data);
+}
+
+
+static int debugTrap(M6502 *mpu, word address, byte data)
+{
+  M6502_Debug	 *d= mpu->debug;
+  M6502_Callback  handler= d->exec[address];
+  word		  pc= 0;
+
+  if (data != M6502_BreakOpcode || !d->armed[address])	/* a genuine illegal instruction */
+    return d->oldIllegal[data] ? invoke(mpu, d->oldIllegal[data], address, data) : 0;
+
+  disarm(mpu, address);
+  mpu->registers->pc= address;
+  if (hit(mpu))
+    {
+      d->busy= 1;
+      d->current= address + 1;
+      pc= handler(mpu, address, mpu->memory[address]);
+      d->current= 0;
+      d->busy= 0;
+    }
+  if (!pc)
+    {
+      M6502_step(mpu);
+      pc= mpu->registers->pc;
+    }
+  if (d->exec[address] && !d->armed[address])	/* the handler can clear it */
+    arm(mpu, address);
+  if (mpu->trace)
+    --mpu->trace->insns;	/* the interpreter counts this trap as well */
+
+  return pc;
+}
+
+
+/* route reads and writes of address through the debugger */
+
+static void intercept(M6502 *mpu, word address)
+{
+  M6502_Debug *d= mpu->debug;
+  if (mpu->callbacks->read[address] != debugRead)
+    {
+      d->oldRead[address]= mpu->callbacks->read[address];
+      mpu->callbacks->read[address]= debugRead;
+    }
+  if (mpu->callbacks->write[address] != debugWrite)
+    {
+      d->oldWrite[address]= mpu->callbacks->write[address];
+      mpu->callbacks->write[address]= debugWrite;
+    }
+}
+
+
+/* give address back to the callbacks it had before intercept() */
+
+static void release(M6502 *mpu, word address)
+{
+  M6502_Debug *d= mpu->debug;
+  if (d->exec[address] || d->read[address] || d->write[address] || d->armed[address]
+      || (d->history && (d->oldRead[address] || d->oldWrite[address])))
+    return;
+  if (mpu->callbacks->read[address] == debugRead)
+    mpu->callbacks->read[address]= d->oldRead[address];
+  if (mpu->callbacks->write[address] == debugWrite)
+    mpu->callbacks->write[address]= d->oldWrite[address];
+  d->oldRead[address]= d->oldWrite[address]= 0;
+}
+
+
+/* take the debugger out of copies of the memory and callbacks of mpu
+ * (used by M6502_clone, whose clones have no breakpoints or history) */
+
+void M6502_undebug(M6502 *mpu, byte *memory, M6502_Callbacks *callbacks)
+{
+  M6502_Debug *d= mpu->debug;
+  unsigned     address;
+  int	       i;
+
+  for (address= 0;  address < 0x10000;  ++address)
+    {
+      if (d->armed[address])			memory[address]= d->original[address];
+      if (callbacks->read[address] == debugRead)	callbacks->read[address]= d->oldRead[address];
+      if (callbacks->write[address] == debugWrite)	callbacks->write[address]= d->oldWrite[address];
+      if (callbacks->call[address] == debugCall)	callbacks->call[address]= d->oldCall[address];
+    }
+  for (i= 0;  i < 0x100;  ++i)
+    if (callbacks->illegal_instruction[i] == debugTrap)
+      callbacks->illegal_instruction[i]= d->oldIllegal[i];
+}
+
+
+void M6502_setBreakpoint(M6502 *mpu, word address, M6502_Callback handler)
+{
+  M6502_Debug *d= debug(mpu);
+
+  d->exec[address]= handler;
+  if (handler)
+    {
+      intercept(mpu, address);
+      if (!d->armed[address])
+	arm(mpu, address);
+    }
+  else
+    {
+      if (d->armed[address])
+	disarm(mpu, address);
+      release(mpu, address);
+    }
+}
+
+
+void M6502_setWatchpoint(M6502 *mpu, int type, unsigned first, unsigned last, M6502_Callback handler)
+{
+  M6502_Debug *d= debug(mpu);
+  unsigned address;
+
+  if (last > 0x10000) last= 0x10000;
+  for (address= first;  address < last;  ++address)
+    {
+      if (type & M6502_WatchRead)  d->read [address]= handler;
+      if (type & M6502_WatchWrite) d->write[address]= handler;
+      if (handler)
+	intercept(mpu, address);
+      else
+	release(mpu, address);
+    }
+}
+
+
+/* history */
+
+static void checkpoint(M6502 *mpu, int everything)
+{
+  struct history    *h= mpu->debug->history;
+  M6502_Trace	    *trace= mpu->trace;
+  struct checkpoint *c;
+  int		     i, n= 0;
+
+  if (h->ncheckpoints == h->maxcheckpoints)
+    {
+      h->maxcheckpoints= h->maxcheckpoints ? h->maxcheckpoints * 2 : 64;
+      if (!(h->checkpoints= realloc(h->checkpoints, h->maxcheckpoints * sizeof(struct checkpoint))))
+	outOfMemory();
+    }
+  c= &h->checkpoints[h->ncheckpoints++];
+  c->insns= trace->insns;
+  c->registers= *mpu->registers;
+  c->logpos= h->logpos;
+  c->npages= 0;
+  for (i= 0;  i < 0x100;  ++i)
+    n += everything || trace->dirty[i];
+  c->pages= n ? allocate(n * sizeof(Page)) : 0;
+  for (i= 0;  i < 0x100;  ++i)
+    if (everything || trace->dirty[i])
+      {
+	savePage(mpu, &c->pages[c->npages++], i);
+	h->stale[i] |= trace->dirty[i];
+      }
+  memset(trace->dirty, 0, sizeof(trace->dirty));
+  h->used += sizeof(struct checkpoint) + c->npages * sizeof(Page);
+  h->next= trace->insns + h->interval;
+
+  /* over budget: fold the second checkpoint into the first (the only one
+   * that holds every page, in order) and discard the log before it.  a replay
+   * only recreates checkpoints that fitted before, and folding them would
+   * lose the history being replayed */
+  while (h->used > h->budget && h->ncheckpoints > 2 && !h->seeking)
+    {
+      struct checkpoint *first= &h->checkpoints[0], *second= &h->checkpoints[1];
+      size_t		 n= second->logpos;
+      for (i= 0;  i < second->npages;  ++i)
+	first->pages[second->pages[i].number]= second->pages[i];
+      first->insns= second->insns;
+      first->logpos= second->logpos;
+      first->registers= second->registers;
+      h->used -= sizeof(struct checkpoint) + second->npages * sizeof(Page);
+      free(second->pages);
+      memmove(second, second + 1, (h->ncheckpoints - 2) * sizeof(struct checkpoint));
+      --h->ncheckpoints;
+      for (i= 0;  i < (int)n;  ++i)
+	{
+	  h->used -= h->log[i].npages * sizeof(Page);
+	  free(h->log[i].pages);
+	}
+      memmove(h->log, h->log + n, (h->loglen - n) * sizeof(struct event));
+      h->loglen -= n;
+      h->logpos -= n;
+      for (i= 0;  i < h->ncheckpoints;  ++i)
+	h->checkpoints[i].logpos -= n;
+    }
+}
+
+
+/* set the trace limit to the next checkpoint, the end of a replay or the
+ * client's limit, whichever comes first (a replay ignores the client's) */
+
+static void setLimit(M6502 *mpu)
+{
+  struct history *h= mpu->debug->history;
+  uint64_t	  limit= (h->next < h->target) ? h->next : h->target;
+
+  if (!h->seeking && h->limit < limit)
+    limit= h->limit;
+  mpu->trace->limit= h->ours= limit;
+}
+
+
+/* called by the traced interpreter when insns reaches its limit */
+
+static int expired(M6502 *mpu)
+{
+  struct history *h= mpu->debug->history;
+  M6502_Trace	 *trace= mpu->trace;
+
+  if (trace->limit != h->ours)		/* a callback moved it: that is the client's */
+    h->limit= trace->limit;
+  if (trace->insns >= h->next)
+    checkpoint(mpu, 0);
+  if (trace->insns >= h->target)
+    return 0;
+  if (!h->seeking && trace->insns >= h->limit)
+    {
+      trace->limit= h->limit;
+      if (!h->expired || !h->expired(mpu))
+	{
+	  h->ours= h->limit= trace->limit;	/* as the client left it */
+	  return 0;
+	}
+      h->limit= trace->limit;
+    }
+  setLimit(mpu);
+  return 1;
+}
+
+
+/* M6502_run is starting: a limit stored since the last run (or since
+ * M6502_setHistory) is the client's, and checkpoints must still be taken
+ * before it.  M6502_check sets its own limit for each interval, and calls
+ * the expiry handler itself, so it is left alone while a check runs. */
+
+void M6502_syncHistory(M6502 *mpu)
+{
+  struct history *h= mpu->debug->history;
+
+  if (h && !mpu->check && mpu->trace->limit != h->ours)
+    {
+      h->limit= mpu->trace->limit;
+      setLimit(mpu);
+    }
+}
+
+
+/* restore the latest checkpoint taken no later than insns */
+
+static void restore(M6502 *mpu, uint64_t insns)
+{
+  M6502_Debug	    *d= mpu->debug;
+  struct history    *h= d->history;
+  struct checkpoint *c;
+  byte		     loaded[0x100];
+  unsigned	     address;
+  int		     k, i;
+
+  for (k= h->ncheckpoints - 1;  k > 0 && h->checkpoints[k].insns > insns;  --k)
+    ;
+  for (i= k + 1;  i < h->ncheckpoints;  ++i)
+    {
+      h->used -= sizeof(struct checkpoint) + h->checkpoints[i].npages * sizeof(Page);
+      free(h->checkpoints[i].pages);
+    }
+  h->ncheckpoints= k + 1;
+
+  /* a breakpoint disarmed by the handler now running must trap when its
+   * instruction is replayed */
+  for (address= 0;  address < 0x10000;  ++address)
+    if (d->exec[address] && !d->armed[address])
+      arm(mpu, address);
+
+  memset(loaded, 0, sizeof(loaded));
+  for (i= k;  i >= 0;  --i)
+    {
+      int j;
+      c= &h->checkpoints[i];
+      for (j= 0;  j < c->npages;  ++j)
+	if (!loaded[c->pages[j].number])
+	  {
+	    loadPage(mpu, &c->pages[j]);
+	    loaded[c->pages[j].number]= 1;
+	  }
+    }
+  c= &h->checkpoints[k];
+  *mpu->registers= c->registers;
+  mpu->trace->insns= c->insns;
+  for (i= 0;  i < 0x100;  ++i)
+    h->stale[i] |= mpu->trace->dirty[i];
+  memset(mpu->trace->dirty, 0, sizeof(mpu->trace->dirty));
+  h->logpos= c->logpos;
+  h->next= c->insns + h->interval;
+}
+
+
+/* restore the latest checkpoint no later than from, then replay up to
+ * (but not including) instruction number to */
+
+static void seek(M6502 *mpu, uint64_t from, uint64_t to)
+{
+  M6502_Debug	 *d= mpu->debug;
+  struct history *h= d->history;
+  M6502_Trace	 *trace= mpu->trace;
+
+  if (trace->limit != h->ours)
+    h->limit= trace->limit;
+  restore(mpu, from);
+  h->hits= 0;
+  h->target= to;
+  h->seeking= 1;
+  setLimit(mpu);
+  if (trace->insns < to)
+    M6502_run(mpu);
+  h->seeking= 0;
+  h->target= ~(uint64_t)0;
+  h->resume= trace->insns;
+  setLimit(mpu);
+  if (d->current && d->armed[d->current - 1])	/* as debugTrap() left it */
+    disarm(mpu, d->current - 1);
+}
+
+
+void M6502_setHistory(M6502 *mpu, unsigned interval, size_t budget)
+{
+  M6502_Debug	  *d= debug(mpu);
+  M6502_Callbacks *callbacks= mpu->callbacks;
+  struct history  *h= d->history;
+  M6502_Trace	  *trace;
+  unsigned	   address;
+  int		   i;
+
+  if (!h && !interval)
+    return;
+
+  trace= M6502_trace(mpu);
+  if (h)
+    {
+      d->history= 0;
+      forget(h, 0);
+      for (i= 0;  i < h->ncheckpoints;  ++i)
+	free(h->checkpoints[i].pages);
+      free(h->checkpoints);
+      free(h->log);
+      trace->expired= h->expired;
+      if (trace->limit == h->ours)
+	trace->limit= h->limit;
+      free(h);
+    }
+
+  if (!interval)
+    {
+      for (address= 0;  address < 0x10000;  ++address)
+	{
+	  release(mpu, address);
+	  if (callbacks->call[address] == debugCall)
+	    callbacks->call[address]= d->oldCall[address];
+	  d->oldCall[address]= 0;
+	}
+      for (i= 0;  i < 0x100;  ++i)
+	if (i != M6502_BreakOpcode && callbacks->illegal_instruction[i] == debugTrap)
+	  {
+	    callbacks->illegal_instruction[i]= d->oldIllegal[i];
+	    d->oldIllegal[i]= 0;
+	  }
+      return;
+    }
+
+  h= d->history= allocate(sizeof(struct history));
+  h->interval= interval;
+  h->budget= budget;
+  h->target= ~(uint64_t)0;
+  h->resume= ~(uint64_t)0;
+  memset(h->stale, 1, sizeof(h->stale));
+
+  /* route every client callback through invoke() */
+  for (address= 0;  address < 0x10000;  ++address)
+    {
+      if ((callbacks->read[address] && callbacks->read[address] != debugRead)
+	  || (callbacks->write[address] && callbacks->write[address] != debugWrite))
+	intercept(mpu, address);
+      if (callbacks->call[address] && callbacks->call[address] != debugCall)
+	{
+	  d->oldCall[address]= callbacks->call[address];
+	  callbacks->call[address]= debugCall;
+	}
+    }
+  for (i= 0;  i < 0x100;  ++i)
+    if (callbacks->illegal_instruction[i] && callbacks->illegal_instruction[i] != debugTrap)
+      {
+	d->oldIllegal[i]= callbacks->illegal_instruction[i];
+	callbacks->illegal_instruction[i]= debugTrap;
+      }
+
+  h->expired= trace->expired;
+  h->limit= trace->limit;
+  checkpoint(mpu, 1);
+  trace->expired= expired;
+  setLimit(mpu);
+}
+
+
+int M6502_reverseStep(M6502 *mpu)
+{
+  struct history *h= mpu->debug ? mpu->debug->history : 0;
+
+  if (!h || mpu->trace->insns <= h->checkpoints[0].insns)
+    return 0;
+  seek(mpu, mpu->trace->insns - 1, mpu->trace->insns - 1);
+  return 1;
+}
+
+
+int M6502_reverseContinue(M6502 *mpu)
+{
+  struct history *h= mpu->debug ? mpu->debug->history : 0;
+  uint64_t	  start, end;
+
+  if (!h)
+    return 0;
+
+  /* replay each interval in turn, working backwards, until one passes a
+   * breakpoint or watchpoint; then go back to the last of them */
+  for (end= mpu->trace->insns;  end > h->checkpoints[0].insns;  )
+    {
+      int k;
+      for (k= h->ncheckpoints - 1;  k > 0 && h->checkpoints[k].insns >= end;  --k)
+	;
+      start= h->checkpoints[k].insns;
+      seek(mpu, end - 1, end);
+      if (h->hits)
+	{
+	  seek(mpu, h->lastHit, h->lastHit);
+	  return 1;
+	}
+      end= start;
+    }
+  seek(mpu, h->checkpoints[0].insns, h->checkpoints[0].insns);
+  return 0;
+}
@@ -0,0 +1,75 @@
+/* clone1.c -- a clone of an instance with a breakpoint runs without it */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+
+#include "lib6502.h"
+
+#define WRCH	0xFFEE
+
+static jmp_buf stopped;
+
+int wrch(M6502 *mpu, uint16_t address, uint8_t data)
+{
+  int pc;
+  putchar(mpu->registers->a);
+  pc  = mpu->memory[++mpu->registers->s + 0x100];
+  pc |= mpu->memory[++mpu->registers->s + 0x100] << 8;
+  return pc + 1;
+}
+
+int done(M6502 *mpu, uint16_t address, uint8_t data)
+{
+  putchar('\n');
+  longjmp(stopped, 1);
+}
+
+int stop(M6502 *mpu, uint16_t address, uint8_t data)
+{
+  char buffer[64];
+  M6502_disassemble(mpu, address, buffer);
+  printf("[breakpoint %s]", buffer);
+  return 0;
+}
+
+int main()
+{
+  M6502    *mpu = M6502_new(0, 0, 0);
+  M6502    *clone;
+  unsigned  pc  = 0x1000;
+
+  M6502_setCallback(mpu, call, WRCH, wrch);
+  M6502_setCallback(mpu, call,    0, done);
+
+# define gen1(X)	(mpu->memory[pc++]= (uint8_t)(X))
+# define gen2(X,Y)	gen1(X); gen1(Y)
+# define gen3(X,Y,Z)	gen1(X); gen2(Y,Z)
+
+  gen2(0xA2, 'A'     );	// LDX #'A'
+  gen1(0x8A          );	// TXA
+  gen3(0x20,0xEE,0xFF);	// JSR FFEE
+  gen1(0xE8          );	// INX
+  gen2(0xE0, 'F'     );	// CPX #'F'
+  gen2(0xD0, -9      );	// BNE 0x1002
+  gen3(0x4C,0x00,0x00);	// JMP 0
+
+  M6502_setBreakpoint(mpu, 0x1006, stop);	/* INX */
+  mpu->registers->pc= 0x1000;
+
+  /* the clone sees the INX, not the opcode planted over it */
+  if (!(clone= M6502_clone(mpu)))
+    {
+      perror("M6502_clone");
+      return 1;
+    }
+  if (!setjmp(stopped))
+    M6502_run(clone);
+  M6502_delete(clone);
+
+  if (!setjmp(stopped))
+    M6502_run(mpu);
+  M6502_delete(mpu);
+
+  return 0;
+}
@@ -0,0 +1,117 @@
+/* tube1.c -- two processors talking through a Tube ULA */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lib6502.h"
+
+#define WRCH	0xFFEE
+
+int wrch(M6502 *mpu, uint16_t address, uint8_t data)
+{
+  int pc;
+  putchar(mpu->registers->a);
+  pc  = mpu->memory[++mpu->registers->s + 0x100];
+  pc |= mpu->memory[++mpu->registers->s + 0x100] << 8;
+  return pc + 1;
+}
+
+/* stop the host, as run6502 -X does; M6502_runTube then stops the parasite */
+int done(M6502 *mpu, uint16_t address, uint8_t data)
+{
+  mpu->trace->limit= 0;
+  return 0;
+}
+
+static void gen(M6502 *mpu, unsigned pc, const uint8_t *code, size_t size)
+{
+  while (size--)
+    mpu->memory[pc++]= *code++;
+}
+
+int main()
+{
+  M6502	     *host     = M6502_new(0, 0, 0);
+  M6502	     *parasite = M6502_new(0, 0, 0);
+  M6502_Tube *tube;
+
+  /* send each byte of the message through R1, print what comes back, then
+   * fill R4, clear the queues (flag T) and print '+' if R4 is empty again;
+   * then print '1' if one byte fills R3 and '2' if setting flag V makes
+   * room for another */
+  static const uint8_t hostCode[]= {
+    0xA2, 0x00,		// 1000	LDX #0
+    0xAD, 0xE0, 0xFE,	// 1002	LDA FEE0	R1 status
+    0x29, 0x40,		// 1005	AND #40		room to write?
+    0xF0, 0xF9,		// 1007	BEQ 1002
+    0xBD, 0x00, 0x11,	// 1009	LDA 1100,X
+    0xF0, 0x11,		// 100C	BEQ 101F
+    0x8D, 0xE1, 0xFE,	// 100E	STA FEE1	R1 data
+    0xAD, 0xE0, 0xFE,	// 1011	LDA FEE0
+    0x10, 0xFB,		// 1014	BPL 1011	wait for the reply
+    0xAD, 0xE1, 0xFE,	// 1016	LDA FEE1
+    0x20, 0xEE, 0xFF,	// 1019	JSR FFEE
+    0xE8,		// 101C	INX
+    0xD0, 0xE3,		// 101D	BNE 1002
+    0xA9, 0x78,		// 101F	LDA #'x'
+    0x8D, 0xE7, 0xFE,	// 1021	STA FEE7	R4 data: now full
+    0xA9, 0xC0,		// 1024	LDA #C0
+    0x8D, 0xE0, 0xFE,	// 1026	STA FEE0	set T
+    0xA9, 0x40,		// 1029	LDA #40
+    0x8D, 0xE0, 0xFE,	// 102B	STA FEE0	clear T
+    0xAD, 0xE6, 0xFE,	// 102E	LDA FEE6	R4 status
+    0x29, 0x40,		// 1031	AND #40
+    0xF0, 0x05,		// 1033	BEQ 103A
+    0xA9, 0x2B,		// 1035	LDA #'+'
+    0x20, 0xEE, 0xFF,	// 1037	JSR FFEE
+    0xA9, 0x72,		// 103A	LDA #'r'
+    0x8D, 0xE5, 0xFE,	// 103C	STA FEE5	R3 data: full while V is clear
+    0xAD, 0xE4, 0xFE,	// 103F	LDA FEE4	R3 status
+    0x29, 0x40,		// 1042	AND #40
+    0xD0, 0x05,		// 1044	BNE 104B
+    0xA9, 0x31,		// 1046	LDA #'1'
+    0x20, 0xEE, 0xFF,	// 1048	JSR FFEE
+    0xA9, 0x90,		// 104B	LDA #90
+    0x8D, 0xE0, 0xFE,	// 104D	STA FEE0	set V: room for a second byte
+    0xAD, 0xE4, 0xFE,	// 1050	LDA FEE4
+    0x29, 0x40,		// 1053	AND #40
+    0xF0, 0x05,		// 1055	BEQ 105C
+    0xA9, 0x32,		// 1057	LDA #'2'
+    0x20, 0xEE, 0xFF,	// 1059	JSR FFEE
+    0xA9, 0x0A,		// 105C	LDA #'\n'
+    0x20, 0xEE, 0xFF,	// 105E	JSR FFEE
+    0x4C, 0x00, 0x00,	// 1061	JMP 0
+  };
+
+  /* echo each byte from R1 back to the host in lower case */
+  static const uint8_t parasiteCode[]= {
+    0xAD, 0xF8, 0xFE,	// 2000	LDA FEF8	R1 status
+    0x10, 0xFB,		// 2003	BPL 2000
+    0xAD, 0xF9, 0xFE,	// 2005	LDA FEF9	R1 data
+    0x09, 0x20,		// 2008	ORA #20
+    0x8D, 0xF9, 0xFE,	// 200A	STA FEF9
+    0x4C, 0x00, 0x20,	// 200D	JMP 2000
+  };
+
+  gen(host, 0x1000, hostCode, sizeof(hostCode));
+  gen(host, 0x1100, (const uint8_t *)"TUBE", 5);
+  gen(parasite, 0x2000, parasiteCode, sizeof(parasiteCode));
+
+  M6502_setCallback(host, call, WRCH, wrch);
+  M6502_setCallback(host, call,    0, done);
+  host->registers->pc= 0x1000;
+  host->registers->p= parasite->registers->p= 0x04;	/* SEI */
+  parasite->registers->pc= 0x2000;
+
+  if (!(tube= M6502_newTube(host, parasite)))
+    {
+      perror("M6502_newTube");
+      return 1;
+    }
+  M6502_runTube(tube);
+  M6502_deleteTube(tube);
+  M6502_delete(parasite);
+  M6502_delete(host);
+
+  return 0;
+}
@@ -0,0 +1,582 @@
+/* flow6502.c -- static control-flow recovery for lib6502	-*- C -*- */
+
+/* Copyright (c) 2005 Ian Piumarta
+ *
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the 'Software'),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, provided that the above copyright notice(s) and this
+ * permission notice appear in all copies of the Software and that both the
+ * above copyright notice(s) and this permission notice appear in supporting
+ * documentation.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS'.  USE ENTIRELY AT YOUR OWN RISK.
+ */
+
+/* M6502_flow decides which bytes of a region of memory (a ROM, usually)
+ * are code by recursive descent from the reset, IRQ and NMI vectors and
+ * any other entry points it is given, decoding insns with M6502_decode.
+ * Branches, jmp, bra and jsr are followed when their targets lie in the
+ * region; jsr is assumed to return.  jmp (abs) is followed when its
+ * pointer is in the region (and is therefore constant).  jmp (abs,X) is
+ * taken to index a table of words at abs, which extends for as long as
+ * its entries point into the region and its bytes have not been found to
+ * be code, up to 128 entries.  Anything else (a pointer in RAM, an
+ * rts-dispatch table built on the stack, code reached only by computed
+ * jumps) is not discovered.
+ *
+ * The code found is then cut into basic blocks, each block is assigned
+ * to the first function (vector, entry point or jsr target) from which
+ * it can be reached without a call, and each jsr becomes an edge of the
+ * call graph.
+ *
+ * A saved flow is a cache: it starts with a hash of the region's contents
+ * and the entry points, and M6502_loadFlow refuses it if that no longer
+ * matches memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lib6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+static const char magic[8]= "6502cfg1";
+
+
+static void *allocate(size_t size)
+{
+  void *p= calloc(1, size ? size : 1);
+  if (!p)
+    {
+      fflush(stdout);
+      fprintf(stderr, "\nout of memory\n");
+      abort();
+    }
+  return p;
+}
+
+#define append(ARRAY, COUNT, ITEM)								\
+  do {												\
+    if (!((COUNT) & ((COUNT) - 1)))								\
+      if (!((ARRAY)= realloc((ARRAY), sizeof(*(ARRAY)) * ((COUNT) ? (COUNT) * 2 : 1))))	\
+	allocate(~(size_t)0 >> 1);								\
+    (ARRAY)[(COUNT)++]= (ITEM);									\
+  } while (0)
+
+
+static uint64_t keyOf(M6502 *mpu, unsigned first, unsigned last, const uint16_t *entries, unsigned count)
+{
+  uint64_t key= 14695981039346656037ull;
+  unsigned i;
+
+#define mix(B)	(key= (key ^ (byte)(B)) * 1099511628211ull)
+  mix(first);  mix(first >> 8);  mix(first >> 16);
+  mix(last);   mix(last  >> 8);  mix(last  >> 16);
+  for (i= 0;  i < count;  ++i)
+    {
+      mix(entries[i]);
+      mix(entries[i] >> 8);
+    }
+  for (i= first;  i < last;  ++i)
+    mix(mpu->memory[i]);
+  for (i= M6502_NMIVectorLSB;  i <= M6502_IRQVectorMSB;  ++i)
+    mix(mpu->memory[i]);
+#undef mix
+
+  return key;
+}
+
+
+#define inRegion(A)	((A) >= flow->first && (A) < flow->last)
+#define isBranch(M)	((M) == M6502_bcc || (M) == M6502_bcs || (M) == M6502_beq || (M) == M6502_bmi	\
+			 || (M) == M6502_bne || (M) == M6502_bpl || (M) == M6502_bvc || (M) == M6502_bvs)
+
+struct work
+{
+  unsigned count;
+  word	  *addresses;
+};
+
+static void reach(M6502_Flow *flow, struct work *work, word address, int flags)
+{
+  if (!inRegion(address))
+    return;
+  flow->map[address] |= M6502_FlowLeader | flags;
+  append(work->addresses, work->count, address);
+}
+
+
+/* the table of words used by the jmp (abs,X) at site */
+
+static void jumpTable(M6502_Flow *flow, M6502 *mpu, struct work *work, word site, word base)
+{
+  M6502_JumpTable table;
+  unsigned	  i;
+
+  memset(&table, 0, sizeof(table));
+  table.site= site;
+  table.base= base;
+  for (i= 0;  i < 128;  ++i)
+    {
+      unsigned lo= base + 2 * i, hi= lo + 1;
+      word     target;
+      if (!inRegion(lo) || !inRegion(hi)
+	  || (flow->map[lo] & (M6502_FlowInsn | M6502_FlowOperand))
+	  || (flow->map[hi] & (M6502_FlowInsn | M6502_FlowOperand)))
+	break;
+      target= mpu->memory[lo] | (mpu->memory[hi] << 8);
+      if (!inRegion(target))
+	break;
+      table.targets[table.count++]= target;
+    }
+  for (i= 0;  i < table.count;  ++i)
+    {
+      flow->map[(word)(base + 2 * i)]     |= M6502_FlowTable;
+      flow->map[(word)(base + 2 * i + 1)] |= M6502_FlowTable;
+      reach(flow, work, table.targets[i], 0);
+    }
+  append(flow->tables, flow->ntables, table);
+}
+
+
+/* decode everything reachable from the addresses in work */
+
+static void descend(M6502_Flow *flow, M6502 *mpu, struct work *work)
+{
+  while (work->count)
+    {
+      unsigned address= work->addresses[--work->count];
+
+      while (inRegion(address))
+	{
+	  M6502_Insn insn;
+	  unsigned   i;
+
+	  if (flow->map[address] & M6502_FlowInsn)
+	    break;
+	  if (flow->map[address] & (M6502_FlowOperand | M6502_FlowTable))
+	    {
+	      flow->map[address] |= M6502_FlowConflict;
+	      ++flow->conflicts;
+	      break;
+	    }
+	  M6502_decode(mpu, address, &insn);
+	  if (insn.mnemonic == M6502_ill || !inRegion(address + insn.length - 1))
+	    {
+	      flow->map[address] |= M6502_FlowInvalid;
+	      break;
+	    }
+	  flow->map[address] |= M6502_FlowInsn;
+	  for (i= 1;  i < insn.length;  ++i)
+	    {
+	      if (flow->map[address + i] & (M6502_FlowInsn | M6502_FlowTable))
+		{
+		  flow->map[address + i] |= M6502_FlowConflict;	/* an insn or table overlaps this one */
+		  ++flow->conflicts;
+		}
+	      flow->map[address + i] |= M6502_FlowOperand;
+	    }
+
+	  if (isBranch(insn.mnemonic))
+	    {
+	      reach(flow, work, insn.operand, 0);
+	      reach(flow, work, address + insn.length, 0);
+	      break;
+	    }
+	  switch (insn.mnemonic)
+	    {
+	    case M6502_bra:
+	      reach(flow, work, insn.operand, 0);
+	      break;
+	    case M6502_jmp:
+	      if (insn.mode == M6502_Abs)
+		reach(flow, work, insn.operand, 0);
+	      else if (insn.mode == M6502_Indirect && inRegion(insn.operand) && inRegion(insn.operand + 1u))
+		reach(flow, work, mpu->memory[insn.operand] | (mpu->memory[insn.operand + 1] << 8), 0);
+	      else if (insn.mode == M6502_Indabsx)
+		jumpTable(flow, mpu, work, address, insn.operand);
+	      break;
+	    case M6502_jsr:
+	      reach(flow, work, insn.operand, M6502_FlowEntry);
+	      address += insn.length;
+	      continue;
+	    case M6502_rts:
+	    case M6502_rti:
+	    case M6502_brk:
+	      break;
+	    default:
+	      address += insn.length;
+	      continue;
+	    }
+	  break;
+	}
+    }
+}
+
+
+static M6502_JumpTable *tableAt(M6502_Flow *flow, word site)
+{
+  unsigned i;
+  for (i= 0;  i < flow->ntables;  ++i)
+    if (flow->tables[i].site == site)
+      return &flow->tables[i];
+  return 0;
+}
+
+
+/* cut the code into blocks and describe how each one ends */
+
+static void cut(M6502_Flow *flow, M6502 *mpu)
+{
+  unsigned address= flow->first;
+
+  while (address < flow->last)
+    {
+      M6502_Block block;
+      M6502_Insn  insn;
+
+      if (!(flow->map[address] & M6502_FlowInsn))
+	{
+	  ++address;
+	  continue;
+	}
+      memset(&block, 0, sizeof(block));
+      block.first= address;
+      for (;;)
+	{
+	  unsigned next;
+	  M6502_decode(mpu, address, &insn);
+	  block.last= address;
+	  next= address + insn.length;
+	  if (isBranch(insn.mnemonic))
+	    {
+	      block.ends= M6502_EndsBranch;
+	      block.target= insn.operand;
+	    }
+	  else if (insn.mnemonic == M6502_bra || (insn.mnemonic == M6502_jmp && insn.mode == M6502_Abs))
+	    {
+	      block.ends= M6502_EndsJump;
+	      block.target= insn.operand;
+	    }
+	  else if (insn.mnemonic == M6502_jmp && insn.mode == M6502_Indirect)
+	    {
+	      if (inRegion(insn.operand) && inRegion(insn.operand + 1u))
+		{
+		  block.ends= M6502_EndsJump;
+		  block.target= mpu->memory[insn.operand] | (mpu->memory[insn.operand + 1] << 8);
+		}
+	      else
+		{
+		  block.ends= M6502_EndsIndirect;
+		  block.target= insn.operand;
+		}
+	    }
+	  else if (insn.mnemonic == M6502_jmp)
+	    {
+	      block.ends= M6502_EndsTable;
+	      block.target= tableAt(flow, address) - flow->tables;
+	    }
+	  else if (insn.mnemonic == M6502_rts || insn.mnemonic == M6502_rti)
+	    block.ends= M6502_EndsReturn;
+	  else if (insn.mnemonic == M6502_brk)
+	    block.ends= M6502_EndsBreak;
+	  else if (next >= flow->last || !(flow->map[next] & M6502_FlowInsn))
+	    block.ends= M6502_EndsInvalid;
+	  else if (flow->map[next] & M6502_FlowLeader)
+	    {
+	      block.ends= M6502_EndsFalling;
+	      block.target= next;
+	    }
+	  else
+	    {
+	      address= next;
+	      continue;
+	    }
+	  address= next;
+	  break;
+	}
+      append(flow->blocks, flow->nblocks, block);
+    }
+}
+
+
+/* give each block to the first function that reaches it without a call,
+ * then find the caller of each jsr */
+
+static void assign(M6502_Flow *flow, M6502 *mpu)
+{
+  int	  *blockAt= allocate(0x10000 * sizeof(int));
+  byte	  *seen= allocate(flow->nblocks);
+  unsigned *stack= allocate((flow->nblocks + 1) * sizeof(unsigned));
+  unsigned  i, address;
+
+  for (i= 0;  i < flow->nblocks;  ++i)
+    blockAt[flow->blocks[i].first]= i + 1;
+
+  for (address= flow->first;  address < flow->last;  ++address)
+    if (flow->map[address] & M6502_FlowEntry)
+      append(flow->entries, flow->nentries, address);
+
+  for (i= 0;  i < flow->nentries;  ++i)
+    {
+      word     entry= flow->entries[i];
+      unsigned depth= 0;
+
+      if (!blockAt[entry] || seen[blockAt[entry] - 1])
+	continue;
+      seen[blockAt[entry] - 1]= 1;
+      stack[depth++]= blockAt[entry] - 1;
+      while (depth)
+	{
+	  M6502_Block *block= &flow->blocks[stack[--depth]];
+	  word	       successors[130];
+	  unsigned     n= 0, k;
+
+	  block->function= entry;
+	  switch (block->ends)
+	    {
+	    case M6502_EndsBranch:
+	      successors[n++]= block->target;
+	      successors[n++]= block->last + 2;
+	      break;
+	    case M6502_EndsFalling:
+	    case M6502_EndsJump:
+	      successors[n++]= block->target;
+	      break;
+	    case M6502_EndsTable:
+	      for (k= 0;  k < flow->tables[block->target].count;  ++k)
+		successors[n++]= flow->tables[block->target].targets[k];
+	      break;
+	    }
+	  for (k= 0;  k < n;  ++k)
+	    {
+	      int b= blockAt[successors[k]] - 1;
+	      if (b >= 0 && !seen[b] && !(flow->map[successors[k]] & M6502_FlowEntry))
+		{
+		  seen[b]= 1;
+		  stack[depth++]= b;
+		}
+	    }
+	}
+    }
+
+  for (i= 0;  i < flow->nblocks;  ++i)
+    {
+      M6502_Block *block= &flow->blocks[i];
+      for (address= block->first;  address <= block->last;  )
+	{
+	  M6502_Insn insn;
+	  M6502_decode(mpu, address, &insn);
+	  if (insn.mnemonic == M6502_jsr)
+	    {
+	      M6502_Call call= { address, seen[i] ? block->function : block->first, insn.operand };
+	      append(flow->calls, flow->ncalls, call);
+	    }
+	  address += insn.length;
+	}
+    }
+
+  free(stack);
+  free(seen);
+  free(blockAt);
+}
+
+
+M6502_Flow *M6502_flow(M6502 *mpu, unsigned first, unsigned last, const uint16_t *entries, unsigned count)
+{
+  M6502_Flow *flow= allocate(sizeof(M6502_Flow));
+  struct work work= { 0, 0 };
+  unsigned    i;
+
+  if (last > 0x10000) last= 0x10000;
+  if (first > last)   first= last;
+  flow->first= first;
+  flow->last=  last;
+  flow->key=   keyOf(mpu, first, last, entries, count);
+
+  reach(flow, &work, M6502_getVector(mpu, NMI), M6502_FlowEntry);
+  reach(flow, &work, M6502_getVector(mpu, IRQ), M6502_FlowEntry);
+  reach(flow, &work, M6502_getVector(mpu, RST), M6502_FlowEntry);
+  for (i= count;  i--;  )
+    reach(flow, &work, entries[i], M6502_FlowEntry);
+  descend(flow, mpu, &work);
+  free(work.addresses);
+
+  cut(flow, mpu);
+  assign(flow, mpu);
+  return flow;
+}
+
+
+int M6502_saveFlow(M6502_Flow *flow, const char *path)
+{
+  FILE	  *file= fopen(path, "wb");
+  uint32_t header[7]= { flow->first, flow->last, flow->nentries, flow->nblocks, flow->ncalls, flow->ntables, flow->conflicts };
+  int	   ok;
+
+  if (!file)
+    return 0;
+  ok= (   (1 == fwrite(magic,     sizeof(magic),     1, file))
+       && (1 == fwrite(&flow->key, sizeof(flow->key), 1, file))
+       && (1 == fwrite(header,    sizeof(header),    1, file))
+       && (1 == fwrite(flow->map, sizeof(flow->map), 1, file))
+       && (flow->nentries == fwrite(flow->entries, sizeof(*flow->entries), flow->nentries, file))
+       && (flow->nblocks  == fwrite(flow->blocks,  sizeof(*flow->blocks),  flow->nblocks,  file))
+       && (flow->ncalls   == fwrite(flow->calls,   sizeof(*flow->calls),   flow->ncalls,   file))
+       && (flow->ntables  == fwrite(flow->tables,  sizeof(*flow->tables),  flow->ntables,  file)));
+  return !fclose(file) && ok;
+}
+
+
+/* a cache file is only trusted as far as its key: check that everything
+ * M6502_printFlow and clients index by is in range */
+
+static int validFlow(M6502_Flow *flow)
+{
+  unsigned i;
+
+  for (i= 0;  i < flow->nentries;  ++i)
+    if (!inRegion(flow->entries[i]))
+      return 0;
+  for (i= 0;  i < flow->nblocks;  ++i)
+    {
+      M6502_Block *block= &flow->blocks[i];
+      if (!inRegion(block->first) || !inRegion(block->last) || block->first > block->last
+	  || block->ends > M6502_EndsInvalid
+	  || (block->ends == M6502_EndsTable && block->target >= flow->ntables))
+	return 0;
+    }
+  for (i= 0;  i < flow->ncalls;  ++i)
+    if (!inRegion(flow->calls[i].site) || !inRegion(flow->calls[i].caller))
+      return 0;
+  for (i= 0;  i < flow->ntables;  ++i)
+    if (!inRegion(flow->tables[i].site) || flow->tables[i].count > 128)
+      return 0;
+  return 1;
+}
+
+
+M6502_Flow *M6502_loadFlow(M6502 *mpu, unsigned first, unsigned last, const uint16_t *entries, unsigned count, const char *path)
+{
+  FILE	     *file= fopen(path, "rb");
+  char	      header[sizeof(magic)];
+  uint32_t    sizes[7];
+  M6502_Flow *flow;
+  int	      ok;
+
+  if (!file)
+    return 0;
+  flow= allocate(sizeof(M6502_Flow));
+  ok= (   (1 == fread(header,     sizeof(header),    1, file))
+       && (1 == fread(&flow->key, sizeof(flow->key), 1, file))
+       && (1 == fread(sizes,      sizeof(sizes),     1, file)));
+  if (ok && (memcmp(header, magic, sizeof(magic)) || sizes[0] > 0x10000 || sizes[1] > 0x10000
+	     || sizes[2] > 0x10000 || sizes[3] > 0x10000 || sizes[4] > 0x10000 || sizes[5] > 0x10000 || sizes[6] > 0x10000))
+    {
+      fclose(file);
+      M6502_deleteFlow(flow);
+      errno= EINVAL;
+      return 0;
+    }
+  if (ok)
+    {
+      if (last > 0x10000) last= 0x10000;
+      if (first > last)   first= last;
+      if (flow->key != keyOf(mpu, first, last, entries, count) || sizes[0] != first || sizes[1] != last)
+	{
+	  fclose(file);
+	  M6502_deleteFlow(flow);
+	  errno= ESTALE;
+	  return 0;
+	}
+      flow->first=     sizes[0];
+      flow->last=      sizes[1];
+      flow->nentries=  sizes[2];
+      flow->nblocks=   sizes[3];
+      flow->ncalls=    sizes[4];
+      flow->ntables=   sizes[5];
+      flow->conflicts= sizes[6];
+      flow->entries= allocate(flow->nentries * sizeof(*flow->entries));
+      flow->blocks=  allocate(flow->nblocks  * sizeof(*flow->blocks));
+      flow->calls=   allocate(flow->ncalls   * sizeof(*flow->calls));
+      flow->tables=  allocate(flow->ntables  * sizeof(*flow->tables));
+      ok= (   (1 == fread(flow->map, sizeof(flow->map), 1, file))
+	   && (flow->nentries == fread(flow->entries, sizeof(*flow->entries), flow->nentries, file))
+	   && (flow->nblocks  == fread(flow->blocks,  sizeof(*flow->blocks),  flow->nblocks,  file))
+	   && (flow->ncalls   == fread(flow->calls,   sizeof(*flow->calls),   flow->ncalls,   file))
+	   && (flow->ntables  == fread(flow->tables,  sizeof(*flow->tables),  flow->ntables,  file))
+	   && validFlow(flow));
+    }
+  fclose(file);
+  if (!ok)
+    {
+      M6502_deleteFlow(flow);
+      errno= EINVAL;
+      return 0;
+    }
+  return flow;
+}
+
+
+void M6502_printFlow(M6502_Flow *flow, FILE *stream)
+{
+  static const char *ends[]= { "falls", "branch", "jump", "indirect", "table", "return", "break", "invalid" };
+  unsigned i, k, code= 0;
+
+  for (i= flow->first;  i < flow->last;  ++i)
+    code += !!(flow->map[i] & (M6502_FlowInsn | M6502_FlowOperand));
+  fprintf(stream, "# %04X-%04X: %u bytes of code, %u functions, %u blocks, %u calls, %u tables, %u conflicts\n",
+	  flow->first, flow->last - 1, code, flow->nentries, flow->nblocks, flow->ncalls, flow->ntables, flow->conflicts);
+  for (i= 0;  i < flow->nentries;  ++i)
+    fprintf(stream, "F %04X\n", flow->entries[i]);
+  for (i= 0;  i < flow->nblocks;  ++i)
+    {
+      M6502_Block *block= &flow->blocks[i];
+      fprintf(stream, "B %04X %04X %04X %s", block->first, block->last, block->function, ends[block->ends]);
+      switch (block->ends)
+	{
+	case M6502_EndsFalling:
+	case M6502_EndsBranch:
+	case M6502_EndsJump:
+	case M6502_EndsIndirect:
+	  fprintf(stream, " %04X", block->target);
+	  break;
+	case M6502_EndsTable:
+	  fprintf(stream, " %04X", flow->tables[block->target].base);
+	  break;
+	}
+      fprintf(stream, "\n");
+    }
+  for (i= 0;  i < flow->ncalls;  ++i)
+    fprintf(stream, "C %04X %04X %04X\n", flow->calls[i].site, flow->calls[i].caller, flow->calls[i].callee);
+  for (i= 0;  i < flow->ntables;  ++i)
+    {
+      M6502_JumpTable *table= &flow->tables[i];
+      fprintf(stream, "T %04X %04X %u", table->site, table->base, table->count);
+      for (k= 0;  k < table->count;  ++k)
+	fprintf(stream, " %04X", table->targets[k]);
+      fprintf(stream, "\n");
+    }
+  for (i= flow->first;  i < flow->last;  ++i)
+    if (flow->map[i] & (M6502_FlowInvalid | M6502_FlowConflict))
+      fprintf(stream, "X %04X %s\n", i, (flow->map[i] & M6502_FlowConflict) ? "conflict" : "invalid");
+}
+
+
+void M6502_deleteFlow(M6502_Flow *flow)
+{
+  free(flow->entries);
+  free(flow->blocks);
+  free(flow->calls);
+  free(flow->tables);
+  free(flow);
+}
@@ -0,0 +1,296 @@
+/* fuzz6502.c -- coverage-guided fuzzing of 6502 programs	-*- C -*- */
+
+/* Copyright (c) 2005 Ian Piumarta
+ *
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the 'Software'),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, provided that the above copyright notice(s) and this
+ * permission notice appear in all copies of the Software and that both the
+ * above copyright notice(s) and this permission notice appear in supporting
+ * documentation.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS'.  USE ENTIRELY AT YOUR OWN RISK.
+ */
+
+/* Built with 'make fuzz6502' (which needs clang) this is a libFuzzer
+ * target; built with 'make fuzz6502-replay' it runs each file named on
+ * its command line through the same harness once and says what happened,
+ * which is how crashes are reproduced and corpora checked without clang.
+ *
+ * libFuzzer owns the command line, so the machine is described by options
+ * in the environment variable FUZZ6502:
+ *
+ *   -l addr file   load file at addr (as many as needed)
+ *   -R addr        start at addr (default: the reset vector)
+ *   -i addr size   copy each input into size bytes at addr
+ *   -G addr        ... or let each read of addr return its next byte
+ *   -t byte        follow the input with byte (e.g. 0D)
+ *   -X addr        finish when PC reaches addr
+ *   -a addr        crash when PC reaches addr (an assertion failed)
+ *   -n count       finish after count instructions (default 100000)
+ *   -H             crash after count instructions instead
+ *
+ * For example
+ *
+ *   FUZZ6502='-l 1000 parser.bin -R 1000 -G F000 -t 0D -X 0 -a 1F00' \
+ *     ./fuzz6502 corpus
+ *
+ * A run also finishes when the program reads past the end of its input.
+ * Every run starts from the same memory and registers.  Rather than copy
+ * the whole of memory back each time, only the pages the traced
+ * interpreter saw written are restored from the pristine image.  Each
+ * branch, jump and call bumps an edge counter (see M6502_CoverEdges) and
+ * those counters are libFuzzer's 'extra counters', which is all the
+ * coverage the fuzzer gets: the emulator itself is not instrumented.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "lib6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+#if defined(FUZZ6502_REPLAY)
+# define EXTRA_COUNTERS
+#else
+# define EXTRA_COUNTERS	__attribute__((section("__libfuzzer_extra_counters")))
+#endif
+
+static byte edges[0x10000] EXTRA_COUNTERS;
+
+static M6502	       *mpu= 0;
+static byte		pristine[0x10000];
+static M6502_Registers	start;
+
+static uint64_t budget=	     100000;
+static int	hangs=	     0;		/* -H: running out of instructions is a crash */
+static unsigned regionStart= 0;		/* -i addr size */
+static unsigned regionSize=  0;
+static int	terminator=  -1;	/* -t byte */
+
+static const byte *input= 0;		/* the current input ... */
+static size_t	   inputSize= 0;
+static size_t	   inputNext= 0;	/* ... and how much of it -G has read */
+
+enum { runExited, runStarved, runExpired };
+
+static int outcome= runExpired;
+
+
+static void fail(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "fuzz6502: ");
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+
+static unsigned long htol(char *hex)
+{
+  char *end;
+  unsigned long l= strtol(hex, &end, 16);
+  if (*end) fail("bad hex number: %s", hex);
+  return l;
+}
+
+
+static void finish(M6502 *mpu, int how)
+{
+  outcome= how;
+  mpu->trace->limit= 0;
+}
+
+
+static int getInput(M6502 *mpu, word address, byte data)
+{
+  if (inputNext < inputSize)
+    return input[inputNext++];
+  if (inputNext++ == inputSize && terminator >= 0)
+    return terminator;
+  finish(mpu, runStarved);
+  return 0;
+}
+
+
+static int doExit(M6502 *mpu, word address, byte data)
+{
+  finish(mpu, runExited);
+  return 0;
+}
+
+
+static int doAbort(M6502 *mpu, word address, byte data)
+{
+  char state[64];
+  M6502_dump(mpu, state);
+  fprintf(stderr, "fuzz6502: reached %04X after %llu instructions: %s\n",
+	  address, (unsigned long long)mpu->trace->insns, state);
+  abort();
+  return 0;
+}
+
+
+static void load(word address, const char *path)
+{
+  FILE  *file= fopen(path, "r");
+  size_t count;
+  if (!file)
+    fail("%s: cannot open", path);
+  count= fread(mpu->memory + address, 1, 0x10000 - address, file);
+  fclose(file);
+  if (!count)
+    fail("%s: empty", path);
+}
+
+
+static void configure(char *options)
+{
+  char *argv[64];
+  int   argc= 0, i;
+  int   startAddress= -1;
+
+  while (options && argc < 64)
+    {
+      while (isspace(*options)) ++options;
+      if (!*options) break;
+      argv[argc++]= options;
+      while (*options && !isspace(*options)) ++options;
+      if (*options) *options++= '\0';
+    }
+
+#define argument()	((i + 1 < argc) ? argv[++i] : (fail("%s: missing argument", argv[i]), (char *)0))
+
+  for (i= 0;  i < argc;  ++i)
+    {
+      char *opt= argv[i];
+      if	(!strcmp(opt, "-l"))	{ word a= htol(argument());  load(a, argument()); }
+      else if (!strcmp(opt, "-R"))	startAddress= htol(argument());
+      else if (!strcmp(opt, "-i"))	{ regionStart= htol(argument());  regionSize= htol(argument()); }
+      else if (!strcmp(opt, "-G"))	M6502_setCallback(mpu, read, htol(argument()), getInput);
+      else if (!strcmp(opt, "-t"))	terminator= htol(argument()) & 0xff;
+      else if (!strcmp(opt, "-X"))	M6502_setCallback(mpu, call, htol(argument()), doExit);
+      else if (!strcmp(opt, "-a"))	M6502_setCallback(mpu, call, htol(argument()), doAbort);
+      else if (!strcmp(opt, "-n"))	budget= strtoull(argument(), 0, 0);
+      else if (!strcmp(opt, "-H"))	hangs= 1;
+      else				fail("unknown option in FUZZ6502: %s", opt);
+    }
+
+#undef argument
+
+  if (regionStart + regionSize > 0x10000)
+    fail("input region %04X +%X runs off the end of memory", regionStart, regionSize);
+
+  M6502_reset(mpu);
+  if (startAddress >= 0)
+    mpu->registers->pc= startAddress;
+  start= *mpu->registers;
+  memcpy(pristine, mpu->memory, sizeof(pristine));
+}
+
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+  M6502_Coverage *coverage;
+
+  if (mpu)
+    return 0;
+  if (!(mpu= M6502_new(0, 0, 0)))
+    fail("out of memory");
+  coverage= M6502_coverage(mpu, 0);
+  coverage->edges= edges;
+  configure(getenv("FUZZ6502"));
+  return 0;
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  M6502_Trace *trace;
+  unsigned     page;
+
+  LLVMFuzzerInitialize(0, 0);
+  trace= mpu->trace;
+
+  input= data;
+  inputSize= size;
+  inputNext= 0;
+  if (regionSize)
+    {
+      size_t length= (size < regionSize) ? size : regionSize;
+      memcpy(mpu->memory + regionStart, data, length);
+      if (length < regionSize && terminator >= 0)
+	mpu->memory[regionStart + length++]= terminator;
+      for (page= regionStart >> 8;  page <= (regionStart + regionSize - 1) >> 8;  ++page)
+	trace->dirty[page]= 1;
+    }
+
+  outcome= runExpired;
+  trace->insns= 0;
+  trace->limit= budget;
+  trace->coverage->previous= 0;
+  M6502_run(mpu);
+
+  if (outcome == runExpired && hangs)
+    doAbort(mpu, mpu->registers->pc, 0);
+
+  for (page= 0;  page < 0x100;  ++page)
+    if (trace->dirty[page])
+      {
+	memcpy(mpu->memory + (page << 8), pristine + (page << 8), 0x100);
+	trace->dirty[page]= 0;
+      }
+  *mpu->registers= start;
+  return 0;
+}
+
+
+#if defined(FUZZ6502_REPLAY)
+
+int main(int argc, char **argv)
+{
+  static const char *outcomes[]= { "exited", "ran out of input", "ran out of instructions" };
+  int i;
+
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: FUZZ6502='options' %s input ...\n", argv[0]);
+      return 1;
+    }
+  LLVMFuzzerInitialize(&argc, &argv);
+  for (i= 1;  i < argc;  ++i)
+    {
+      FILE	   *file= fopen(argv[i], "r");
+      static byte   data[0x10000];
+      size_t	    size;
+      unsigned	    hit= 0, e;
+      uint64_t	    insns;
+      if (!file)
+	fail("%s: cannot open", argv[i]);
+      size= fread(data, 1, sizeof(data), file);
+      fclose(file);
+      memset(edges, 0, sizeof(edges));
+      LLVMFuzzerTestOneInput(data, size);
+      insns= mpu->trace->insns;
+      for (e= 0;  e < 0x10000;  ++e)
+	hit += !!edges[e];
+      printf("%s: %s after %llu instructions, %u edges\n",
+	     argv[i], outcomes[outcome], (unsigned long long)insns, hit);
+    }
+  return 0;
+}
+
+#endif
@@ -27,11 +27,23 @@
  *   - emulator+disassembler in same object file (library is kind of pointless)
  */
 
+/* MAP_ANON, pwrite and ftruncate are not declared under -D__STRICT_ANSI__ */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "lib6502.h"
 
+#if defined(M6502_STATS)
+# include <time.h>
+#endif
+
 typedef uint8_t  byte;
 typedef uint16_t word;
 
@@ -62,27 +74,81 @@ enum {
 
 #define NAND(P, Q)	(!((P) & (Q)))
 
-#define tick(n)
-#define tickIf(p)
+/* performance counters (compile with -DM6502_STATS) */
+
+#if defined(M6502_STATS)
+
+struct stats
+{
+  M6502_Stats counters;		/* what M6502_getStats reports */
+  uint64_t    started;		/* when the outermost M6502_run began */
+  int	      depth;		/* nesting of M6502_run */
+};
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int timedCallback(M6502 *mpu, int kind, M6502_Callback fn, word address, byte data)
+{
+  uint64_t start= now();
+  int	   result;
+  ++mpu->stats->callbacks[kind];
+  result= fn(mpu, address, data);
+  mpu->stats->callbackTime[kind] += now() - start;
+  return result;
+}
+
+# define tick(n)			(mpu->stats->cycles += (n))
+# define tickIf(p)			(mpu->stats->cycles += !!(p))
+# define retired()			(++mpu->stats->insns)
+# define callback(KIND, FN, ADDR, DATA)	timedCallback(mpu, M6502_##KIND##Callback, FN, ADDR, DATA)
+
+#else
+
+# define tick(n)
+# define tickIf(p)
+# define retired()			((void)0)
+# define callback(KIND, FN, ADDR, DATA)	(FN)(mpu, ADDR, DATA)
+
+#endif
+
+/* hooks for the traced interpreter (see runTraced) */
+
+#define written(ADDR)		((void)0)
+#define loaded(ADDR)		((void)0)
+#define executed(ADDR)		((void)0)
+#define branched(ADDR, TAKEN)	((void)0)
 
 /* memory access (indirect if callback installed) -- ARGUMENTS ARE EVALUATED MORE THAN ONCE! */
 
-#define putMemory(ADDR, BYTE)			\
-  ( writeCallback[ADDR]				\
-      ? writeCallback[ADDR](mpu, ADDR, BYTE)	\
+/* registers are externalised before a read or write callback so that the
+ * callback sees the state of the processor part-way through the insn */
+
+#define putMemory(ADDR, BYTE)					\
+  ( written(ADDR),						\
+    writeCallback[ADDR]						\
+      ? (externalise(), callback(Write, writeCallback[ADDR], ADDR, BYTE))	\
       : (memory[ADDR]= BYTE) )
 
-#define getMemory(ADDR)				\
-  ( readCallback[ADDR]				\
-      ?  readCallback[ADDR](mpu, ADDR, 0)	\
+#define getMemory(ADDR)						\
+  ( loaded(ADDR),						\
+    readCallback[ADDR]						\
+      ? (externalise(),  callback(Read, readCallback[ADDR], ADDR, 0))	\
       :  memory[ADDR] )
 
 /* stack access (always direct) */
 
-#define push(BYTE)		(memory[0x0100 + S--]= (BYTE))
-#define pop()			(memory[++S + 0x0100])
+#define push(BYTE)		(written(0x0100 + S), memory[0x0100 + S--]= (BYTE))
+#define pop()			(++S, loaded(0x0100 + S), memory[0x0100 + S])
+
+/* adressing modes (memory access direct; operands at the top of memory
+ * wrap round to the bottom) */
 
-/* adressing modes (memory access direct) */
+#define direct(ADDR)		(loaded((word)(ADDR)), memory[(word)(ADDR)])
 
 #define implied(ticks)				\
   tick(ticks);
@@ -93,12 +159,13 @@ enum {
 
 #define abs(ticks)				\
   tick(ticks);					\
-  ea= memory[PC] + (memory[PC + 1] << 8);	\
+  ea= direct(PC) + (direct(PC + 1) << 8);	\
   PC += 2;
 
 #define relative(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++];				\
+  ea= direct(PC);				\
+  PC++;						\
   if (ea & 0x80) ea -= 0x100;			\
   tickIf((ea >> 8) != (PC >> 8));
 
@@ -106,51 +173,56 @@ enum {
   tick(ticks);					\
   {						\
     word tmp;					\
-    tmp= memory[PC]  + (memory[PC  + 1] << 8);	\
-    ea = memory[tmp] + (memory[tmp + 1] << 8);	\
+    tmp= direct(PC)  + (direct(PC  + 1) << 8);	\
+    ea = direct(tmp) + (direct(tmp + 1) << 8);	\
     PC += 2;					\
   }
 
 #define absx(ticks)						\
   tick(ticks);							\
-  ea= memory[PC] + (memory[PC + 1] << 8);			\
+  ea= direct(PC) + (direct(PC + 1) << 8);			\
   PC += 2;							\
   tickIf((ticks == 4) && ((ea >> 8) != ((ea + X) >> 8)));	\
   ea += X;
 
 #define absy(ticks)						\
   tick(ticks);							\
-  ea= memory[PC] + (memory[PC + 1] << 8);			\
+  ea= direct(PC) + (direct(PC + 1) << 8);			\
   PC += 2;							\
   tickIf((ticks == 4) && ((ea >> 8) != ((ea + Y) >> 8)));	\
   ea += Y
 
 #define zp(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++];
+  ea= direct(PC);				\
+  PC++;
 
 #define zpx(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++] + X;				\
+  ea= direct(PC) + X;				\
+  PC++;						\
   ea &= 0x00ff;
 
 #define zpy(ticks)				\
   tick(ticks);					\
-  ea= memory[PC++] + Y;				\
+  ea= direct(PC) + Y;				\
+  PC++;						\
   ea &= 0x00ff;
 
 #define indx(ticks)				\
   tick(ticks);					\
   {						\
-    byte tmp= memory[PC++] + X;			\
-    ea= memory[tmp] + (memory[tmp + 1] << 8);	\
+    byte tmp= direct(PC) + X;			\
+    PC++;					\
+    ea= direct(tmp) + (direct((byte)(tmp + 1)) << 8);	\
   }
 
 #define indy(ticks)						\
   tick(ticks);							\
   {								\
-    byte tmp= memory[PC++];					\
-    ea= memory[tmp] + (memory[tmp + 1] << 8);			\
+    byte tmp= direct(PC);					\
+    PC++;							\
+    ea= direct(tmp) + (direct((byte)(tmp + 1)) << 8);		\
     tickIf((ticks == 5) && ((ea >> 8) != ((ea + Y) >> 8)));	\
     ea += Y;							\
   }
@@ -159,16 +231,17 @@ enum {
   tick(ticks);						\
   {							\
     word tmp;						\
-    tmp= memory[PC ] + (memory[PC  + 1] << 8) + X;	\
-    ea = memory[tmp] + (memory[tmp + 1] << 8);		\
+    tmp= direct(PC) + (direct(PC  + 1) << 8) + X;	\
+    ea = direct(tmp) + (direct(tmp + 1) << 8);		\
   }
 
 #define indzp(ticks)					\
   tick(ticks);						\
   {							\
     byte tmp;						\
-    tmp= memory[PC++];					\
-    ea = memory[tmp] + (memory[tmp + 1] << 8);		\
+    tmp= direct(PC);					\
+    PC++;						\
+    ea = direct(tmp) + (direct((byte)(tmp + 1)) << 8);	\
   }
 
 /* insns */
@@ -297,7 +370,9 @@ enum {
 #define inx(ticks, adrmode)	incR(ticks, adrmode, X)
 #define iny(ticks, adrmode)	incR(ticks, adrmode, Y)
 
-#define bit(ticks, adrmode)			\
+#define bit(ticks, adrmode)	bit_##adrmode(ticks, adrmode)
+
+#define bitm(ticks, adrmode)			\
   adrmode(ticks);				\
   fetch();					\
   {						\
@@ -320,6 +395,12 @@ enum {
   }						\
   next();
 
+#define bit_zp		bitm
+#define bit_zpx		bitm
+#define bit_abs		bitm
+#define bit_absx	bitm
+#define bit_immediate	bim
+
 #define tsb(ticks, adrmode)			\
   adrmode(ticks);				\
   fetch();					\
@@ -359,7 +440,7 @@ enum {
     unsigned int i= getMemory(ea) << 1;		\
     putMemory(ea, i);				\
     fetch();					\
-    setNZC(i & 0x80, !i, i >> 8);		\
+    setNZC(i & 0x80, !(i & 0xff), i >> 8);	\
   }						\
   next();
 
@@ -482,12 +563,14 @@ enum {
 #define branch(ticks, adrmode, cond)		\
   if (cond)					\
     {						\
+      branched(PC - 1, 1);			\
       adrmode(ticks);				\
       PC += ea;					\
       tick(1);					\
     }						\
   else						\
     {						\
+      branched(PC - 1, 0);			\
       tick(ticks);				\
       PC++;					\
     }						\
@@ -504,6 +587,7 @@ enum {
 #define bvs(ticks, adrmode)	branch(ticks, adrmode,  getV())
 
 #define bra(ticks, adrmode)			\
+  branched(PC - 1, 1);				\
   adrmode(ticks);				\
   PC += ea;					\
   fetch();					\
@@ -512,6 +596,7 @@ enum {
 
 #define jmp(ticks, adrmode)					\
   {								\
+      branched(PC - 1, 1);					\
       adrmode(ticks);						\
       byte opcode= mpu->memory[PC-3];                          	\
       PC= ea;							\
@@ -519,7 +604,7 @@ enum {
 	{							\
 	  word addr;						\
 	  externalise();					\
-	  if ((addr= mpu->callbacks->call[ea](mpu, ea, opcode)))\
+	  if ((addr= callback(Call, mpu->callbacks->call[ea], ea, opcode)))\
 	    {							\
 	      internalise();					\
 	      PC= addr;						\
@@ -530,6 +615,7 @@ enum {
   }
 
 #define jsr(ticks, adrmode)				\
+  branched(PC - 1, 1);					\
   PC++;							\
   push(PC >> 8);					\
   push(PC & 0xff);					\
@@ -539,7 +625,7 @@ enum {
     {							\
       word addr;					\
       externalise();					\
-      if ((addr= mpu->callbacks->call[ea](mpu, ea, 0x20))) \
+      if ((addr= callback(Call, mpu->callbacks->call[ea], ea, 0x20))) \
 	{						\
 	  internalise();				\
 	  PC= addr;					\
@@ -572,12 +658,13 @@ enum {
   push(P | flagX);						\
   P |= flagI;							\
   {								\
-    word hdlr= getMemory(0xfffe) + (getMemory(0xffff) << 8);	\
+    word hdlr= getMemory(0xfffe);				\
+    hdlr |= getMemory(0xffff) << 8;				\
     if (mpu->callbacks->call[hdlr])				\
       {								\
 	word addr;						\
 	externalise();						\
-	if ((addr= mpu->callbacks->call[hdlr](mpu, PC - 2, 0)))	\
+	if ((addr= callback(Call, mpu->callbacks->call[hdlr], PC - 2, 0)))	\
 	  {							\
 	    internalise();					\
 	    hdlr= addr;						\
@@ -606,13 +693,12 @@ enum {
   {											\
     word addr= PC-1;									\
     byte instruction= memory[addr];							\
-    tick(ticks);									\
     if (mpu->callbacks->illegal_instruction[instruction])				\
       {											\
 	adrmode(ticks);									\
 	externalise();									\
-        if (addr= (mpu->callbacks->illegal_instruction[instruction](mpu, addr,          \
-								    instruction)))      \
+        if (addr= (callback(Illegal, mpu->callbacks->illegal_instruction[instruction],  \
+				     addr, instruction)))				\
           {										\
 	    mpu->registers->pc= addr;							\
           }										\
@@ -745,10 +831,24 @@ enum {
 
 
 
+/* a clone snapshot is retaken once the instance it was taken from changes */
+
+struct _M6502_Clone
+{
+  int	   fd;		/* snapshot shared by clones of this instance, or -1 */
+  int	   fresh;	/* non-zero while the snapshot matches this instance */
+  uint8_t *mapping;	/* copy-on-write memory and callbacks of this clone */
+};
+
+#define changed(MPU)	((MPU)->clone ? (void)((MPU)->clone->fresh= 0) : (void)0)
+
+
 void M6502_irq(M6502 *mpu)
 {
+  changed(mpu);
   if (!(mpu->registers->p & flagI))
     {
+      if (mpu->trace) mpu->trace->dirty[0x01]= 1;
       mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc >> 8);
       mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc & 0xff);
       mpu->memory[0x0100 + mpu->registers->s--] = mpu->registers->p;
@@ -761,6 +861,8 @@ void M6502_irq(M6502 *mpu)
 
 void M6502_nmi(M6502 *mpu)
 {
+  changed(mpu);
+  if (mpu->trace) mpu->trace->dirty[0x01]= 1;
   mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc >> 8);
   mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc & 0xff);
   mpu->memory[0x0100 + mpu->registers->s--] = mpu->registers->p;
@@ -772,6 +874,7 @@ void M6502_nmi(M6502 *mpu)
 
 void M6502_reset(M6502 *mpu)
 {
+  changed(mpu);
   mpu->registers->p &= ~flagD;
   mpu->registers->p |=  flagI;
   mpu->registers->pc = M6502_getVector(mpu, RST);
@@ -786,26 +889,152 @@ static void oops(void)
 }
 
 
+/* the addresses of the instruction labels, for computed-goto dispatch */
+
+#define insnLabels	{ &&_00, &&_01, &&_02, &&_03, &&_04, &&_05, &&_06, &&_07, &&_08, &&_09, &&_0a, &&_0b, &&_0c, &&_0d, &&_0e, &&_0f, \
+		   &&_10, &&_11, &&_12, &&_13, &&_14, &&_15, &&_16, &&_17, &&_18, &&_19, &&_1a, &&_1b, &&_1c, &&_1d, &&_1e, &&_1f, \
+		   &&_20, &&_21, &&_22, &&_23, &&_24, &&_25, &&_26, &&_27, &&_28, &&_29, &&_2a, &&_2b, &&_2c, &&_2d, &&_2e, &&_2f, \
+		   &&_30, &&_31, &&_32, &&_33, &&_34, &&_35, &&_36, &&_37, &&_38, &&_39, &&_3a, &&_3b, &&_3c, &&_3d, &&_3e, &&_3f, \
+		   &&_40, &&_41, &&_42, &&_43, &&_44, &&_45, &&_46, &&_47, &&_48, &&_49, &&_4a, &&_4b, &&_4c, &&_4d, &&_4e, &&_4f, \
+		   &&_50, &&_51, &&_52, &&_53, &&_54, &&_55, &&_56, &&_57, &&_58, &&_59, &&_5a, &&_5b, &&_5c, &&_5d, &&_5e, &&_5f, \
+		   &&_60, &&_61, &&_62, &&_63, &&_64, &&_65, &&_66, &&_67, &&_68, &&_69, &&_6a, &&_6b, &&_6c, &&_6d, &&_6e, &&_6f, \
+		   &&_70, &&_71, &&_72, &&_73, &&_74, &&_75, &&_76, &&_77, &&_78, &&_79, &&_7a, &&_7b, &&_7c, &&_7d, &&_7e, &&_7f, \
+		   &&_80, &&_81, &&_82, &&_83, &&_84, &&_85, &&_86, &&_87, &&_88, &&_89, &&_8a, &&_8b, &&_8c, &&_8d, &&_8e, &&_8f, \
+		   &&_90, &&_91, &&_92, &&_93, &&_94, &&_95, &&_96, &&_97, &&_98, &&_99, &&_9a, &&_9b, &&_9c, &&_9d, &&_9e, &&_9f, \
+		   &&_a0, &&_a1, &&_a2, &&_a3, &&_a4, &&_a5, &&_a6, &&_a7, &&_a8, &&_a9, &&_aa, &&_ab, &&_ac, &&_ad, &&_ae, &&_af, \
+		   &&_b0, &&_b1, &&_b2, &&_b3, &&_b4, &&_b5, &&_b6, &&_b7, &&_b8, &&_b9, &&_ba, &&_bb, &&_bc, &&_bd, &&_be, &&_bf, \
+		   &&_c0, &&_c1, &&_c2, &&_c3, &&_c4, &&_c5, &&_c6, &&_c7, &&_c8, &&_c9, &&_ca, &&_cb, &&_cc, &&_cd, &&_ce, &&_cf, \
+		   &&_d0, &&_d1, &&_d2, &&_d3, &&_d4, &&_d5, &&_d6, &&_d7, &&_d8, &&_d9, &&_da, &&_db, &&_dc, &&_dd, &&_de, &&_df, \
+		   &&_e0, &&_e1, &&_e2, &&_e3, &&_e4, &&_e5, &&_e6, &&_e7, &&_e8, &&_e9, &&_ea, &&_eb, &&_ec, &&_ed, &&_ee, &&_ef, \
+		   &&_f0, &&_f1, &&_f2, &&_f3, &&_f4, &&_f5, &&_f6, &&_f7, &&_f8, &&_f9, &&_fa, &&_fb, &&_fc, &&_fd, &&_fe, &&_ff }
+
+
+/* moving registers between the M6502 and the interpreter's locals */
+
+#define internalise()	A= mpu->registers->a;  X= mpu->registers->x;  Y= mpu->registers->y;  P= mpu->registers->p;  S= mpu->registers->s;  PC= mpu->registers->pc
+#define externalise()	(mpu->registers->a= A,  mpu->registers->x= X,  mpu->registers->y= Y,  mpu->registers->p= P,  mpu->registers->s= S,  mpu->registers->pc= PC)
+
+
+/* The traced interpreter counts instructions in mpu->trace, returns
+ * when the count reaches trace->limit (unless trace->expired asks for
+ * more) and notes the pages of memory written by the processor.
+ * M6502_run uses it only for an mpu that has a trace, so the ordinary
+ * interpreter pays nothing for it.
+ */
+
+static void covered(M6502_Coverage *coverage, word address, int taken)
+{
+  uint8_t *bits= taken ? coverage->taken : coverage->notTaken;
+  bits[address >> 3] |= 1 << (address & 7);
+  if (coverage->counts)
+    ++coverage->counts[address][taken];
+  if (coverage->edges)
+    {
+      /* as in AFL: the edge is named by this outcome (address and
+       * direction) XORed with the address of the last, which is not
+       * shifted along with it so that A->B and B->A differ */
+      word	site= (address << 1) | taken;
+      uint8_t *edge= &coverage->edges[(word)(site ^ coverage->previous)];
+      if (*edge != 0xff)
+	++*edge;
+      coverage->previous= address;
+    }
+}
+
+
+static void heat(M6502_Heatmap *heatmap, unsigned address, int write)
+{
+  address &= 0xffff;
+  ++heatmap->pages[address >> 8][write];
+  if (heatmap->detailed[address >> 8])
+    ++heatmap->addresses[address][write];
+}
+
+
+static void runTraced(M6502 *mpu)
+{
+  M6502_Trace *trace= mpu->trace;
+
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+
+  static void *itab[256]= insnLabels;
+
+  register void **itabp= &itab[0];
+  register void  *tpc;
+
+# define begin()				fetch();  executed(PC - 1);  goto *tpc
+# define fetch()				tpc= itabp[memory[PC++]]
+# define next()					{ if (++trace->insns >= trace->limit) goto expired;  executed(PC - 1);  goto *tpc; }
+# define dispatch(num, name, mode, cycles)	_##num: retired();  name(cycles, mode) oops();  next()
+# define end()
+
+#else /* (!__GNUC__) || (__STRICT_ANSI__) */
+
+# define begin()				while (trace->insns < trace->limit) { executed(PC);  switch (memory[PC++]) {
+# define fetch()
+# define next()					break
+# define dispatch(num, name, mode, cycles)	case 0x##num: retired();  name(cycles, mode);  next()
+# define end()					} ++trace->insns; }
+
+#endif
+
+# undef  written
+# undef  loaded
+# undef  executed
+# undef  branched
+# define written(ADDR)				(trace->dirty[((ADDR) >> 8) & 0xff]= 1, trace->heatmap ? heat(trace->heatmap, ADDR, 1) : (void)0)
+# define loaded(ADDR)				(trace->heatmap ? heat(trace->heatmap, ADDR, 0) : (void)0)
+# define executed(ADDR)				(trace->coverage ? (void)(trace->coverage->executed[(ADDR) >> 3] |= 1 << ((ADDR) & 7)) : (void)0)
+# define branched(ADDR, TAKEN)			(trace->coverage ? covered(trace->coverage, ADDR, TAKEN) : (void)0)
+
+  register byte  *memory= mpu->memory;
+  register word   PC;
+  word		  ea;
+  byte		  A, X, Y, P, S;
+  M6502_Callback *readCallback=  mpu->callbacks->read;
+  M6502_Callback *writeCallback= mpu->callbacks->write;
+
+  for (;;)
+    {
+      internalise();
+      if (trace->insns < trace->limit)
+	{
+	  begin();
+	  do_insns(dispatch);
+	  end();
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+	expired:
+	  --PC;		/* the next opcode has already been fetched */
+#endif
+	  externalise();
+	}
+      if (!trace->expired || !trace->expired(mpu))
+	break;
+    }
+
+# undef begin
+# undef fetch
+# undef next
+# undef dispatch
+# undef end
+# undef  written
+# undef  loaded
+# undef  executed
+# undef  branched
+# define written(ADDR)				((void)0)
+# define loaded(ADDR)				((void)0)
+# define executed(ADDR)				((void)0)
+# define branched(ADDR, TAKEN)			((void)0)
+}
+
+
+extern void M6502_syncHistory(M6502 *mpu);	/* debug6502.c */
+
 void M6502_run(M6502 *mpu)
 {
 #if defined(__GNUC__) && !defined(__STRICT_ANSI__)
 
-  static void *itab[256]= { &&_00, &&_01, &&_02, &&_03, &&_04, &&_05, &&_06, &&_07, &&_08, &&_09, &&_0a, &&_0b, &&_0c, &&_0d, &&_0e, &&_0f,
-			    &&_10, &&_11, &&_12, &&_13, &&_14, &&_15, &&_16, &&_17, &&_18, &&_19, &&_1a, &&_1b, &&_1c, &&_1d, &&_1e, &&_1f,
-			    &&_20, &&_21, &&_22, &&_23, &&_24, &&_25, &&_26, &&_27, &&_28, &&_29, &&_2a, &&_2b, &&_2c, &&_2d, &&_2e, &&_2f,
-			    &&_30, &&_31, &&_32, &&_33, &&_34, &&_35, &&_36, &&_37, &&_38, &&_39, &&_3a, &&_3b, &&_3c, &&_3d, &&_3e, &&_3f,
-			    &&_40, &&_41, &&_42, &&_43, &&_44, &&_45, &&_46, &&_47, &&_48, &&_49, &&_4a, &&_4b, &&_4c, &&_4d, &&_4e, &&_4f,
-			    &&_50, &&_51, &&_52, &&_53, &&_54, &&_55, &&_56, &&_57, &&_58, &&_59, &&_5a, &&_5b, &&_5c, &&_5d, &&_5e, &&_5f,
-			    &&_60, &&_61, &&_62, &&_63, &&_64, &&_65, &&_66, &&_67, &&_68, &&_69, &&_6a, &&_6b, &&_6c, &&_6d, &&_6e, &&_6f,
-			    &&_70, &&_71, &&_72, &&_73, &&_74, &&_75, &&_76, &&_77, &&_78, &&_79, &&_7a, &&_7b, &&_7c, &&_7d, &&_7e, &&_7f,
-			    &&_80, &&_81, &&_82, &&_83, &&_84, &&_85, &&_86, &&_87, &&_88, &&_89, &&_8a, &&_8b, &&_8c, &&_8d, &&_8e, &&_8f,
-			    &&_90, &&_91, &&_92, &&_93, &&_94, &&_95, &&_96, &&_97, &&_98, &&_99, &&_9a, &&_9b, &&_9c, &&_9d, &&_9e, &&_9f,
-			    &&_a0, &&_a1, &&_a2, &&_a3, &&_a4, &&_a5, &&_a6, &&_a7, &&_a8, &&_a9, &&_aa, &&_ab, &&_ac, &&_ad, &&_ae, &&_af,
-			    &&_b0, &&_b1, &&_b2, &&_b3, &&_b4, &&_b5, &&_b6, &&_b7, &&_b8, &&_b9, &&_ba, &&_bb, &&_bc, &&_bd, &&_be, &&_bf,
-			    &&_c0, &&_c1, &&_c2, &&_c3, &&_c4, &&_c5, &&_c6, &&_c7, &&_c8, &&_c9, &&_ca, &&_cb, &&_cc, &&_cd, &&_ce, &&_cf,
-			    &&_d0, &&_d1, &&_d2, &&_d3, &&_d4, &&_d5, &&_d6, &&_d7, &&_d8, &&_d9, &&_da, &&_db, &&_dc, &&_dd, &&_de, &&_df,
-			    &&_e0, &&_e1, &&_e2, &&_e3, &&_e4, &&_e5, &&_e6, &&_e7, &&_e8, &&_e9, &&_ea, &&_eb, &&_ec, &&_ed, &&_ee, &&_ef,
-			    &&_f0, &&_f1, &&_f2, &&_f3, &&_f4, &&_f5, &&_f6, &&_f7, &&_f8, &&_f9, &&_fa, &&_fb, &&_fc, &&_fd, &&_fe, &&_ff };
+  static void *itab[256]= insnLabels;
 
   register void **itabp= &itab[0];
   register void  *tpc;
@@ -814,7 +1043,7 @@ void M6502_run(M6502 *mpu)
 # define fetch()				tpc= itabp[memory[PC++]]
 /* sf temp # define fetch()				do { tpc= itabp[memory[PC++]]; fprintf(stderr, "todo: %04X %02X\n", (unsigned) (PC-1), (unsigned) memory[PC-1]); } while(0) */
 # define next()					goto *tpc
-# define dispatch(num, name, mode, cycles)	_##num: name(cycles, mode) oops();  next()
+# define dispatch(num, name, mode, cycles)	_##num: retired();  name(cycles, mode) oops();  next()
 # define end()
 
 #else /* (!__GNUC__) || (__STRICT_ANSI__) */
@@ -822,7 +1051,7 @@ void M6502_run(M6502 *mpu)
 # define begin()				for (;;) switch (memory[PC++]) {
 # define fetch()
 # define next()					break
-# define dispatch(num, name, mode, cycles)	case 0x##num: name(cycles, mode);  next()
+# define dispatch(num, name, mode, cycles)	case 0x##num: retired();  name(cycles, mode);  next()
 # define end()					}
 
 #endif
@@ -834,8 +1063,77 @@ void M6502_run(M6502 *mpu)
   M6502_Callback *readCallback=  mpu->callbacks->read;
   M6502_Callback *writeCallback= mpu->callbacks->write;
 
-# define internalise()	A= mpu->registers->a;  X= mpu->registers->x;  Y= mpu->registers->y;  P= mpu->registers->p;  S= mpu->registers->s;  PC= mpu->registers->pc
-# define externalise()	mpu->registers->a= A;  mpu->registers->x= X;  mpu->registers->y= Y;  mpu->registers->p= P;  mpu->registers->s= S;  mpu->registers->pc= PC
+#if defined(M6502_STATS)
+  struct stats *stats= (struct stats *)mpu->stats;
+  if (!stats->depth++) stats->started= now();
+#endif
+
+  changed(mpu);
+  if (mpu->debug)
+    M6502_syncHistory(mpu);
+  if (mpu->trace)
+    runTraced(mpu);
+  else
+    {
+      internalise();
+
+      begin();
+      do_insns(dispatch);
+      end();
+
+      externalise();
+    }
+
+#if defined(M6502_STATS)
+  if (!--stats->depth) stats->counters.runTime += now() - stats->started;
+#endif
+# undef begin
+# undef fetch
+# undef next
+# undef dispatch
+# undef end
+
+}
+
+
+static void stepTraced(M6502 *mpu)
+{
+  M6502_Trace *trace= mpu->trace;
+  uint64_t     limit= trace->limit;
+  int	     (*expired)(M6502 *)= trace->expired;
+
+  trace->limit= trace->insns + 1;
+  trace->expired= 0;
+  runTraced(mpu);
+  trace->limit= limit;
+  trace->expired= expired;
+}
+
+
+/* execute exactly one instruction.  the switch is used regardless of
+ * compiler so that next() can simply leave it after the insn. */
+
+void M6502_step(M6502 *mpu)
+{
+# define begin()				switch (memory[PC++]) {
+# define fetch()
+# define next()					break
+# define dispatch(num, name, mode, cycles)	case 0x##num: retired();  name(cycles, mode);  next()
+# define end()					}
+
+  register byte  *memory= mpu->memory;
+  register word   PC;
+  word		  ea;
+  byte		  A, X, Y, P, S;
+  M6502_Callback *readCallback=  mpu->callbacks->read;
+  M6502_Callback *writeCallback= mpu->callbacks->write;
+
+  changed(mpu);
+  if (mpu->trace)
+    {
+      stepTraced(mpu);
+      return;
+    }
 
   internalise();
 
@@ -845,47 +1143,257 @@ void M6502_run(M6502 *mpu)
 
   externalise();
 # undef begin
-# undef internalise
-# undef externalise
 # undef fetch
 # undef next
 # undef dispatch
 # undef end
+}
+
+
+/* decoding.  the table is generated from do_insns; the flags each insn
+ * reads and writes are listed here by mnemonic. */
+
+#define NVZC	(flagN | flagV | flagZ | flagC)
+#define NZC	(flagN | flagZ | flagC)
+#define NZ	(flagN | flagZ)
+#define ALL	(flagN | flagV | flagB | flagD | flagI | flagZ | flagC)
+
+#define flags_adc(mode)		flagC | flagD,	NVZC
+#define flags_and(mode)		0,		NZ
+#define flags_asl(mode)		0,		NZC
+#define flags_asla(mode)	0,		NZC
+#define flags_bcc(mode)		flagC,		0
+#define flags_bcs(mode)		flagC,		0
+#define flags_beq(mode)		flagZ,		0
+#define flags_bit(mode)		0,		((mode) == M6502_Immediate ? flagZ : flagN | flagV | flagZ)
+#define flags_bmi(mode)		flagN,		0
+#define flags_bne(mode)		flagZ,		0
+#define flags_bpl(mode)		flagN,		0
+#define flags_bra(mode)		0,		0
+#define flags_brk(mode)		ALL,		flagB | flagD | flagI
+#define flags_bvc(mode)		flagV,		0
+#define flags_bvs(mode)		flagV,		0
+#define flags_clc(mode)		0,		flagC
+#define flags_cld(mode)		0,		flagD
+#define flags_cli(mode)		0,		flagI
+#define flags_clv(mode)		0,		flagV
+#define flags_cmp(mode)		0,		NZC
+#define flags_cpx(mode)		0,		NZC
+#define flags_cpy(mode)		0,		NZC
+#define flags_dea(mode)		0,		NZ
+#define flags_dec(mode)		0,		NZ
+#define flags_dex(mode)		0,		NZ
+#define flags_dey(mode)		0,		NZ
+#define flags_eor(mode)		0,		NZ
+#define flags_ill(mode)		0,		0
+#define flags_ina(mode)		0,		NZ
+#define flags_inc(mode)		0,		NZ
+#define flags_inx(mode)		0,		NZ
+#define flags_iny(mode)		0,		NZ
+#define flags_jmp(mode)		0,		0
+#define flags_jsr(mode)		0,		0
+#define flags_lda(mode)		0,		NZ
+#define flags_ldx(mode)		0,		NZ
+#define flags_ldy(mode)		0,		NZ
+#define flags_lsr(mode)		0,		NZC
+#define flags_lsra(mode)	0,		NZC
+#define flags_nop(mode)		0,		0
+#define flags_ora(mode)		0,		NZ
+#define flags_pha(mode)		0,		0
+#define flags_php(mode)		ALL,		0
+#define flags_phx(mode)		0,		0
+#define flags_phy(mode)		0,		0
+#define flags_pla(mode)		0,		NZ
+#define flags_plp(mode)		0,		ALL
+#define flags_plx(mode)		0,		NZ
+#define flags_ply(mode)		0,		NZ
+#define flags_rol(mode)		flagC,		NZC
+#define flags_rola(mode)	flagC,		NZC
+#define flags_ror(mode)		flagC,		NZC
+#define flags_rora(mode)	flagC,		NZC
+#define flags_rti(mode)		0,		ALL
+#define flags_rts(mode)		0,		0
+#define flags_sbc(mode)		flagC | flagD,	NVZC
+#define flags_sec(mode)		0,		flagC
+#define flags_sed(mode)		0,		flagD
+#define flags_sei(mode)		0,		flagI
+#define flags_sta(mode)		0,		0
+#define flags_stx(mode)		0,		0
+#define flags_sty(mode)		0,		0
+#define flags_stz(mode)		0,		0
+#define flags_tax(mode)		0,		NZ
+#define flags_tay(mode)		0,		NZ
+#define flags_trb(mode)		0,		flagZ
+#define flags_tsb(mode)		0,		flagZ
+#define flags_tsx(mode)		0,		NZ
+#define flags_txa(mode)		0,		NZ
+#define flags_txs(mode)		0,		0
+#define flags_tya(mode)		0,		NZ
+
+#define decode_implied		M6502_Implied,	 1
+#define decode_immediate	M6502_Immediate, 2
+#define decode_zp		M6502_Zp,	 2
+#define decode_zpx		M6502_Zpx,	 2
+#define decode_zpy		M6502_Zpy,	 2
+#define decode_abs		M6502_Abs,	 3
+#define decode_absx		M6502_Absx,	 3
+#define decode_absy		M6502_Absy,	 3
+#define decode_relative		M6502_Relative,	 2
+#define decode_indirect		M6502_Indirect,	 3
+#define decode_indzp		M6502_Indzp,	 2
+#define decode_indx		M6502_Indx,	 2
+#define decode_indy		M6502_Indy,	 2
+#define decode_indabsx		M6502_Indabsx,	 3
+
+#define modeOf(mode)		modeOf_(decode_##mode)
+#define modeOf_(...)		modeOf__(__VA_ARGS__)
+#define modeOf__(M, L)		M
+
+static const char *mnemonics[M6502_Mnemonics]= {
+# define mnemonic(NAME)	#NAME,
+  M6502_mnemonics(mnemonic)
+# undef mnemonic
+};
+
 
+int M6502_decode(M6502 *mpu, word ip, M6502_Insn *insn)
+{
+  byte *memory= mpu->memory;
+
+  switch (memory[ip])
+    {
+#     define decoded(num, name, mode, cycles)							\
+	case 0x##num:										\
+	  { static const M6502_Insn decoding= { 0x##num, M6502_##name, decode_##mode, cycles,	\
+						flags_##name(modeOf(mode)), 0 };		\
+	    *insn= decoding; }									\
+	  break
+      do_insns(decoded);
+#     undef decoded
+    }
+  switch (insn->length)
+    {
+    case 2:
+      insn->operand= memory[(word)(ip + 1)];
+      if (insn->mode == M6502_Relative)
+	insn->operand= ip + 2 + (int8_t)insn->operand;
+      break;
+    case 3:
+      insn->operand= memory[(word)(ip + 1)] | (memory[(word)(ip + 2)] << 8);
+      break;
+    }
+  return insn->length;
 }
 
+#undef NVZC
+#undef NZC
+#undef NZ
+#undef ALL
 
-int M6502_disassemble(M6502 *mpu, word ip, char buffer[64])
+
+const char *M6502_mnemonic(unsigned mnemonic)
+{
+  return (mnemonic < M6502_Mnemonics) ? mnemonics[mnemonic] : 0;
+}
+
+
+/* formatting without printf, shared by M6502_disassemble and
+ * M6502_disassembleRange */
+
+static const char hexDigits[16]= "0123456789ABCDEF";
+
+static inline char *hex2(char *s, byte b)
 {
-  char *s= buffer;
-  byte *b= mpu->memory + ip;
+  s[0]= hexDigits[b >> 4];
+  s[1]= hexDigits[b & 15];
+  return s + 2;
+}
 
-  switch (b[0])
+static inline char *hex4(char *s, word w)
+{
+  return hex2(hex2(s, w >> 8), w);
+}
+
+static char *formatInsn(char *s, M6502_Insn *insn)
+{
+  const char *name= mnemonics[insn->mnemonic];
+  word	      operand= insn->operand;
+
+  while (*name) *s++= *name++;
+  *s++= ' ';
+  switch (insn->mode)
     {
-#    define _implied							    return 1;
-#    define _immediate	sprintf(s, "#%02X",	   b[1]);		    return 2;
-#    define _zp		sprintf(s, "%02X",	   b[1]);		    return 2;
-#    define _zpx	sprintf(s, "%02X,X",	   b[1]);		    return 2;
-#    define _zpy	sprintf(s, "%02X,Y",	   b[1]);		    return 2;
-#    define _abs	sprintf(s, "%02X%02X",	   b[2], b[1]);		    return 3;
-#    define _absx	sprintf(s, "%02X%02X,X",   b[2], b[1]);		    return 3;
-#    define _absy	sprintf(s, "%02X%02X,Y",   b[2], b[1]);		    return 3;
-#    define _relative	sprintf(s, "%04X",	   ip + 2 + (int8_t)b[1]);  return 2;
-#    define _indirect	sprintf(s, "(%02X%02X)",   b[2], b[1]);		    return 3;
-#    define _indzp	sprintf(s, "(%02X)",	   b[1]);		    return 2;
-#    define _indx	sprintf(s, "(%02X,X)",	   b[1]);		    return 2;
-#    define _indy	sprintf(s, "(%02X),Y",	   b[1]);		    return 2;
-#    define _indabsx	sprintf(s, "(%02X%02X,X)", b[2], b[1]);		    return 3;
-
-#    define disassemble(num, name, mode, cycles) case 0x##num: s += sprintf(s, "%s ", #name); _##mode
-      do_insns(disassemble);
-#    undef _do
+    case M6502_Implied:						break;
+    case M6502_Immediate:  *s++= '#';  s= hex2(s, operand);	break;
+    case M6502_Zp:	   s= hex2(s, operand);			break;
+    case M6502_Zpx:	   s= hex2(s, operand);  *s++= ',';  *s++= 'X';			break;
+    case M6502_Zpy:	   s= hex2(s, operand);  *s++= ',';  *s++= 'Y';			break;
+    case M6502_Abs:	   s= hex4(s, operand);			break;
+    case M6502_Absx:	   s= hex4(s, operand);  *s++= ',';  *s++= 'X';			break;
+    case M6502_Absy:	   s= hex4(s, operand);  *s++= ',';  *s++= 'Y';			break;
+    case M6502_Relative:   s= hex4(s, operand);			break;
+    case M6502_Indirect:   *s++= '(';  s= hex4(s, operand);  *s++= ')';			break;
+    case M6502_Indzp:	   *s++= '(';  s= hex2(s, operand);  *s++= ')';			break;
+    case M6502_Indx:	   *s++= '(';  s= hex2(s, operand);  *s++= ',';  *s++= 'X';  *s++= ')';	break;
+    case M6502_Indy:	   *s++= '(';  s= hex2(s, operand);  *s++= ')';  *s++= ',';  *s++= 'Y';	break;
+    case M6502_Indabsx:	   *s++= '(';  s= hex4(s, operand);  *s++= ',';  *s++= 'X';  *s++= ')';	break;
     }
+  return s;
+}
 
-  return 0;
+
+int M6502_disassemble(M6502 *mpu, word ip, char buffer[64])
+{
+  M6502_Insn insn;
+
+  M6502_decode(mpu, ip, &insn);
+  *formatInsn(buffer, &insn)= '\0';
+  return insn.length;
 }
 
 
+/* one line per insn, as run6502 -d prints them: address, bytes, the bytes
+ * again as characters, and the insn.  stops before last or when the next
+ * line might not fit, and answers the number of characters written. */
+
+#define LINE_MAX	64
+
+size_t M6502_disassembleRange(M6502 *mpu, unsigned *address, unsigned last, char *buffer, size_t size)
+{
+  byte	    *memory= mpu->memory;
+  char	    *s= buffer, *limit= buffer + size;
+  unsigned   ip= *address;
+  M6502_Insn insn;
+
+  while (ip < last && limit - s >= LINE_MAX)
+    {
+      int i;
+      M6502_decode(mpu, ip, &insn);
+      s= hex4(s, ip);
+      *s++= ' ';
+      for (i= 0;  i < insn.length;  ++i)  s= hex2(s, memory[(word)(ip + i)]);
+      for (     ;  i < 3;	    ++i)  *s++= ' ', *s++= ' ';
+      *s++= ' ';
+      for (i= 0;  i < insn.length;  ++i)
+	{
+	  byte c= memory[(word)(ip + i)];
+	  *s++= (c > ' ' && c < 0x7f) ? c : ' ';
+	}
+      for (     ;  i < 3;	    ++i)  *s++= ' ';
+      *s++= ' ';
+      s= formatInsn(s, &insn);
+      *s++= '\n';
+      ip += insn.length;
+    }
+  if (s < limit)
+    *s= '\0';
+  *address= ip;
+  return s - buffer;
+}
+
+#undef LINE_MAX
+
+
 void M6502_dump(M6502 *mpu, char buffer[64])
 {
   M6502_Registers *r= mpu->registers;
@@ -922,15 +1430,791 @@ M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callback
   mpu->memory    = memory;
   mpu->callbacks = callbacks;
 
+#if defined(M6502_STATS)
+  if (!(mpu->stats= calloc(1, sizeof(struct stats)))) outOfMemory();
+#endif
+
   return mpu;
 }
 
 
+/* A snapshot holds memory then callbacks in an unlinked shared memory
+ * object; pages that are entirely zero (most of the callback tables) are
+ * left as holes.  Clones map it privately, so they share every page until
+ * they write to it.
+ */
+
+#define CLONE_MEMORY	sizeof(M6502_Memory)
+#define CLONE_SIZE	(sizeof(M6502_Memory) + sizeof(M6502_Callbacks))
+
+static int writePages(int fd, const uint8_t *data, size_t length, off_t offset)
+{
+  size_t page= sysconf(_SC_PAGESIZE), done, i;
+  for (done= 0;  done < length;  done += page)
+    {
+      size_t size= (length - done < page) ? length - done : page;
+      for (i= 0;  (i < size) && !data[done + i];  ++i);
+      if ((i < size) && (pwrite(fd, data + done, size, offset + done) != (ssize_t)size))
+	return 0;
+    }
+  return 1;
+}
+
+
+extern void M6502_undebug(M6502 *mpu, uint8_t *memory, M6502_Callbacks *callbacks);	/* debug6502.c */
+
+static int snapshot(M6502 *mpu)
+{
+  static unsigned serial= 0;
+  char	   name[64];
+  int	   fd;
+  uint8_t *copy= 0, *memory= mpu->memory, *callbacks= (uint8_t *)mpu->callbacks;
+  int	   ok;
+
+  /* clones get the bytes and callbacks that breakpoints and history displaced */
+  if (mpu->debug)
+    {
+      if (!(copy= malloc(CLONE_SIZE))) outOfMemory();
+      memcpy(copy, mpu->memory, CLONE_MEMORY);
+      memcpy(copy + CLONE_MEMORY, mpu->callbacks, sizeof(M6502_Callbacks));
+      M6502_undebug(mpu, copy, (M6502_Callbacks *)(copy + CLONE_MEMORY));
+      memory= copy;
+      callbacks= copy + CLONE_MEMORY;
+    }
+
+  sprintf(name, "/lib6502-%ld-%u", (long)getpid(), serial++);
+  if ((fd= shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+    {
+      free(copy);
+      return -1;
+    }
+  shm_unlink(name);
+  ok= ((ftruncate(fd, CLONE_SIZE) >= 0)
+       && writePages(fd, memory, CLONE_MEMORY, 0)
+       && writePages(fd, callbacks, sizeof(M6502_Callbacks), CLONE_MEMORY));
+  free(copy);
+  if (!ok)
+    {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+
+M6502 *M6502_clone(M6502 *mpu)
+{
+  M6502_Registers *registers;
+  M6502		  *clone;
+  uint8_t	  *mapping;
+
+  if (!mpu->clone)
+    {
+      if (!(mpu->clone= calloc(1, sizeof(M6502_Clone)))) outOfMemory();
+      mpu->clone->fd= -1;
+    }
+  if (!mpu->clone->fresh)
+    {
+      if (mpu->clone->fd >= 0) close(mpu->clone->fd);
+      if ((mpu->clone->fd= snapshot(mpu)) < 0)
+	return 0;
+      mpu->clone->fresh= 1;
+    }
+  mapping= mmap(0, CLONE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, mpu->clone->fd, 0);
+  if (MAP_FAILED == mapping)
+    return 0;
+  if (!(registers= malloc(sizeof(M6502_Registers)))) outOfMemory();
+  *registers= *mpu->registers;
+  clone= M6502_new(registers, mapping, (M6502_Callbacks *)(mapping + CLONE_MEMORY));
+  clone->flags |= M6502_RegistersAllocated;
+  if (!(clone->clone= calloc(1, sizeof(M6502_Clone)))) outOfMemory();
+  clone->clone->fd= -1;
+  clone->clone->mapping= mapping;
+  return clone;
+}
+
+
+/* A pool is one mapping divided into 2MB slots (so that each can be a
+ * single huge page where the system provides them), each holding the
+ * memory, callbacks, registers and M6502 of one instance.  Released slots
+ * are reset by discarding their pages, so only those that were touched
+ * cost anything, and they read as zero when next used.
+ */
+
+#define POOL_SLOT	0x200000
+
+struct slot
+{
+  M6502_Memory	  memory;
+  M6502_Callbacks callbacks;
+  M6502		  mpu;
+  M6502_Registers registers;
+#if defined(M6502_STATS)
+  struct stats	  stats;
+#endif
+};
+
+struct _M6502_Pool
+{
+  uint8_t	*slab;		/* count slots of POOL_SLOT bytes */
+  size_t	 size;		/* ... as mapped */
+  unsigned	 count;
+  unsigned	 free;		/* slots available */
+  unsigned	*available;	/* their indices */
+};
+
+
+M6502_Pool *M6502_newPool(unsigned count)
+{
+  M6502_Pool *pool= calloc(1, sizeof(M6502_Pool));
+  uint8_t    *base;
+  size_t      slack;
+  unsigned    i;
+
+  if (!pool || !(pool->available= calloc(count, sizeof(unsigned)))) outOfMemory();
+  pool->size= (size_t)count * POOL_SLOT;
+  base= mmap(0, pool->size + POOL_SLOT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (MAP_FAILED == base)
+    {
+      free(pool->available);
+      free(pool);
+      return 0;
+    }
+  /* align the slots to POOL_SLOT and give back the rest */
+  slack= (POOL_SLOT - ((unsigned long)base & (POOL_SLOT - 1))) & (POOL_SLOT - 1);
+  if (slack) munmap(base, slack);
+  munmap(base + slack + pool->size, POOL_SLOT - slack);
+  pool->slab= base + slack;
+  pool->count= pool->free= count;
+  for (i= 0;  i < count;  ++i)
+    pool->available[i]= count - 1 - i;
+  return pool;
+}
+
+
+M6502 *M6502_acquire(M6502_Pool *pool)
+{
+  struct slot *slot;
+
+  if (!pool->free)
+    return M6502_new(0, 0, 0);
+  slot= (struct slot *)(pool->slab + (size_t)pool->available[--pool->free] * POOL_SLOT);
+  slot->mpu.registers= &slot->registers;
+  slot->mpu.memory=    slot->memory;
+  slot->mpu.callbacks= &slot->callbacks;
+  slot->mpu.pool=      pool;
+#if defined(M6502_STATS)
+  slot->mpu.stats=     (M6502_Stats *)&slot->stats;
+#endif
+  return &slot->mpu;
+}
+
+
+static void releaseSlot(M6502 *mpu)
+{
+  M6502_Pool  *pool= mpu->pool;
+  uint8_t     *slot= (uint8_t *)mpu - offsetof(struct slot, mpu);
+  size_t       used= (sizeof(struct slot) + sysconf(_SC_PAGESIZE) - 1) & ~(sysconf(_SC_PAGESIZE) - 1);
+
+#if defined(MADV_DONTNEED) && defined(__linux__)
+  madvise(slot, used, MADV_DONTNEED);		/* private anonymous pages read back as zero */
+#else
+  if (MAP_FAILED == mmap(slot, used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0))
+    memset(slot, 0, sizeof(struct slot));
+#endif
+  pool->available[pool->free++]= (slot - pool->slab) / POOL_SLOT;
+}
+
+
+void M6502_deletePool(M6502_Pool *pool)
+{
+  munmap(pool->slab, pool->size);
+  free(pool->available);
+  free(pool);
+}
+
+
+/* A batch runs many clones of one instance in lockstep.  The registers
+ * of the lanes that still share a PC are kept in arrays, one element per
+ * lane, so each insn is decoded once and the common ones are executed by
+ * loops over the lanes that the compiler can vectorise.  Everything else
+ * goes through the ordinary insn macros one lane at a time.  A lane that
+ * ends up at a different PC from the first leaves the lockstep and
+ * finishes on its own in M6502_run.
+ */
+
+struct _M6502_Batch
+{
+  unsigned  count;		/* lanes */
+  M6502   **lanes;		/* one clone per lane */
+  unsigned *id;			/* lane of each element in lockstep */
+  byte	   *a, *x, *y, *p, *s;	/* its registers */
+  word	   *pc;			/* its PC after the current insn */
+  byte	  **memory;		/* its memory */
+  uint64_t *start;		/* its trace->insns when the lockstep began */
+  byte	   *m;			/* its operand for the current insn */
+  word	   *e;			/* and that operand's address, if indexed */
+  byte	    length[0x100];	/* of each insn */
+};
+
+
+M6502_Batch *M6502_newBatch(M6502 *mpu, unsigned count)
+{
+  M6502_Batch *batch= calloc(1, sizeof(M6502_Batch));
+  uint64_t     limit= mpu->trace ? mpu->trace->limit : ~(uint64_t)0;
+
+  if (!batch) outOfMemory();
+  batch->lanes=  calloc(count, sizeof(M6502 *));
+  batch->id=	 calloc(count, sizeof(unsigned));
+  batch->a=	 calloc(count, 5);
+  batch->pc=	 calloc(count, sizeof(word));
+  batch->memory= calloc(count, sizeof(byte *));
+  batch->start=	 calloc(count, sizeof(uint64_t));
+  batch->m=	 calloc(count, 1);
+  batch->e=	 calloc(count, sizeof(word));
+  if (!batch->lanes || !batch->id || !batch->a || !batch->pc || !batch->memory || !batch->start || !batch->m || !batch->e)
+    outOfMemory();
+  batch->x= batch->a + count;
+  batch->y= batch->x + count;
+  batch->p= batch->y + count;
+  batch->s= batch->p + count;
+
+  for (batch->count= 0;  batch->count < count;  ++batch->count)
+    {
+      M6502 *lane= M6502_clone(mpu);
+      if (!lane)
+	{
+	  M6502_deleteBatch(batch);
+	  return 0;
+	}
+      M6502_trace(lane)->limit= limit;
+      batch->lanes[batch->count]= lane;
+    }
+
+# define length_implied		1
+# define length_immediate	2
+# define length_zp		2
+# define length_zpx		2
+# define length_zpy		2
+# define length_relative	2
+# define length_indx		2
+# define length_indy		2
+# define length_indzp		2
+# define length_abs		3
+# define length_absx		3
+# define length_absy		3
+# define length_indirect	3
+# define length_indabsx		3
+# define setLength(num, name, mode, cycles)	batch->length[0x##num]= length_##mode
+  do_insns(setLength);
+# undef setLength
+  return batch;
+}
+
+
+M6502 *M6502_lane(M6502_Batch *batch, unsigned lane)
+{
+  return (lane < batch->count) ? batch->lanes[lane] : 0;
+}
+
+
+/* move element k of the lockstep back into its lane, run the lane on its
+ * own (which calls trace->expired if it has reached its limit) and
+ * replace the element with the last one */
+
+static void leaveLockstep(M6502_Batch *batch, unsigned k, unsigned *n, uint64_t steps)
+{
+  M6502 *lane= batch->lanes[batch->id[k]];
+  unsigned last= --*n;
+
+  lane->registers->a=  batch->a[k];
+  lane->registers->x=  batch->x[k];
+  lane->registers->y=  batch->y[k];
+  lane->registers->p=  batch->p[k];
+  lane->registers->s=  batch->s[k];
+  lane->registers->pc= batch->pc[k];
+  lane->trace->insns=  batch->start[k] + steps;
+  M6502_run(lane);
+
+  batch->id[k]=	    batch->id[last];
+  batch->a[k]=	    batch->a[last];
+  batch->x[k]=	    batch->x[last];
+  batch->y[k]=	    batch->y[last];
+  batch->p[k]=	    batch->p[last];
+  batch->s[k]=	    batch->s[last];
+  batch->pc[k]=	    batch->pc[last];
+  batch->memory[k]= batch->memory[last];
+  batch->start[k]=  batch->start[last];
+}
+
+
+/* retire the lanes (all at pc) that have reached their limits; answer
+ * after how many steps the next of the rest will */
+
+static uint64_t expireLockstep(M6502_Batch *batch, unsigned *n, uint64_t steps, word pc)
+{
+  uint64_t stop= ~(uint64_t)0;
+  unsigned k;
+
+  for (k= *n;  k--; )
+    {
+      uint64_t limit= batch->lanes[batch->id[k]]->trace->limit;
+      if (limit <= batch->start[k] + steps)
+	{
+	  batch->pc[k]= pc;
+	  leaveLockstep(batch, k, n, steps);
+	}
+      else if (limit - batch->start[k] < stop)
+	stop= limit - batch->start[k];
+    }
+  return stop;
+}
+
+
+static int samePage(M6502_Batch *batch, unsigned n, unsigned page)
+{
+  unsigned k;
+  page= (page & 0xff) << 8;
+  for (k= 1;  k < n;  ++k)
+    if (memcmp(batch->memory[k] + page, batch->memory[0] + page, 0x100))
+      return 0;
+  return 1;
+}
+
+
+static int sameInsn(M6502_Batch *batch, unsigned k, word pc, unsigned length)
+{
+  while (length--)
+    {
+      if (batch->memory[k][pc] != batch->memory[0][pc])
+	return 0;
+      ++pc;
+    }
+  return 1;
+}
+
+
+/* execute the insn at pc in every element of the lockstep, one at a time,
+ * leaving each element's new PC in batch->pc */
+
+# undef  written
+# define written(ADDR)	(same[((ADDR) >> 8) & 0xff]= 0, mpu->trace->dirty[((ADDR) >> 8) & 0xff]= 1)
+# undef  callback
+#if defined(M6502_STATS)
+# define callback(KIND, FN, ADDR, DATA)	(*called= 1, timedCallback(mpu, M6502_##KIND##Callback, FN, ADDR, DATA))
+#else
+# define callback(KIND, FN, ADDR, DATA)	(*called= 1, (FN)(mpu, ADDR, DATA))
+#endif
+
+static void stepLanes(M6502_Batch *batch, unsigned n, word pc, byte *same, int *called)
+{
+# define fetch()
+# define next()		continue
+# define laneIn(K)	mpu= batch->lanes[batch->id[K]];  memory= batch->memory[K];		\
+			readCallback= mpu->callbacks->read;  writeCallback= mpu->callbacks->write;	\
+			A= batch->a[K];  X= batch->x[K];  Y= batch->y[K];  P= batch->p[K];  S= batch->s[K];  PC= pc + 1
+# define laneOut(K)	(batch->a[K]= A,  batch->x[K]= X,  batch->y[K]= Y,  batch->p[K]= P,  batch->s[K]= S,  batch->pc[K]= PC)
+# define dispatch(num, name, mode, cycles)	case 0x##num: for (k= 0;  k < n;  laneOut(k), ++k) { laneIn(k);  retired();  name(cycles, mode); }  break
+
+  register byte  *memory;
+  register word   PC;
+  word		  ea;
+  byte		  A, X, Y, P, S;
+  M6502		 *mpu;
+  M6502_Callback *readCallback, *writeCallback;
+  unsigned	  k;
+
+  switch (batch->memory[0][pc])
+    {
+      do_insns(dispatch);
+    }
+
+# undef fetch
+# undef next
+# undef laneIn
+# undef laneOut
+# undef dispatch
+}
+
+# undef  written
+# define written(ADDR)	((void)0)
+# undef  callback
+#if defined(M6502_STATS)
+# define callback(KIND, FN, ADDR, DATA)	timedCallback(mpu, M6502_##KIND##Callback, FN, ADDR, DATA)
+#else
+# define callback(KIND, FN, ADDR, DATA)	(FN)(mpu, ADDR, DATA)
+#endif
+
+
+/* execute the insn at pc in every element of the lockstep together, if it
+ * is one of the common insns that never calls back.  answer the new PC
+ * (0x10000 if it differs between lanes and has been left in batch->pc) or
+ * -1 if the insn must be stepped one lane at a time. */
+
+#if !defined(M6502_STATS)
+
+enum { modeNone, modeImmediate, modeZp, modeAbs, modeZpx, modeZpy, modeAbsx, modeAbsy };
+
+static int stepLockstep(M6502_Batch *batch, unsigned n, word pc, byte *same)
+{
+  byte	   *code= batch->memory[0] + pc;
+  byte	    lo= batch->memory[0][(word)(pc + 1)], hi= batch->memory[0][(word)(pc + 2)];	/* operands wrap round memory */
+  byte	   *a= batch->a, *x= batch->x, *y= batch->y, *p= batch->p, *m= batch->m;
+  byte	  **memory= batch->memory;
+  word	   *e= batch->e;
+  word	    ea= 0, next= pc + batch->length[code[0]];
+  unsigned  k;
+  int	    mode= modeNone, hit= 0;
+  M6502_Callbacks *callbacks= batch->lanes[batch->id[0]]->callbacks;
+
+# define lanes(STMT)	for (k= 0;  k < n;  ++k) { STMT; }
+# define NZ(V)		(((V) & flagN) | (!(V) << 1))
+# define dirty(K, ADDR)	(batch->lanes[batch->id[K]]->trace->dirty[(ADDR) >> 8]= 1)
+
+  /* the low five bits of the opcode select the addressing mode of the
+   * regular insns handled here (ldx and stx index by Y instead of X) */
+  switch (code[0] & 0x1f)
+    {
+    case 0x09: case 0x00: case 0x02: mode= modeImmediate;  ea= pc + 1;	break;
+    case 0x05: case 0x04: case 0x06: mode= modeZp;	  ea= lo;	break;
+    case 0x0d: case 0x0c: case 0x0e: mode= modeAbs;	  ea= lo | (hi << 8);	break;
+    case 0x15: case 0x14: case 0x16: mode= modeZpx;	  ea= lo;	break;
+    case 0x1d: case 0x1c: case 0x1e: mode= modeAbsx;	  ea= lo | (hi << 8);	break;
+    case 0x19:			     mode= modeAbsy;	  ea= lo | (hi << 8);	break;
+    }
+  if ((code[0] == 0x96) || (code[0] == 0xb6))	mode= modeZpy;
+  if (code[0] == 0xbe)				mode= modeAbsy;
+  switch (mode)
+    {
+    case modeZpx:	lanes(e[k]= (byte)(ea + x[k]));  break;
+    case modeZpy:	lanes(e[k]= (byte)(ea + y[k]));  break;
+    case modeAbsx:	lanes(e[k]= ea + x[k]);  break;
+    case modeAbsy:	lanes(e[k]= ea + y[k]);  break;
+    }
+
+# define load()		if (mode == modeImmediate)							\
+			  memset(m, lo, n);							\
+			else if ((mode == modeZp) || (mode == modeAbs))					\
+			  {										\
+			    if (callbacks->read[ea]) return -1;						\
+			    lanes(m[k]= memory[k][ea]);							\
+			  }										\
+			else if (mode >= modeZpx)							\
+			  {										\
+			    lanes(hit |= !!callbacks->read[e[k]]);					\
+			    if (hit) return -1;								\
+			    lanes(m[k]= memory[k][e[k]]);						\
+			  }										\
+			else										\
+			  return -1
+# define store(V)	if ((mode == modeZp) || (mode == modeAbs))					\
+			  {										\
+			    if (callbacks->write[ea]) return -1;					\
+			    same[ea >> 8]= 0;								\
+			    lanes(dirty(k, ea);  memory[k][ea]= (V));					\
+			  }										\
+			else if (mode >= modeZpx)							\
+			  {										\
+			    lanes(hit |= !!callbacks->write[e[k]]);					\
+			    if (hit) return -1;								\
+			    lanes(same[e[k] >> 8]= 0;  dirty(k, e[k]);  memory[k][e[k]]= (V));		\
+			  }										\
+			else										\
+			  return -1
+# define modify(E, Z, C)	if (((mode != modeZp) && (mode != modeAbs)) || callbacks->read[ea] || callbacks->write[ea])	\
+			  return -1;									\
+			same[ea >> 8]= 0;								\
+			lanes(unsigned w= memory[k][ea];  byte v= (E);					\
+			      dirty(k, ea);  memory[k][ea]= v;  p[k]= (p[k] & ~(flagN | flagZ | flagC)) | (v & flagN) | ((Z) << 1) | (C))
+# define shiftA(E, C)	lanes(unsigned w= a[k];  byte v= (E);						\
+			      a[k]= v;  p[k]= (p[k] & ~(flagN | flagZ | flagC)) | NZ(v) | (C))
+# define result(R, V)	lanes(R[k]= (V);  p[k]= (p[k] & ~(flagN | flagZ)) | NZ(R[k]))
+# define compare(R)	load();  lanes(byte d= R[k] - m[k];  p[k]= (p[k] & ~(flagN | flagZ | flagC)) | NZ(d) | (R[k] >= m[k]))
+# define test(F, V)	lanes(batch->pc[k]= ((p[k] & (F)) == (V)) ? next + (int8_t)lo : next);  return 0x10000
+# define flag(F, V)	lanes(p[k]= (p[k] & ~(F)) | (V))
+
+  switch (code[0])
+    {
+    case 0xa9: case 0xa5: case 0xad:
+    case 0xb5: case 0xbd: case 0xb9:  load();  result(a, m[k]);  break;			/* lda */
+    case 0xa2: case 0xa6: case 0xae:
+    case 0xb6: case 0xbe:	      load();  result(x, m[k]);  break;			/* ldx */
+    case 0xa0: case 0xa4: case 0xac:
+    case 0xb4: case 0xbc:	      load();  result(y, m[k]);  break;			/* ldy */
+    case 0x85: case 0x8d:
+    case 0x95: case 0x9d: case 0x99:  store(a[k]);  break;				/* sta */
+    case 0x86: case 0x8e: case 0x96:  store(x[k]);  break;				/* stx */
+    case 0x84: case 0x8c: case 0x94:  store(y[k]);  break;				/* sty */
+    case 0x64: case 0x74: case 0x9e:  store(0);  break;					/* stz */
+    case 0x9c:			      mode= modeAbs;  store(0);  break;
+    case 0x29: case 0x25: case 0x2d:
+    case 0x35: case 0x3d: case 0x39:  load();  result(a, a[k] & m[k]);  break;		/* and */
+    case 0x09: case 0x05: case 0x0d:
+    case 0x15: case 0x1d: case 0x19:  load();  result(a, a[k] | m[k]);  break;		/* ora */
+    case 0x49: case 0x45: case 0x4d:
+    case 0x55: case 0x5d: case 0x59:  load();  result(a, a[k] ^ m[k]);  break;		/* eor */
+    case 0xc9: case 0xc5: case 0xcd:
+    case 0xd5: case 0xdd: case 0xd9:  compare(a);  break;				/* cmp */
+    case 0xe0: case 0xe4: case 0xec:  compare(x);  break;				/* cpx */
+    case 0xc0: case 0xc4: case 0xcc:  compare(y);  break;				/* cpy */
+    case 0x69: case 0x65: case 0x6d:
+    case 0x75: case 0x7d: case 0x79:							/* adc */
+    case 0xe9: case 0xe5: case 0xed:
+    case 0xf5: case 0xfd: case 0xf9:							/* sbc */
+      {
+	byte d= 0, s= (code[0] & 0x80) ? 0xff : 0;	/* sbc adds the complement */
+	lanes(d |= p[k]);
+	if (d & flagD) return -1;
+	load();
+	lanes(unsigned b= m[k] ^ s;  unsigned c= a[k] + b + (p[k] & flagC);  byte r= c;
+	      p[k]= (p[k] & ~(flagN | flagV | flagZ | flagC)) | NZ(r) | ((~(a[k] ^ b) & (a[k] ^ r) & 0x80) >> 1) | (c >> 8);
+	      a[k]= r);
+	break;
+      }
+    case 0x24: case 0x2c:								/* bit */
+      load();
+      lanes(p[k]= (p[k] & ~(flagN | flagV | flagZ)) | (m[k] & 0xc0) | (!(a[k] & m[k]) << 1));
+      break;
+    case 0xe6: case 0xee:  modify(w + 1, !v, p[k] & flagC);  break;			/* inc */
+    case 0xc6: case 0xce:  modify(w - 1, !v, p[k] & flagC);  break;			/* dec */
+    case 0x06: case 0x0e:  modify(w << 1, !v, w >> 7);  break;				/* asl */
+    case 0x46: case 0x4e:  modify(w >> 1, !v, w & 1);  break;				/* lsr */
+    case 0x26: case 0x2e:  modify((w << 1) | (p[k] & flagC), !v, w >> 7);  break;	/* rol */
+    case 0x66: case 0x6e:  modify((w >> 1) | (p[k] << 7), !v, w & 1);  break;		/* ror */
+    case 0x0a:  shiftA(w << 1, w >> 7);  break;						/* asl a */
+    case 0x4a:  shiftA(w >> 1, w & 1);  break;						/* lsr a */
+    case 0x2a:  shiftA((w << 1) | (p[k] & flagC), w >> 7);  break;			/* rol a */
+    case 0x6a:  shiftA((w >> 1) | (p[k] << 7), w & 1);  break;				/* ror a */
+    case 0xe8:  result(x, x[k] + 1);  break;						/* inx */
+    case 0xc8:  result(y, y[k] + 1);  break;						/* iny */
+    case 0x1a:  result(a, a[k] + 1);  break;						/* ina */
+    case 0xca:  result(x, x[k] - 1);  break;						/* dex */
+    case 0x88:  result(y, y[k] - 1);  break;						/* dey */
+    case 0x3a:  result(a, a[k] - 1);  break;						/* dea */
+    case 0xaa:  result(x, a[k]);  break;							/* tax */
+    case 0xa8:  result(y, a[k]);  break;							/* tay */
+    case 0x8a:  result(a, x[k]);  break;							/* txa */
+    case 0x98:  result(a, y[k]);  break;							/* tya */
+    case 0x18:  flag(flagC, 0);      break;						/* clc */
+    case 0x38:  flag(flagC, flagC);  break;						/* sec */
+    case 0x58:  flag(flagI, 0);      break;						/* cli */
+    case 0x78:  flag(flagI, flagI);  break;						/* sei */
+    case 0xb8:  flag(flagV, 0);      break;						/* clv */
+    case 0xd8:  flag(flagD, 0);      break;						/* cld */
+    case 0xf8:  flag(flagD, flagD);  break;						/* sed */
+    case 0xea:  break;									/* nop */
+    case 0x10:  test(flagN, 0);							/* bpl */
+    case 0x30:  test(flagN, flagN);							/* bmi */
+    case 0x50:  test(flagV, 0);							/* bvc */
+    case 0x70:  test(flagV, flagV);							/* bvs */
+    case 0x90:  test(flagC, 0);							/* bcc */
+    case 0xb0:  test(flagC, flagC);							/* bcs */
+    case 0xd0:  test(flagZ, 0);							/* bne */
+    case 0xf0:  test(flagZ, flagZ);							/* beq */
+    case 0x80:  return (word)(next + (int8_t)lo);						/* bra */
+    case 0x4c:											/* jmp */
+      ea= lo | (hi << 8);
+      return callbacks->call[ea] ? -1 : ea;
+    default:
+      return -1;
+    }
+  return next;
+
+# undef lanes
+# undef NZ
+# undef dirty
+# undef load
+# undef store
+# undef modify
+# undef shiftA
+# undef result
+# undef compare
+# undef test
+# undef flag
+}
+
+#endif
+
+
+/* run lanes first to last-1 in lockstep */
+
+static void runLockstep(M6502_Batch *batch, unsigned first, unsigned last)
+{
+  word	   pc= batch->lanes[first]->registers->pc;
+  byte	   same[0x100];		/* non-zero for pages identical in every lane */
+  uint64_t steps= 0, stop;
+  unsigned n= 0, i, k;
+
+  for (i= first;  i < last;  ++i)
+    {
+      M6502 *lane= batch->lanes[i];
+      changed(lane);
+      if (lane->registers->pc != pc)
+	{
+	  M6502_run(lane);
+	  continue;
+	}
+      batch->id[n]=	i;
+      batch->a[n]=	lane->registers->a;
+      batch->x[n]=	lane->registers->x;
+      batch->y[n]=	lane->registers->y;
+      batch->p[n]=	lane->registers->p;
+      batch->s[n]=	lane->registers->s;
+      batch->pc[n]=	pc;
+      batch->memory[n]= lane->memory;
+      batch->start[n]=	lane->trace->insns;
+      ++n;
+    }
+  memset(same, 0, sizeof(same));
+  stop= expireLockstep(batch, &n, 0, pc);
+
+  while (n)
+    {
+      unsigned length= batch->length[batch->memory[0][pc]];
+      word     last= pc + length - 1;	/* wraps round memory */
+      int      next;
+
+      /* the insn must be the same in every lane */
+      if (!same[pc >> 8] || !same[last >> 8])
+	{
+	  if (samePage(batch, n, pc >> 8) && samePage(batch, n, last >> 8))
+	    same[pc >> 8]= same[last >> 8]= 1;
+	  else
+	    {
+	      for (k= n;  --k; )
+		if (!sameInsn(batch, k, pc, length))
+		  {
+		    batch->pc[k]= pc;
+		    leaveLockstep(batch, k, &n, steps);
+		  }
+	    }
+	}
+
+#if defined(M6502_STATS)
+      next= -1;			/* so that every insn is counted */
+#else
+      next= stepLockstep(batch, n, pc, same);
+#endif
+      if (next < 0)
+	{
+	  int called= 0;
+	  stepLanes(batch, n, pc, same, &called);
+	  next= 0x10000;
+	  if (called)
+	    {
+	      memset(same, 0, sizeof(same));
+	      stop= 0;		/* the callback might have moved a limit */
+	    }
+	}
+      ++steps;
+
+      if (next < 0x10000)
+	pc= next;
+      else
+	{
+	  pc= batch->pc[0];
+	  for (k= n;  --k; )
+	    if (batch->pc[k] != pc)
+	      leaveLockstep(batch, k, &n, steps);
+	}
+
+      if (steps >= stop)
+	stop= expireLockstep(batch, &n, steps, pc);
+    }
+}
+
+
+/* lanes are run in groups small enough that the pages each insn touches
+ * in all of them stay in the cache and TLB */
+
+#define BATCH_GROUP	64
+
+void M6502_runBatch(M6502_Batch *batch)
+{
+  unsigned first;
+  for (first= 0;  first < batch->count;  first += BATCH_GROUP)
+    runLockstep(batch, first, (batch->count - first > BATCH_GROUP) ? first + BATCH_GROUP : batch->count);
+}
+
+
+void M6502_deleteBatch(M6502_Batch *batch)
+{
+  while (batch->count)
+    M6502_delete(batch->lanes[--batch->count]);
+  free(batch->lanes);
+  free(batch->id);
+  free(batch->a);
+  free(batch->pc);
+  free(batch->memory);
+  free(batch->start);
+  free(batch->m);
+  free(batch->e);
+  free(batch);
+}
+
+
+M6502_Trace *M6502_trace(M6502 *mpu)
+{
+  if (!mpu->trace)
+    {
+      if (!(mpu->trace= calloc(1, sizeof(M6502_Trace)))) outOfMemory();
+      mpu->trace->limit= ~(uint64_t)0;
+    }
+  return mpu->trace;
+}
+
+
+int M6502_getStats(M6502 *mpu, M6502_Stats *stats)
+{
+#if defined(M6502_STATS)
+  struct stats *s= (struct stats *)mpu->stats;
+  *stats= s->counters;
+  if (s->depth)		/* still running (e.g., exiting from a callback) */
+    stats->runTime += now() - s->started;
+  return 1;
+#else
+  memset(stats, 0, sizeof(*stats));
+  return 0;
+#endif
+}
+
+
+M6502_Heatmap *M6502_heatmap(M6502 *mpu)
+{
+  M6502_Trace *trace= M6502_trace(mpu);
+  if (!trace->heatmap && !(trace->heatmap= calloc(1, sizeof(M6502_Heatmap)))) outOfMemory();
+  return trace->heatmap;
+}
+
+
 void M6502_delete(M6502 *mpu)
 {
+  if (mpu->debug) M6502_setHistory(mpu, 0, 0);
+  if (mpu->trace && mpu->trace->coverage)
+    {
+      free(mpu->trace->coverage->counts);
+      free(mpu->trace->coverage->edges);
+      free(mpu->trace->coverage);
+    }
+  if (mpu->trace)
+    free(mpu->trace->heatmap);
+  free(mpu->trace);
+  free(mpu->debug);
+  if (mpu->pool)
+    mpu->stats= 0;		/* part of the slot */
+  free(mpu->stats);
+  if (mpu->clone)
+    {
+      if (mpu->clone->fd >= 0) close(mpu->clone->fd);
+      if (mpu->clone->mapping) munmap(mpu->clone->mapping, CLONE_SIZE);
+      free(mpu->clone);
+    }
   if (mpu->flags & M6502_CallbacksAllocated) free(mpu->callbacks);
   if (mpu->flags & M6502_MemoryAllocated   ) free(mpu->memory);
   if (mpu->flags & M6502_RegistersAllocated) free(mpu->registers);
 
-  free(mpu);
+  if (mpu->pool)
+    releaseSlot(mpu);
+  else
+    free(mpu);
 }
@@ -8,6 +8,21 @@
 typedef struct _M6502		M6502;
 typedef struct _M6502_Registers	M6502_Registers;
 typedef struct _M6502_Callbacks	M6502_Callbacks;
+typedef struct _M6502_Debug	M6502_Debug;
+typedef struct _M6502_Trace	M6502_Trace;
+typedef struct _M6502_Coverage	M6502_Coverage;
+typedef struct _M6502_Heatmap	M6502_Heatmap;
+typedef struct _M6502_Stats	M6502_Stats;
+typedef struct _M6502_Clone	M6502_Clone;
+typedef struct _M6502_Pool	M6502_Pool;
+typedef struct _M6502_Batch	M6502_Batch;
+typedef struct _M6502_Tube	M6502_Tube;
+typedef struct _M6502_Check	M6502_Check;
+typedef struct _M6502_Insn	M6502_Insn;
+typedef struct _M6502_Flow	M6502_Flow;
+typedef struct _M6502_Block	M6502_Block;
+typedef struct _M6502_Call	M6502_Call;
+typedef struct _M6502_JumpTable	M6502_JumpTable;
 
 typedef int   (*M6502_Callback)(M6502 *mpu, uint16_t address, uint8_t data);
 
@@ -45,6 +60,57 @@ struct _M6502
   uint8_t	  *memory;
   M6502_Callbacks *callbacks;
   unsigned int	   flags;
+  M6502_Debug	  *debug;	/* breakpoints and watchpoints, if any */
+  M6502_Trace	  *trace;	/* instruction counting, if any */
+  M6502_Stats	  *stats;	/* performance counters (if built with M6502_STATS) */
+  M6502_Clone	  *clone;	/* copy-on-write snapshot state, if cloned */
+  M6502_Pool	  *pool;	/* the pool it was acquired from, if any */
+  M6502_Tube	  *tube;	/* the Tube connecting it to another mpu, if any */
+  M6502_Check	  *check;	/* the differential check it is part of, if any */
+};
+
+enum {
+  M6502_ReadCallback,
+  M6502_WriteCallback,
+  M6502_CallCallback,
+  M6502_IllegalCallback,
+  M6502_CallbackKinds
+};
+
+struct _M6502_Stats
+{
+  uint64_t   insns;				/* instructions executed */
+  uint64_t   cycles;				/* clock cycles (approximate) */
+  uint64_t   callbacks[M6502_CallbackKinds];	/* callbacks invoked, by kind */
+  uint64_t   callbackTime[M6502_CallbackKinds];	/* nanoseconds spent in them */
+  uint64_t   runTime;				/* nanoseconds spent in M6502_run */
+};
+
+struct _M6502_Trace
+{
+  uint64_t   insns;			/* instructions executed */
+  volatile uint64_t limit;		/* M6502_run returns when insns reaches limit */
+  int	   (*expired)(M6502 *mpu);	/* ... unless this returns non-zero */
+  uint8_t    dirty[0x100];		/* non-zero for each page written */
+  M6502_Coverage *coverage;		/* executed addresses and branches, if any */
+  M6502_Heatmap  *heatmap;		/* memory accesses, if any */
+};
+
+struct _M6502_Coverage
+{
+  uint8_t    executed[0x2000];		/* one bit per address: opcode executed */
+  uint8_t    taken   [0x2000];		/* ... branch taken, jump or call made */
+  uint8_t    notTaken[0x2000];		/* ... branch not taken */
+  uint32_t (*counts)[2];		/* per address: not taken, taken (if counting) */
+  uint8_t   *edges;			/* hit counts per edge hash (if counting edges) */
+  uint16_t   previous;			/* hash of the last edge's source */
+};
+
+struct _M6502_Heatmap
+{
+  uint64_t   pages[0x100][2];		/* reads and writes per page */
+  uint8_t    detailed[0x100];		/* non-zero for pages counted per address too */
+  uint32_t   addresses[0x10000][2];	/* reads and writes per address in those pages */
 };
 
 enum {
@@ -58,8 +124,20 @@ extern void   M6502_reset(M6502 *mpu);
 extern void   M6502_nmi(M6502 *mpu);
 extern void   M6502_irq(M6502 *mpu);
 extern void   M6502_run(M6502 *mpu);
+extern void   M6502_step(M6502 *mpu);
+extern int    M6502_getStats(M6502 *mpu, M6502_Stats *stats);
+extern M6502_Trace *M6502_trace(M6502 *mpu);
+extern M6502_Heatmap *M6502_heatmap(M6502 *mpu);
 extern int    M6502_disassemble(M6502 *mpu, uint16_t addr, char buffer[64]);
 extern void   M6502_dump(M6502 *mpu, char buffer[64]);
+extern M6502 *M6502_clone(M6502 *mpu);
+extern M6502_Pool *M6502_newPool(unsigned count);
+extern M6502 *M6502_acquire(M6502_Pool *pool);
+extern void   M6502_deletePool(M6502_Pool *pool);
+extern M6502_Batch *M6502_newBatch(M6502 *mpu, unsigned count);
+extern M6502 *M6502_lane(M6502_Batch *batch, unsigned lane);
+extern void   M6502_runBatch(M6502_Batch *batch);
+extern void   M6502_deleteBatch(M6502_Batch *batch);
 extern void   M6502_delete(M6502 *mpu);
 
 #define M6502_getVector(MPU, VEC)			\
@@ -73,5 +151,159 @@ extern void   M6502_delete(M6502 *mpu);
 #define M6502_getCallback(MPU, TYPE, ADDR)	((MPU)->callbacks->TYPE[ADDR])
 #define M6502_setCallback(MPU, TYPE, ADDR, FN)	((MPU)->callbacks->TYPE[ADDR]= (FN))
 
+/* decoding and disassembly (lib6502.c) */
+
+#define M6502_mnemonics(_)											\
+  _(adc) _(and) _(asl) _(asla) _(bcc) _(bcs) _(beq) _(bit) _(bmi) _(bne) _(bpl) _(bra) _(brk) _(bvc)	\
+  _(bvs) _(clc) _(cld) _(cli) _(clv) _(cmp) _(cpx) _(cpy) _(dea) _(dec) _(dex) _(dey) _(eor) _(ill)	\
+  _(ina) _(inc) _(inx) _(iny) _(jmp) _(jsr) _(lda) _(ldx) _(ldy) _(lsr) _(lsra) _(nop) _(ora) _(pha)	\
+  _(php) _(phx) _(phy) _(pla) _(plp) _(plx) _(ply) _(rol) _(rola) _(ror) _(rora) _(rti) _(rts) _(sbc)	\
+  _(sec) _(sed) _(sei) _(sta) _(stx) _(sty) _(stz) _(tax) _(tay) _(trb) _(tsb) _(tsx) _(txa) _(txs)	\
+  _(tya)
+
+enum {
+# define _M6502_mnemonic(NAME)	M6502_##NAME,
+  M6502_mnemonics(_M6502_mnemonic)
+# undef _M6502_mnemonic
+  M6502_Mnemonics
+};
+
+enum {
+  M6502_Implied, M6502_Immediate, M6502_Zp, M6502_Zpx, M6502_Zpy, M6502_Abs, M6502_Absx,
+  M6502_Absy, M6502_Relative, M6502_Indirect, M6502_Indzp, M6502_Indx, M6502_Indy, M6502_Indabsx
+};
+
+enum {				/* as they appear in P */
+  M6502_FlagC = 1 << 0,
+  M6502_FlagZ = 1 << 1,
+  M6502_FlagI = 1 << 2,
+  M6502_FlagD = 1 << 3,
+  M6502_FlagB = 1 << 4,
+  M6502_FlagV = 1 << 6,
+  M6502_FlagN = 1 << 7
+};
+
+struct _M6502_Insn
+{
+  uint8_t  opcode;
+  uint8_t  mnemonic;		/* M6502_adc ... M6502_tya */
+  uint8_t  mode;		/* M6502_Implied ... M6502_Indabsx */
+  uint8_t  length;		/* in bytes */
+  uint8_t  cycles;		/* not counting page crossings and taken branches */
+  uint8_t  read;		/* flags the insn depends on */
+  uint8_t  written;		/* flags it may change */
+  uint16_t operand;		/* the byte or word after the opcode (the target, if relative) */
+};
+
+extern int    M6502_decode(M6502 *mpu, uint16_t address, M6502_Insn *insn);
+extern const char *M6502_mnemonic(unsigned mnemonic);
+extern size_t M6502_disassembleRange(M6502 *mpu, unsigned *address, unsigned last, char *buffer, size_t size);
+
+/* breakpoints and watchpoints (debug6502.c) */
+
+enum {
+  M6502_WatchRead  = 1 << 0,
+  M6502_WatchWrite = 1 << 1
+};
+
+enum {
+  M6502_BreakOpcode = 0xdb	/* illegal opcode planted at breakpoints */
+};
+
+extern void   M6502_setBreakpoint(M6502 *mpu, uint16_t address, M6502_Callback handler);
+extern void   M6502_setWatchpoint(M6502 *mpu, int type, unsigned first, unsigned last, M6502_Callback handler);
+
+/* coverage (cover6502.c) */
+
+enum {
+  M6502_CoverCounts = 1 << 0,	/* count branch outcomes as well */
+  M6502_CoverEdges  = 1 << 1	/* count edges between them */
+};
+
+extern M6502_Coverage *M6502_coverage(M6502 *mpu, int flags);
+extern int    M6502_saveCoverage(M6502_Coverage *coverage, const char *path);
+extern int    M6502_loadCoverage(M6502_Coverage *coverage, const char *path);
+extern void   M6502_printCoverage(M6502_Coverage *coverage, FILE *stream);
+
+/* reverse execution (debug6502.c) */
+
+extern void   M6502_setHistory(M6502 *mpu, unsigned interval, size_t budget);
+extern int    M6502_reverseStep(M6502 *mpu);
+extern int    M6502_reverseContinue(M6502 *mpu);
+
+/* two processors connected by a Tube (tube6502.c) */
+
+extern M6502_Tube *M6502_newTube(M6502 *host, M6502 *parasite);
+extern void   M6502_runTube(M6502_Tube *tube);
+extern void   M6502_deleteTube(M6502_Tube *tube);
+
+/* differential checking of interpreters (check6502.c) */
+
+typedef void (*M6502_Engine)(M6502 *mpu, unsigned insns);	/* execute exactly insns instructions */
+
+extern void   M6502_stepEngine(M6502 *mpu, unsigned insns);
+extern void   M6502_traceEngine(M6502 *mpu, unsigned insns);
+extern uint64_t M6502_check(M6502 *mpu, M6502_Engine engine, unsigned interval, FILE *stream);
+
+/* static control-flow recovery (flow6502.c) */
+
+enum {				/* M6502_Flow.map, per address */
+  M6502_FlowInsn     = 1 << 0,	/* an insn starts here */
+  M6502_FlowOperand  = 1 << 1,	/* the operand of an insn */
+  M6502_FlowLeader   = 1 << 2,	/* a basic block starts here */
+  M6502_FlowEntry    = 1 << 3,	/* a vector, entry point or jsr target */
+  M6502_FlowTable    = 1 << 4,	/* part of a jump table */
+  M6502_FlowInvalid  = 1 << 5,	/* control reached an undefined opcode here */
+  M6502_FlowConflict = 1 << 6	/* control reached the middle of an insn or table, or an operand overlaps one */
+};
+
+enum {				/* how an M6502_Block ends */
+  M6502_EndsFalling,		/* into the next block */
+  M6502_EndsBranch,		/* to target or into the next block */
+  M6502_EndsJump,		/* to target */
+  M6502_EndsIndirect,		/* through a pointer outside the region */
+  M6502_EndsTable,		/* through tables[target] */
+  M6502_EndsReturn,		/* rts or rti */
+  M6502_EndsBreak,		/* brk */
+  M6502_EndsInvalid		/* at an undefined opcode or the end of the region */
+};
+
+struct _M6502_Block
+{
+  uint16_t first, last;		/* addresses of its first and last insns */
+  uint16_t function;		/* the entry of the function it belongs to */
+  uint16_t target;		/* see ends */
+  uint8_t  ends;
+};
+
+struct _M6502_Call
+{
+  uint16_t site, caller, callee;	/* the jsr, the function it is in, and its target */
+};
+
+struct _M6502_JumpTable
+{
+  uint16_t site, base, count;	/* the jmp (abs,X), the table, and its number of entries */
+  uint16_t targets[128];
+};
+
+struct _M6502_Flow
+{
+  unsigned	   first, last;		/* the region analysed (last is exclusive) */
+  uint64_t	   key;			/* hash of its contents and the entry points */
+  uint8_t	   map[0x10000];
+  unsigned	   nentries, nblocks, ncalls, ntables, conflicts;
+  uint16_t	  *entries;		/* functions, in address order */
+  M6502_Block	  *blocks;		/* in address order */
+  M6502_Call	  *calls;
+  M6502_JumpTable *tables;
+};
+
+extern M6502_Flow *M6502_flow(M6502 *mpu, unsigned first, unsigned last, const uint16_t *entries, unsigned count);
+extern int    M6502_saveFlow(M6502_Flow *flow, const char *path);
+extern M6502_Flow *M6502_loadFlow(M6502 *mpu, unsigned first, unsigned last, const uint16_t *entries, unsigned count, const char *path);
+extern void   M6502_printFlow(M6502_Flow *flow, FILE *stream);
+extern void   M6502_deleteFlow(M6502_Flow *flow);
+
 
 #endif /*__m6502_h */
@@ -21,11 +21,28 @@
 /* Last edited: 
  */
 
+/* sigaction, clock_gettime, pread and friends are not declared under
+ * -D__STRICT_ANSI__ */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 #include "config.h"
 #include "lib6502.h"
@@ -37,20 +54,411 @@ typedef uint16_t word;
 
 static char *program= 0;
 
-static byte bank[0x10][0x4000];
+static byte	   bank0[0x4000];	/* whatever was at 0x8000 when -B took effect */
+static const byte  bankEmpty[0x4000];	/* unused slots */
+static const byte *bank[0x10];		/* paged ROM images, mapped or in bank0 */
+static int	   bankNext= 0x0F;	/* next slot for an image */
+static int	   bankCurrent= -1;	/* image copied into 0x8000 */
 
 static char *tube_command= 0;
 
+static FILE *exec_file= 0;	/* *EXEC: input is taken from here first */
+static FILE *spool_file= 0;	/* *SPOOL: output is copied here too */
+
 static int exit_write= 0;
 static M6502 *exit_write_mpu= 0;
 
 
+/* Console output is gathered into blocks and written with writev(2) when
+ * a newline goes to a terminal, before input is read, when the blocks are
+ * full, at exit, and (from SIGALRM) shortly after the first byte was
+ * buffered, so that a prompt without a newline never lingers unseen.
+ * Anything else written to stdout must call flushOutput() first.
+ */
+
+#define OUTPUT_BLOCKS	8
+#define OUTPUT_BLOCK	0x10000
+#define OUTPUT_DELAY	50000	/* microseconds */
+
+static struct
+{
+  char		       *blocks[OUTPUT_BLOCKS];
+  size_t		used;		/* bytes buffered */
+  int			tty;		/* stdout is a terminal */
+  volatile sig_atomic_t busy;		/* the buffer is being changed */
+  volatile sig_atomic_t late;		/* the timer expired meanwhile */
+} output;
+
+
+static void writeOutput(void)
+{
+  struct iovec iov[OUTPUT_BLOCKS];
+  size_t       done= 0;
+
+  while (done < output.used)
+    {
+      size_t  pos= done;
+      int     n= 0;
+      ssize_t count;
+      for (n= 0;  pos < output.used;  ++n)
+	{
+	  size_t offset= pos % OUTPUT_BLOCK, length= OUTPUT_BLOCK - offset;
+	  if (length > output.used - pos) length= output.used - pos;
+	  iov[n].iov_base= output.blocks[pos / OUTPUT_BLOCK] + offset;
+	  iov[n].iov_len= length;
+	  pos += length;
+	}
+      if ((count= writev(1, iov, n)) < 0)
+	{
+	  if (EINTR == errno) continue;
+	  break;		/* nowhere to send it */
+	}
+      done += count;
+    }
+  output.used= 0;
+}
+
+
+static void flushOutput(void)
+{
+  fflush(stdout);
+  output.busy= 1;
+  writeOutput();
+  output.late= 0;
+  output.busy= 0;
+}
+
+
+static void outputTimer(int signum)
+{
+  int saved= errno;
+  if (output.busy)
+    output.late= 1;
+  else
+    writeOutput();
+  errno= saved;
+}
+
+
+static void outputByte(int c)
+{
+  output.busy= 1;
+  if (output.used == OUTPUT_BLOCKS * OUTPUT_BLOCK)
+    writeOutput();
+  if (!output.blocks[output.used / OUTPUT_BLOCK]
+      && !(output.blocks[output.used / OUTPUT_BLOCK]= malloc(OUTPUT_BLOCK)))
+    {
+      output.busy= 0;
+      putchar(c);		/* unbuffered, but not lost */
+      flushOutput();
+      return;
+    }
+  output.blocks[output.used / OUTPUT_BLOCK][output.used % OUTPUT_BLOCK]= c;
+  if (spool_file)
+    putc(c, spool_file);
+  if (!output.used++)
+    {
+      struct itimerval delay= { { 0, 0 }, { 0, OUTPUT_DELAY } };
+      setitimer(ITIMER_REAL, &delay, 0);
+    }
+  output.busy= 0;
+  if (output.late || ('\n' == c && output.tty))
+    flushOutput();
+}
+
+
+static void outputString(const char *s)
+{
+  while (*s)
+    outputByte(*s++);
+}
+
+
+static void initOutput(void)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler= outputTimer;
+  sa.sa_flags= SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGALRM, &sa, 0);
+  output.tty= isatty(1);
+  atexit(flushOutput);
+}
+
+
+/* -K reads the keyboard on a thread of its own (in raw mode, if stdin is a
+ * terminal) into a single-producer single-consumer ring, so that OSRDCH,
+ * INKEY and the getchar traps never block the emulator on the terminal
+ * itself, and Escape is seen even while the program is not reading.
+ * Timeouts are in host time: the fast interpreter keeps no clock.
+ */
+
+#define KEYBOARD_RING	0x1000	/* power of two */
+
+static struct
+{
+  byte		  ring[KEYBOARD_RING];
+  unsigned	  head;		/* next byte to read (consumer only) */
+  unsigned	  tail;		/* next byte to write (producer only) */
+  int		  eof;		/* no more input will arrive */
+  int		  escape;	/* escape condition pending */
+  int		  running;
+  int		  raw;		/* terminal settings to restore */
+  struct termios  saved;
+  pthread_t	  thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  ready;
+} keyboard= { .lock= PTHREAD_MUTEX_INITIALIZER, .ready= PTHREAD_COND_INITIALIZER };
+
+static byte escape_status= 0;	/* OSBYTE 0xE5: 0 if Escape sets the condition */
+
+
+static void keyboardWake(void)
+{
+  pthread_mutex_lock(&keyboard.lock);
+  pthread_cond_broadcast(&keyboard.ready);
+  pthread_mutex_unlock(&keyboard.lock);
+}
+
+
+static void *keyboardThread(void *arg)
+{
+  byte buffer[256];
+  ssize_t n, i;
+
+  while (((n= read(0, buffer, sizeof(buffer))) > 0) || ((n < 0) && (EINTR == errno)))
+    {
+      for (i= 0;  i < n;  ++i)
+	{
+	  unsigned tail= keyboard.tail;
+	  if ((0x1B == buffer[i]) && !__atomic_load_n(&escape_status, __ATOMIC_ACQUIRE))
+	    {
+	      __atomic_store_n(&keyboard.escape, 1, __ATOMIC_RELEASE);
+	      continue;
+	    }
+	  if (tail - __atomic_load_n(&keyboard.head, __ATOMIC_ACQUIRE) == KEYBOARD_RING)
+	    continue;		/* full: drop it, as the MOS would */
+	  keyboard.ring[tail % KEYBOARD_RING]= buffer[i];
+	  __atomic_store_n(&keyboard.tail, tail + 1, __ATOMIC_RELEASE);
+	}
+      keyboardWake();
+    }
+  __atomic_store_n(&keyboard.eof, 1, __ATOMIC_RELEASE);
+  keyboardWake();
+  return 0;
+}
+
+
+static void keyboardRestore(void)
+{
+  if (keyboard.raw)
+    tcsetattr(0, TCSANOW, &keyboard.saved);
+  keyboard.raw= 0;
+}
+
+
+static void (*keyboardSignals[NSIG])(int);
+
+static void keyboardSignal(int signum)
+{
+  keyboardRestore();
+  signal(signum, keyboardSignals[signum]);
+  raise(signum);
+}
+
+
+static void initKeyboard(void)
+{
+  struct termios raw;
+  sigset_t	 alarm, saved;
+  int		 failed;
+
+  if (keyboard.running)
+    return;
+  if (isatty(0) && !tcgetattr(0, &keyboard.saved))
+    {
+      raw= keyboard.saved;
+      raw.c_lflag &= ~(ICANON | ECHO);
+      raw.c_iflag &= ~ICRNL;
+      raw.c_cc[VMIN]= 1;
+      raw.c_cc[VTIME]= 0;
+      if (!tcsetattr(0, TCSANOW, &raw))
+	{
+	  keyboard.raw= 1;
+	  atexit(keyboardRestore);
+	  keyboardSignals[SIGINT]=  signal(SIGINT,  keyboardSignal);
+	  keyboardSignals[SIGTERM]= signal(SIGTERM, keyboardSignal);
+	}
+    }
+  /* the thread inherits a mask without SIGALRM, so that outputTimer()
+   * only ever interrupts the thread that writes the output buffer */
+  sigemptyset(&alarm);
+  sigaddset(&alarm, SIGALRM);
+  pthread_sigmask(SIG_BLOCK, &alarm, &saved);
+  failed= pthread_create(&keyboard.thread, 0, keyboardThread, 0);
+  pthread_sigmask(SIG_SETMASK, &saved, 0);
+  if (failed)
+    {
+      keyboardRestore();
+      return;
+    }
+  pthread_detach(keyboard.thread);
+  keyboard.running= 1;
+}
+
+
+/* answer and clear the escape condition */
+static int keyboardEscape(void)
+{
+  return keyboard.running && __atomic_exchange_n(&keyboard.escape, 0, __ATOMIC_ACQ_REL);
+}
+
+
+/* the next key, waiting at most centiseconds (forever if negative); EOF
+ * at end of input, -2 on timeout, 0x1B (without removing it) on escape */
+static int keyboardGet(long centiseconds)
+{
+  struct timespec deadline;
+
+  if (centiseconds >= 0)
+    {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec  += centiseconds / 100;
+      deadline.tv_nsec += (centiseconds % 100) * 10000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+	{
+	  deadline.tv_sec  += 1;
+	  deadline.tv_nsec -= 1000000000L;
+	}
+    }
+  flushOutput();
+  for (;;)
+    {
+      unsigned head= keyboard.head;
+      if (__atomic_load_n(&keyboard.escape, __ATOMIC_ACQUIRE))
+	return 0x1B;
+      if (head != __atomic_load_n(&keyboard.tail, __ATOMIC_ACQUIRE))
+	{
+	  int c= keyboard.ring[head % KEYBOARD_RING];
+	  __atomic_store_n(&keyboard.head, head + 1, __ATOMIC_RELEASE);
+	  return c;
+	}
+      if (__atomic_load_n(&keyboard.eof, __ATOMIC_ACQUIRE))
+	return EOF;
+      pthread_mutex_lock(&keyboard.lock);
+      if ((head == __atomic_load_n(&keyboard.tail, __ATOMIC_ACQUIRE))
+	  && !__atomic_load_n(&keyboard.eof, __ATOMIC_ACQUIRE)
+	  && !__atomic_load_n(&keyboard.escape, __ATOMIC_ACQUIRE))
+	{
+	  if (centiseconds < 0)
+	    pthread_cond_wait(&keyboard.ready, &keyboard.lock);
+	  else if (pthread_cond_timedwait(&keyboard.ready, &keyboard.lock, &deadline))
+	    {
+	      pthread_mutex_unlock(&keyboard.lock);
+	      if (head == __atomic_load_n(&keyboard.tail, __ATOMIC_ACQUIRE))
+		return -2;
+	      continue;
+	    }
+	}
+      pthread_mutex_unlock(&keyboard.lock);
+    }
+}
+
+
+/* the next byte of a *EXEC file, closing it at the end */
+static int readExec(void)
+{
+  int c= getc(exec_file);
+  if (EOF == c)
+    {
+      fclose(exec_file);
+      exec_file= 0;
+    }
+  return c;
+}
+
+
+/* getchar(), or the next key when -K is in effect */
+static int readKey(void)
+{
+  int c;
+  if (exec_file && (EOF != (c= readExec())))
+    return c;
+  if (!keyboard.running)
+    {
+      flushOutput();
+      return getchar();
+    }
+  if (0x1B == (c= keyboardGet(-1)))
+    keyboardEscape();
+  return c;
+}
+
+
+/* fgets(), echoing and editing the line itself when -K is in effect */
+static char *readLine(char *buffer, int length)
+{
+  int n= 0, c;
+  if (exec_file)
+    {
+      if (fgets(buffer, length, exec_file))
+	{
+	  outputString(buffer);
+	  return buffer;
+	}
+      fclose(exec_file);
+      exec_file= 0;
+    }
+  if (!keyboard.running)
+    {
+      flushOutput();
+      return fgets(buffer, length, stdin);
+    }
+  while (n < length - 1)
+    {
+      if (EOF == (c= keyboardGet(-1)))
+	{
+	  if (!n)
+	    return 0;
+	  break;
+	}
+      if (0x1B == c)
+	{
+	  keyboardEscape();
+	  buffer[n++]= c;
+	  break;
+	}
+      if ((13 == c) || (10 == c))
+	{
+	  outputByte('\n');
+	  buffer[n++]= '\n';
+	  break;
+	}
+      if ((127 == c) || (8 == c))
+	{
+	  if (n)
+	    {
+	      --n;
+	      outputString("\b \b");
+	    }
+	  continue;
+	}
+      buffer[n++]= c;
+      outputByte(c);
+    }
+  buffer[n]= '\0';
+  flushOutput();
+  return buffer;
+}
+
+
 
 
 void fail(const char *fmt, ...)
 {
   va_list ap;
-  fflush(stdout);
+  flushOutput();
   va_start(ap, fmt);
   vfprintf(stderr, fmt, ap);
   va_end(ap);
@@ -61,7 +469,7 @@ void fail(const char *fmt, ...)
 
 void pfail(const char *msg)
 {
-  fflush(stdout);
+  flushOutput();
   perror(msg);
   exit(1);
 }
@@ -76,6 +484,22 @@ void pfail(const char *msg)
   }
 
 
+/* a callback has stored length bytes at address directly: mark the pages
+ * in the trace, as M6502_check looks only there for what it changed, and
+ * if they overlap paged ROM the copy at 0x8000 is no longer good */
+static void stored(M6502 *mpu, unsigned address, size_t length)
+{
+  size_t page;
+  for (page= address >> 8;  length && (page <= (address + length - 1) >> 8);  ++page)
+    {
+      if (mpu->trace)
+	mpu->trace->dirty[page & 0xFF]= 1;
+      if ((page & 0xC0) == 0x80)
+	bankCurrent= -1;
+    }
+}
+
+
 int oswordCommon(M6502 *mpu, word address, byte data)
 {
   byte *params= mpu->memory + mpu->registers->x + (mpu->registers->y << 8);
@@ -94,9 +518,10 @@ int oswordCommon(M6502 *mpu, word address, byte data)
 	word  offset= params[0] + (params[1] << 8);
 	byte *buffer= mpu->memory + offset;
 	byte  length= params[2], minVal= params[3], maxVal= params[4], b= 0;
-	if (!fgets(buffer, length, stdin))
+	stored(mpu, offset, length + 1);
+	if (!readLine((char *)buffer, length))
 	  {
-	    putchar('\n');
+	    outputByte('\n');
 	    exit(0);
 	  }
 	mpu->registers->p &= 0xFE;
@@ -119,7 +544,7 @@ int oswordCommon(M6502 *mpu, word address, byte data)
       {
 	char state[64];
 	M6502_dump(mpu, state);
-	fflush(stdout);
+	flushOutput();
 	fprintf(stderr, "\nOSWORD %s\n", state);
 	fail("ABORT");
       }
@@ -173,7 +598,7 @@ int osbyte(M6502 *mpu, word address, byte data)
       {
 	char state[64];
 	M6502_dump(mpu, state);
-	fflush(stdout);
+	flushOutput();
 	fprintf(stderr, "\nOSBYTE %s\n", state);
 	fail("ABORT");
       }
@@ -184,18 +609,23 @@ int osbyte(M6502 *mpu, word address, byte data)
 }
 
 
-static char *getYXString(M6502 *mpu)
+static char *getString(M6502 *mpu, word address)
 {
-  byte *params= mpu->memory + mpu->registers->x + (mpu->registers->y << 8);
   static char string[1024];
   char *ptr= string;
-  while (13 != *params)
-    *ptr++= *params++;
+  while ((13 != mpu->memory[address]) && (ptr < string + sizeof(string) - 1))
+    *ptr++= mpu->memory[address++];
   *ptr= '\0';
   return string;
 }
 
 
+static char *getYXString(M6502 *mpu)
+{
+  return getString(mpu, mpu->registers->x + (mpu->registers->y << 8));
+}
+
+
 static char *getYXStringOscli(M6502 *mpu)
 {
   byte *params= mpu->memory + mpu->registers->x + (mpu->registers->y << 8);
@@ -209,10 +639,345 @@ static char *getYXStringOscli(M6502 *mpu)
   return command;
 }
 
+/* move length bytes between a host file at offset 0 and memory starting at
+ * address, wrapping around the top of memory; returns the bytes moved */
+static ssize_t fileTransfer(M6502 *mpu, int fd, int save, unsigned address, size_t length)
+{
+  size_t done= 0;
+  while (done < length)
+    {
+      size_t chunk= length - done;
+      ssize_t n;
+      address &= 0xFFFF;
+      if (chunk > 0x10000 - address)
+	chunk= 0x10000 - address;
+      if (save)
+	n= pwrite(fd, mpu->memory + address, chunk, done);
+      else
+	n= pread(fd, mpu->memory + address, chunk, done);
+      if (n > 0 && !save)
+	stored(mpu, address, n);
+      if (n <= 0)
+	return (n < 0) ? n : done;
+      done += n;
+      address += n;
+    }
+  return done;
+}
+
+
+/* Star commands are run natively against the host file system and the
+ * memory image.  Each handler returns 0 on success or a BBC error number;
+ * *RUN leaves the address to continue at in star_run.  Commands not in the
+ * table are passed to system(3) only with -O.
+ */
+
+static int star_system= 0;
+static int star_run= -1;
+
+static struct
+{
+  byte	      number;
+  const char *message;
+} starErrors[]= {
+  { 192, "Can't open file" },
+  { 202, "Disc fault" },
+  { 204, "Bad name" },
+  { 206, "Bad directory" },
+  { 214, "File not found" },
+  { 252, "Bad address" },
+  { 254, "Bad command" },
+  {   0, 0 }
+};
+
+
+static const char *starError(int number)
+{
+  int i;
+  for (i= 0;  starErrors[i].message;  ++i)
+    if (starErrors[i].number == number)
+      return starErrors[i].message;
+  return "Error";
+}
+
+
+/* split off the next space-separated (or "quoted") word of args */
+static char *starWord(char **args)
+{
+  char *word, *end;
+  while (' ' == **args) ++*args;
+  if (!**args)
+    return 0;
+  if ('"' == **args)
+    {
+      word= ++*args;
+      end= strchr(word, '"');
+    }
+  else
+    {
+      word= *args;
+      end= strchr(word, ' ');
+    }
+  if (end)
+    {
+      *end= '\0';
+      *args= end + 1;
+    }
+  else
+    *args += strlen(word);
+  return word;
+}
+
+
+static int starAddress(char **args, unsigned long *address)
+{
+  char *word= starWord(args), *end;
+  if (!word)
+    return 0;
+  *address= strtoul(word, &end, 16);
+  return !*end;
+}
+
+
+static int starLoadFile(M6502 *mpu, const char *name, unsigned long address)
+{
+  struct stat info;
+  int fd;
+
+  if ((fd= open(name, O_RDONLY)) < 0)
+    return 214;
+  if ((fstat(fd, &info) < 0) || S_ISDIR(info.st_mode))
+    {
+      close(fd);
+      return 214;
+    }
+  if (info.st_size > 0x10000 - (address & 0xFFFF))
+    {
+      close(fd);
+      return 252;		/* would wrap round memory */
+    }
+  if (fileTransfer(mpu, fd, 0, address, info.st_size) < 0)
+    {
+      close(fd);
+      return 202;
+    }
+  close(fd);
+  return 0;
+}
+
+
+/* *LOAD name addr (host files have no load address of their own) */
+static int starLoad(M6502 *mpu, char *args)
+{
+  char *name= starWord(&args);
+  unsigned long address;
+
+  if (!name)
+    return 204;
+  if (!starAddress(&args, &address))
+    return 252;
+  return starLoadFile(mpu, name, address);
+}
+
+
+/* *SAVE name start end|+length */
+static int starSave(M6502 *mpu, char *args)
+{
+  char *name= starWord(&args), *word;
+  unsigned long start, end;
+  size_t length;
+  int fd;
+
+  if (!name)
+    return 204;
+  if (!starAddress(&args, &start) || !(word= starWord(&args)))
+    return 252;
+  if ('+' == *word)
+    end= start + strtoul(word + 1, &word, 16);
+  else
+    end= strtoul(word, &word, 16);
+  if (*word || (end < start) || (end - start > 0x10000))
+    return 252;
+  length= end - start;
+  if ((fd= open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    return 192;
+  if (fileTransfer(mpu, fd, 1, start, length) != (ssize_t)length)
+    {
+      close(fd);
+      return 202;
+    }
+  close(fd);
+  return 0;
+}
+
+
+/* *RUN name addr */
+static int starRun(M6502 *mpu, char *args)
+{
+  char *name= starWord(&args);
+  unsigned long address;
+  int status;
+
+  if (!name)
+    return 204;
+  if (!starAddress(&args, &address))
+    return 252;
+  if ((status= starLoadFile(mpu, name, address)))
+    return status;
+  star_run= address & 0xFFFF;
+  return 0;
+}
+
+
+/* *CAT [directory] */
+static int starCat(M6502 *mpu, char *args)
+{
+  char *name= starWord(&args);
+  struct dirent *entry;
+  DIR *dir;
+  int column= 0;
+
+  if (!(dir= opendir(name ? name : ".")))
+    return 206;
+  while ((entry= readdir(dir)))
+    {
+      char line[32];
+      if ('.' == entry->d_name[0])
+	continue;
+      snprintf(line, sizeof(line), "%-19.19s ", entry->d_name);
+      outputString(line);
+      if (4 == ++column)
+	{
+	  outputString("\n");
+	  column= 0;
+	}
+    }
+  if (column)
+    outputString("\n");
+  closedir(dir);
+  return 0;
+}
+
+
+/* *INFO name */
+static int starInfo(M6502 *mpu, char *args)
+{
+  char *name= starWord(&args), line[80];
+  struct stat info;
+
+  if (!name)
+    return 204;
+  if (stat(name, &info) < 0)
+    return 214;
+  snprintf(line, sizeof(line), "%-19.19s 00000000 00000000 %06lX\n", name, (unsigned long)info.st_size);
+  outputString(line);
+  return 0;
+}
+
+
+/* *DIR [directory] */
+static int starDir(M6502 *mpu, char *args)
+{
+  char *name= starWord(&args);
+  if (!name && !(name= getenv("HOME")))
+    return 0;
+  return chdir(name) ? 206 : 0;
+}
+
+
+/* *EXEC [name] */
+static int starExec(M6502 *mpu, char *args)
+{
+  char *name= starWord(&args);
+  if (exec_file)
+    fclose(exec_file);
+  exec_file= 0;
+  if (name && !(exec_file= fopen(name, "rb")))
+    return 214;
+  return 0;
+}
+
+
+/* *SPOOL [name] */
+static int starSpool(M6502 *mpu, char *args)
+{
+  char *name= starWord(&args);
+  if (spool_file)
+    fclose(spool_file);
+  spool_file= 0;
+  if (name && !(spool_file= fopen(name, "wb")))
+    return 192;
+  return 0;
+}
+
+
+static struct
+{
+  const char *name;
+  int	    (*handler)(M6502 *mpu, char *args);
+} starCommands[]= {
+  { "CAT",	starCat   },
+  { "DIR",	starDir   },
+  { "EXEC",	starExec  },
+  { "INFO",	starInfo  },
+  { "LOAD",	starLoad  },
+  { "RUN",	starRun   },
+  { "SAVE",	starSave  },
+  { "SPOOL",	starSpool },
+  { 0,		0	  }
+};
+
+
+/* run command (without the leading '*'s); returns 0, a BBC error number,
+ * or -1 if it is not a built-in command */
+static int starCommand(M6502 *mpu, char *command)
+{
+  char name[16];
+  int length= 0, abbreviated= 0, i;
+
+  while (isalpha(command[length]) && (length < (int)sizeof(name) - 1))
+    {
+      name[length]= toupper(command[length]);
+      ++length;
+    }
+  name[length]= '\0';
+  if ('.' == command[length])
+    abbreviated= 1;
+  else if (command[length] && (' ' != command[length]) && ('"' != command[length]))
+    return -1;
+  if (!length)
+    return -1;
+
+  star_run= -1;
+  for (i= 0;  starCommands[i].name;  ++i)
+    if (abbreviated ? !strncmp(starCommands[i].name, name, length)
+		    : !strcmp(starCommands[i].name, name))
+      return starCommands[i].handler(mpu, command + length + abbreviated);
+  return -1;
+}
+
+
+/* commands that are not built in go on to the MOS's own OSCLI at FFF7
+ * (and from there to the paged ROMs), or to system(3) with -O */
 int oscli(M6502 *mpu, word address, byte data)
 {
   char *command= getYXStringOscli(mpu);
-  system(command);
+  int status= starCommand(mpu, command);
+
+  if (status < 0)
+    {
+      if (!star_system)
+	return 0;
+      flushOutput();
+      system(command);
+    }
+  else if (status)
+    {
+      outputString(starError(status));
+      outputString("\n");
+    }
+  else if (star_run >= 0)
+    return star_run;
   rts;
 }
 
@@ -222,14 +987,13 @@ static int oswrchCommon(M6502 *mpu, word address, byte data)
   switch (mpu->registers->a)
     {
     case 0x0C:
-      fputs("\033[2J\033[H", stdout);
+      outputString("\033[2J\033[H");
       break;
 
     default:
-      putchar(mpu->registers->a);
+      outputByte(mpu->registers->a);
       break;
     }
-  fflush(stdout);
   return 0;
 }
 
@@ -249,7 +1013,88 @@ static int writeROM(M6502 *mpu, word address, byte value)
 
 static int bankSelect(M6502 *mpu, word address, byte value)
 {
-  memcpy(mpu->memory + 0x8000, bank[value & 0x0F], 0x4000);
+  /* paged ROM is write-protected so the copy in memory is still good,
+   * unless a host transfer has stored into it since (see stored()) */
+  if ((value & 0x0F) != bankCurrent)
+    {
+      memcpy(mpu->memory + 0x8000, bank[value & 0x0F], 0x4000);
+      stored(mpu, 0x8000, 0x4000);
+      bankCurrent= value & 0x0F;
+    }
+  return 0;
+}
+
+
+/* ROM images are mapped read-only and shared, so the page cache holds one
+ * copy for every process and pages are read only when first selected.
+ * Images shorter than 16K are copied into a zeroed buffer instead, since
+ * the mapping would end within the bank. */
+
+static const byte *mapImage(const char *path, size_t *size)
+{
+  struct stat info;
+  byte *image;
+  int fd;
+
+  if ((fd= open(path, O_RDONLY)) < 0)
+    return 0;
+  if ((fstat(fd, &info) < 0) || !S_ISREG(info.st_mode))
+    {
+      close(fd);
+      errno= EINVAL;
+      return 0;
+    }
+  *size= info.st_size;
+  if (info.st_size >= 0x4000)
+    image= mmap(0, 0x4000, PROT_READ, MAP_SHARED, fd, 0);
+  else if ((image= calloc(1, 0x4000)) && (pread(fd, image, info.st_size, 0) != info.st_size))
+    {
+      free(image);
+      image= 0;
+    }
+  close(fd);
+  return (MAP_FAILED == image) ? 0 : image;
+}
+
+
+static void mapBank(const char *path)
+{
+  size_t size;
+  if (bankNext < 0)
+    fail("too many images");
+  if (!(bank[bankNext--]= mapImage(path, &size)))
+    pfail(path);
+}
+
+
+/* -L dir indexes a library of ROM images: sideways ROMs (with a valid
+ * copyright string) go into the free paged ROM slots in name order and a
+ * Tube client ROM is remembered for -T */
+
+static const char  tubeSignature[]= "Acorn 6502 Tube";
+static const byte *tubeImage= 0;
+static size_t	   tubeSize= 0;
+
+static int romNameOrder(const void *a, const void *b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+
+static int romIsSideways(const byte *image, size_t size)
+{
+  size_t copyright= image[7];
+  return (size >= 0x100) && (size <= 0x4000)
+    && (copyright + 4 <= size) && !memcmp(image + copyright, "\0(C)", 4);
+}
+
+
+static int romHasTubeSignature(const byte *image, size_t size)
+{
+  size_t length= strlen(tubeSignature), i;
+  for (i= 0;  i + length <= size;  ++i)
+    if (!memcmp(image + i, tubeSignature, length))
+      return 1;
   return 0;
 }
 
@@ -268,14 +1113,19 @@ static int doBtraps(int argc, char **argv, M6502 *mpu)
 
   /* anything already loaded at 0x8000 appears in bank 0 */
 
-  memcpy(bank[0x00], mpu->memory + 0x8000, 0x4000);
+  memcpy(bank0, mpu->memory + 0x8000, 0x4000);
+  bank[0x00]= bank0;
+  bankCurrent= 0x00;
+  for (addr= 0x01;  addr <= 0x0F;  ++addr)
+    if (!bank[addr])
+      bank[addr]= bankEmpty;
 
   /* fake a few interesting OS calls */
 
 # define trap(vec, addr, func)   mpu->callbacks->call[addr]= (func)
   trap(0x020C, 0xFFF1, osword);
   trap(0x020A, 0xFFF4, osbyte);
-//trap(0x0208, 0xFFF7, oscli );	/* enable this to send '*COMMAND's to system(3) :-) */
+  trap(0x0208, 0xFFF7, oscli );
   trap(0x020E, 0xFFEE, oswrch);
   trap(0x020E, 0xE0A4, oswrch);	/* NVWRCH */
 #undef trap
@@ -309,8 +1159,334 @@ static void associateBbcFdAndHostFile(int bbc_fd, FILE *host_file)
 }
 
 
+/* -U serves OSBGET and OSBPUT from per-handle buffers that are filled
+ * (read-ahead) and emptied (write-behind) asynchronously by io_uring, so
+ * the 6502 only waits when a buffer is really empty.  Any other call on the
+ * handle first waits for the outstanding I/O, positions the host FILE to
+ * match and then drops the buffers; from then on the handle uses stdio. */
+
+#if defined(TUBE_IO_URING)
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define ASYNC_BUFFER	0x10000
+
+struct asyncBuffer
+{
+  byte	 *data;
+  off_t	  offset;	/* file offset of data[0] */
+  size_t  length;	/* bytes in buffer (output) or requested (input) */
+  size_t  done;		/* ... of which transferred so far */
+  int	  op;		/* of the transfer in progress */
+  int	  pending;	/* non-zero while io_uring owns the buffer */
+  int	  reaped;	/* non-zero until result has been looked at */
+  int	  result;	/* of the last read or write */
+  int	  error;
+};
+
+struct asyncFile
+{
+  FILE		     *file;
+  int		      output;
+  off_t		      next;		/* offset of the next read or write submitted */
+  size_t	      position;		/* next byte in current buffer (input) */
+  int		      current;
+  struct asyncBuffer  buffers[2];
+};
+
+static struct
+{
+  int			 fd;
+  unsigned		*sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned		*cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe	*sqes;
+  struct io_uring_cqe	*cqes;
+} ring= { -1 };
+
+static int async_enabled= 0;
+static struct asyncFile *async_array[256];
+
+
+static int ringSetup(void)
+{
+  struct io_uring_params p;
+  byte *sq= MAP_FAILED, *cq= MAP_FAILED;
+  size_t sqSize, cqSize, sqesSize;
+
+  memset(&p, 0, sizeof(p));
+  if ((ring.fd= syscall(__NR_io_uring_setup, 64, &p)) < 0)
+    return 0;
+  sqSize= p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqSize= p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+  sqesSize= p.sq_entries * sizeof(struct io_uring_sqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && (cqSize > sqSize))
+    sqSize= cqSize;
+  sq= mmap(0, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == sq)
+    goto failed;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq= sq;
+  else if (MAP_FAILED == (cq= mmap(0, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING)))
+    goto failed;
+  ring.sqes= mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (MAP_FAILED == ring.sqes)
+    goto failed;
+  ring.sqHead=  (unsigned *)(sq + p.sq_off.head);
+  ring.sqTail=  (unsigned *)(sq + p.sq_off.tail);
+  ring.sqMask=  (unsigned *)(sq + p.sq_off.ring_mask);
+  ring.sqArray= (unsigned *)(sq + p.sq_off.array);
+  ring.cqHead=  (unsigned *)(cq + p.cq_off.head);
+  ring.cqTail=  (unsigned *)(cq + p.cq_off.tail);
+  ring.cqMask=  (unsigned *)(cq + p.cq_off.ring_mask);
+  ring.cqes=    (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 1;
+
+ failed:
+  if ((MAP_FAILED != cq) && (cq != sq)) munmap(cq, cqSize);
+  if (MAP_FAILED != sq) munmap(sq, sqSize);
+  close(ring.fd);
+  ring.fd= -1;
+  return 0;
+}
+
+
+/* at most four buffers per handle are in flight, so the ring never fills
+ * up with fewer than 16 handles busy; beyond that, wait for room */
+static void ringReap(int wait);
+
+/* transfer what remains of b (all of it, unless a transfer came up short) */
+static void ringSubmit(int op, struct asyncFile *f, struct asyncBuffer *b)
+{
+  unsigned tail= *ring.sqTail, index;
+  struct io_uring_sqe *sqe;
+
+  while (tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) > *ring.sqMask)
+    ringReap(1);
+  index= tail & *ring.sqMask;
+  sqe= ring.sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode= op;
+  sqe->fd= fileno(f->file);
+  sqe->addr= (unsigned long)(b->data + b->done);
+  sqe->len= b->length - b->done;
+  sqe->off= b->offset + b->done;
+  sqe->user_data= (unsigned long)b;
+  ring.sqArray[index]= index;
+  b->op= op;
+  b->pending= 1;
+  __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+  while ((syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, 0, 0) < 0) && (EINTR == errno))
+    ;
+}
+
+
+static void ringReap(int wait)
+{
+  unsigned head= *ring.cqHead;
+  if (wait && (head == __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)))
+    syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0);
+  while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe *cqe= ring.cqes + (head & *ring.cqMask);
+      struct asyncBuffer *b= (struct asyncBuffer *)(unsigned long)cqe->user_data;
+      b->result= cqe->res;
+      b->pending= 0;
+      b->reaped= 1;
+      ++head;
+    }
+  __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+}
+
+
+/* wait until b has been transferred, resubmitting the rest after a short
+ * read or write (which network filesystems return routinely); answer the
+ * bytes transferred, fewer than asked for only at end of file, or -1 */
+static int asyncSettle(struct asyncFile *f, struct asyncBuffer *b)
+{
+  for (;;)
+    {
+      if (b->reaped)
+	{
+	  b->reaped= 0;
+	  if (b->result < 0)
+	    b->error= 1;
+	  else if (b->result > 0 && (b->done += b->result) < b->length)
+	    ringSubmit(b->op, f, b);
+	  else if (!b->result && IORING_OP_WRITE == b->op)
+	    b->error= 1;		/* no progress: don't spin */
+	}
+      else if (b->pending)
+	ringReap(1);
+      else
+	break;
+    }
+  return b->error ? -1 : (int)b->done;
+}
+
+
+static void asyncRead(struct asyncFile *f, struct asyncBuffer *b)
+{
+  b->offset= f->next;
+  b->length= ASYNC_BUFFER;
+  b->done= 0;
+  ringSubmit(IORING_OP_READ, f, b);
+  f->next += ASYNC_BUFFER;
+}
+
+
+static void asyncOpen(int bbc_fd, FILE *host_file, int output)
+{
+  struct asyncFile *f;
+  int i;
+
+  if (!async_enabled || !(f= calloc(1, sizeof(*f))))
+    return;
+  f->file= host_file;
+  f->output= output;
+  for (i= 0;  i < 2;  ++i)
+    if (!(f->buffers[i].data= malloc(ASYNC_BUFFER)))
+      {
+	free(f->buffers[0].data);
+	free(f);
+	return;
+      }
+  if (!output)
+    {
+      asyncRead(f, f->buffers + 0);
+      asyncRead(f, f->buffers + 1);
+    }
+  async_array[bbc_fd]= f;
+}
+
+
+static int asyncGetc(int bbc_fd)
+{
+  struct asyncFile *f= async_array[bbc_fd];
+  for (;;)
+    {
+      struct asyncBuffer *b= f->buffers + f->current;
+      int done;
+      if (f->position < b->done)
+	return b->data[f->position++];
+      if ((done= asyncSettle(f, b)) < 0)
+	return EOF;
+      if (f->position < (size_t)done)
+	continue;
+      if ((size_t)done < b->length)
+	return EOF;		/* a read of nothing: end of file */
+      /* drained: refill it behind the other buffer and move on */
+      asyncRead(f, b);
+      f->position= 0;
+      f->current ^= 1;
+    }
+}
+
+
+static int asyncPutc(int bbc_fd, int c)
+{
+  struct asyncFile *f= async_array[bbc_fd];
+  struct asyncBuffer *b= f->buffers + f->current;
+  b->data[b->length++]= c;
+  if (ASYNC_BUFFER == b->length)
+    {
+      b->offset= f->next;
+      b->done= 0;
+      ringSubmit(IORING_OP_WRITE, f, b);
+      f->next += b->length;
+      f->current ^= 1;
+      b= f->buffers + f->current;
+      if (asyncSettle(f, b) != (int)b->length)
+	return EOF;
+      b->length= b->done= 0;
+    }
+  return c;
+}
+
+
+/* wait for outstanding I/O, write anything still buffered and leave the
+ * host FILE positioned where the 6502 thinks it is */
+static int asyncSync(int bbc_fd)
+{
+  struct asyncFile *f= async_array[bbc_fd];
+  int status= 0;
+
+  if (!f)
+    return 0;
+  async_array[bbc_fd]= 0;
+  if (f->output)
+    {
+      struct asyncBuffer *b= f->buffers + (f->current ^ 1);
+      if (asyncSettle(f, b) != (int)b->length)
+	status= EOF;
+      b= f->buffers + f->current;
+      while (b->done < b->length)
+	{
+	  ssize_t n= pwrite(fileno(f->file), b->data + b->done, b->length - b->done, f->next + b->done);
+	  if (n <= 0)
+	    {
+	      if ((n < 0) && (EINTR == errno)) continue;
+	      status= EOF;
+	      break;
+	    }
+	  b->done += n;
+	}
+      f->next += b->length;
+      fseek(f->file, f->next, SEEK_SET);
+    }
+  else
+    {
+      asyncSettle(f, f->buffers + 0);
+      asyncSettle(f, f->buffers + 1);
+      fseek(f->file, f->buffers[f->current].offset + f->position, SEEK_SET);
+    }
+  free(f->buffers[0].data);
+  free(f->buffers[1].data);
+  free(f);
+  return status;
+}
+
+
+static void asyncSyncAll(void)
+{
+  int bbc_fd;
+  for (bbc_fd= 1;  bbc_fd <= 255;  ++bbc_fd)
+    asyncSync(bbc_fd);
+}
+
+
+static int doAsync(int argc, char **argv, M6502 *mpu)	/* -U */
+{
+  if (!async_enabled && ringSetup())
+    {
+      async_enabled= 1;
+      atexit(asyncSyncAll);
+    }
+  return 0;
+}
+
+#define isAsync(BBCFD)	(0 != async_array[BBCFD])
+
+#else /* !TUBE_IO_URING */
+
+#define isAsync(BBCFD)			0
+#define asyncOpen(BBCFD, FILE, OUTPUT)	((void)0)
+#define asyncGetc(BBCFD)		EOF
+#define asyncPutc(BBCFD, C)		EOF
+#define asyncSync(BBCFD)		0
+
+static int doAsync(int argc, char **argv, M6502 *mpu)	/* -U */
+{
+  fail("-U requires run6502 to be built with -DTUBE_IO_URING");
+  return 0;
+}
+
+#endif /* !TUBE_IO_URING */
+
+
 static FILE *getHostFileForBbcFd(int bbc_fd)
 {
+  asyncSync(bbc_fd);
   return fd_array[bbc_fd];
 }
 
@@ -321,24 +1497,94 @@ static void freeBbcFd(int bbc_fd)
 }
 
 
-static int tubeOscli(M6502 *mpu, word address, byte value)
+/* raise a BBC error by executing a BRK, error number and message planted
+ * at 0x100; the result is returned from the trap */
+static int tubeError(M6502 *mpu, byte number, const char *error)
 {
-  const char *error= "Bad command";
-  size_t error_length= strlen(error);
-  char *command= getYXString(mpu);
-  fprintf(stderr, "TODO OSCLI: '%s'\n", command);
-
   mpu->memory[0x100]= 0x00; /* BRK */
-  mpu->memory[0x101]= 254;
-  memcpy(mpu->memory + 0x102, error, error_length + 1); /* +1 as we want the NUL terminator */
+  mpu->memory[0x101]= number;
+  memcpy(mpu->memory + 0x102, error, strlen(error) + 1); /* +1 as we want the NUL terminator */
+  stored(mpu, 0x100, strlen(error) + 3);
   return 0x100;
 }
 
 
+static int tubeOscli(M6502 *mpu, word address, byte value)
+{
+  char *command= getYXStringOscli(mpu);
+  int status= starCommand(mpu, command);
+
+  if ((status < 0) && star_system)
+    {
+      flushOutput();
+      system(command);
+      return 0;
+    }
+  if (status)
+    return tubeError(mpu, status < 0 ? 254 : status, starError(status < 0 ? 254 : status));
+  if (star_run >= 0)
+    return star_run;
+  return 0;
+}
+
+
 static int tubeOsbyte(M6502 *mpu, word address, byte value)
 {
   switch (mpu->registers->a)
     {
+      case 0x7C:	/* clear escape condition */
+	keyboardEscape();
+	mpu->memory[0xFF] &= 0x7F;
+	return 0;
+
+      case 0x7D:	/* set escape condition */
+	mpu->memory[0xFF] |= 0x80;
+	return 0;
+
+      case 0x7E:	/* acknowledge escape condition */
+	mpu->registers->x= (keyboardEscape() || (mpu->memory[0xFF] & 0x80)) ? 0xFF : 0x00;
+	mpu->memory[0xFF] &= 0x7F;
+	return 0;
+
+      case 0x81:	/* INKEY: read key with time limit */
+	if (mpu->registers->y >= 0x80)
+	  {
+	    /* keyboard scan: no key is ever seen to be down */
+	    mpu->registers->x= mpu->registers->y= 0;
+	    return 0;
+	  }
+	if (keyboard.running)
+	  {
+	    int c= keyboardGet(mpu->registers->x | (mpu->registers->y << 8));
+	    if (0x1B == c)
+	      {
+		mpu->memory[0xFF] |= 0x80;
+		mpu->registers->y= 0x1B;
+		mpu->registers->p |= 1;
+	      }
+	    else if (c < 0)
+	      {
+		mpu->registers->y= 0xFF;
+		mpu->registers->p |= 1;
+	      }
+	    else
+	      {
+		mpu->registers->x= c;
+		mpu->registers->y= 0;
+		mpu->registers->p &= 0xFE;
+	      }
+	    return 0;
+	  }
+	break;
+
+      case 0xE5:	/* read/write Escape key status */
+	{
+	  byte old= escape_status;
+	  __atomic_store_n(&escape_status, (old & mpu->registers->y) ^ mpu->registers->x, __ATOMIC_RELEASE);
+	  mpu->registers->x= old;
+	  return 0;
+	}
+
       case 0xA3:
         if (mpu->registers->x == 243) 
 	  {
@@ -351,6 +1597,7 @@ static int tubeOsbyte(M6502 *mpu, word address, byte value)
                   {
 		    strcpy(mpu->memory + 0x800, tube_command);
 		    strcat(mpu->memory + 0x800, "\r");
+		    stored(mpu, 0x800, strlen(tube_command) + 2);
 		    mpu->registers->y = 0x08;
 		    mpu->registers->x = 0x00;
                   }
@@ -371,7 +1618,7 @@ static int tubeOsbyte(M6502 *mpu, word address, byte value)
 
     char state[64];
     M6502_dump(mpu, state);
-    fflush(stdout);
+    flushOutput();
     fprintf(stderr, "\nUnsupported OSBYTE %02X: %s\n", mpu->registers->a, state);
     /* Carry on; an unsupported OSBYTE is not necessarily a problem, it can happen 
      * on a real machine. We set X to 0xFF.
@@ -399,7 +1646,7 @@ static int tubeOsword(M6502 *mpu, word address, byte value)
 
     char state[64];
     M6502_dump(mpu, state);
-    fflush(stdout);
+    flushOutput();
     fprintf(stderr, "\nUnsupported OSWORD %02X: %s\n", mpu->registers->a, state);
     /* Carry on. TODO: What does a real machine do in this case? */
 
@@ -414,38 +1661,265 @@ static int tubeOsrdch(M6502 *mpu, word address, byte value)
    * keypresses. For that matter, it might also be nice to do a curses mode with
    * basic terminal emulation.
    */
-  int c= getchar();
-  if (c == EOF)
+  int c;
+  if ((c= readKey()) == EOF)
     exit(0);
   mpu->registers->a= c;
+  if ((0x1B == c) && keyboard.running)
+    {
+      mpu->memory[0xFF] |= 0x80;
+      mpu->registers->p |= 1;	/* escape */
+    }
+  else
+    mpu->registers->p &= 0xFE;
   return 0;
 }
 
 
-static int tubeOsbget(M6502 *mpu, word address, byte value)
-{
-  FILE *host_file= getHostFileForBbcFd(mpu->registers->y);
-  if (host_file == 0)
-  {
-    /* TODO: I suspect we should raise an OS error ("Channel"). For now we just
-     * return with C set to indicate an error. */
-    mpu->registers->p |= 1;
-    return 0;
-  }
+static int tubeOsbget(M6502 *mpu, word address, byte value)
+{
+  FILE *host_file;
+  int c;
+
+  if (isAsync(mpu->registers->y))
+    c= asyncGetc(mpu->registers->y);
+  else if ((host_file= getHostFileForBbcFd(mpu->registers->y)))
+    c= getc(host_file);
+  else
+  {
+    /* TODO: I suspect we should raise an OS error ("Channel"). For now we just
+     * return with C set to indicate an error. */
+    mpu->registers->p |= 1;
+    return 0;
+  }
+
+  if (c == EOF)
+  {
+    /* TODO: We should probably raise an OS error if this is an error not just
+     * EOF. For now we treat both the same. */
+    mpu->registers->p |= 1; /* TODO: Not just here, we need a macro or helper
+			       fn for this */
+    return 0;
+  }
+  
+  mpu->registers->a= c;
+  mpu->registers->p &= 0xFE;
+  return 0;
+}
+
+
+static int tubeOsbput(M6502 *mpu, word address, byte value)
+{
+  FILE *host_file;
+  if (isAsync(mpu->registers->y))
+    {
+      if (asyncPutc(mpu->registers->y, mpu->registers->a) == EOF)
+	return tubeError(mpu, 202, "Disc fault");
+      return 0;
+    }
+  if ((host_file= getHostFileForBbcFd(mpu->registers->y)) == 0)
+    return tubeError(mpu, 222, "Channel");
+  if (putc(mpu->registers->a, host_file) == EOF)
+    return tubeError(mpu, 202, "Disc fault");
+  return 0;
+}
+
+
+/* OSGBPB control blocks hold 32-bit little-endian values */
+/* control blocks are read and written a byte at a time, wrapping round
+ * the top of memory like the operands of an insn */
+
+static unsigned long getBlockWord(M6502 *mpu, word address)
+{
+  unsigned long value= 0;
+  int k;
+  for (k= 4;  k--; )
+    value= (value << 8) | mpu->memory[(word)(address + k)];
+  return value;
+}
+
+static void putBlockWord(M6502 *mpu, word address, unsigned long value)
+{
+  int k;
+  for (k= 0;  k < 4;  ++k, value >>= 8)
+    {
+      mpu->memory[(word)(address + k)]= value;
+      stored(mpu, (word)(address + k), 1);
+    }
+}
+
+
+/* On entry: XY=>control block: +0 handle, +1 data address, +5 byte count,
+ *	     +9 sequential pointer (used by A=1 and A=3 only).
+ * On exit:  the data address is advanced and the count reduced by the bytes
+ *	     transferred, +9 holds the new sequential pointer, A=0 and C is
+ *	     set if the transfer could not be completed (end of file).
+ * Each transfer is a single fread/fwrite straight to or from memory (two if
+ * it wraps around the top of memory). */
+static int tubeOsgbpb(M6502 *mpu, word address, byte value)
+{
+  word block= mpu->registers->x + (mpu->registers->y << 8);
+  int reason= mpu->registers->a;
+  FILE *host_file;
+  unsigned long data, count, done= 0;
+  long ptr;
+
+  if ((reason < 1) || (reason > 4))
+    {
+      char state[64];
+      M6502_dump(mpu, state);
+      flushOutput();
+      fprintf(stderr, "\nUnsupported OSGBPB %02X: %s\n", reason, state);
+      return 0; /* A unchanged tells the caller the call is not supported */
+    }
+
+  if ((host_file= getHostFileForBbcFd(mpu->memory[block])) == 0)
+    return tubeError(mpu, 222, "Channel");
+
+  data=  getBlockWord(mpu, block + 1);
+  count= getBlockWord(mpu, block + 5);
+  if ((reason == 1) || (reason == 3))
+    ptr= fseek(host_file, getBlockWord(mpu, block + 9), SEEK_SET);
+  else
+    ptr= fseek(host_file, 0, SEEK_CUR); /* required between reads and writes */
+  if (ptr < 0)
+    return tubeError(mpu, 202, "Disc fault");
+
+  while (done < count)
+    {
+      size_t chunk= count - done, n;
+      if (chunk > 0x10000 - (data & 0xFFFF))
+	chunk= 0x10000 - (data & 0xFFFF);
+      if (reason <= 2)
+	n= fwrite(mpu->memory + (data & 0xFFFF), 1, chunk, host_file);
+      else
+	{
+	  n= fread(mpu->memory + (data & 0xFFFF), 1, chunk, host_file);
+	  stored(mpu, data & 0xFFFF, n);
+	}
+      done += n;
+      data += n;
+      if (n < chunk)
+	break;
+    }
+  if ((reason <= 2) && (done < count))
+    return tubeError(mpu, 202, "Disc fault");
+
+  putBlockWord(mpu, block + 1, data);
+  putBlockWord(mpu, block + 5, count - done);
+  putBlockWord(mpu, block + 9, ftell(host_file));
+  mpu->registers->a= 0;
+  if (done < count)
+    mpu->registers->p |= 1;
+  else
+    mpu->registers->p &= 0xFE;
+  return 0;
+}
+
+
+/* On entry: XY=>control block: +0 filename address, +2 load address,
+ *	     +6 execution address, +10 start address or length,
+ *	     +14 end address or attributes.
+ * Host files carry no load or execution address: loads always go to the
+ * address in the control block and catalogue information reports them as
+ * zero.  Whole files are read or written with a single pread/pwrite. */
+static int tubeOsfile(M6502 *mpu, word address, byte value)
+{
+  word block= mpu->registers->x + (mpu->registers->y << 8);
+  char *name= getString(mpu, mpu->memory[block] | (mpu->memory[(word)(block + 1)] << 8));
+  struct stat info;
+  int fd;
+
+  switch (mpu->registers->a)
+    {
+    case 0x00:	/* save memory between start and end */
+      {
+	unsigned long start= getBlockWord(mpu, block + 10), end= getBlockWord(mpu, block + 14);
+	size_t length= (end > start) ? end - start : 0;
+	if (length > 0x10000)
+	  length= 0x10000;
+	if ((fd= open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	  return tubeError(mpu, 192, "Can't open file");
+	if (fileTransfer(mpu, fd, 1, start, length) != (ssize_t)length)
+	  {
+	    close(fd);
+	    return tubeError(mpu, 202, "Disc fault");
+	  }
+	close(fd);
+	putBlockWord(mpu, block + 10, length);
+	putBlockWord(mpu, block + 14, 0);
+	mpu->registers->a= 1;
+	return 0;
+      }
+
+    case 0x05:	/* read catalogue information */
+      if (stat(name, &info) < 0)
+	{
+	  mpu->registers->a= 0;
+	  return 0;
+	}
+      putBlockWord(mpu, block + 2, 0);
+      putBlockWord(mpu, block + 6, 0);
+      putBlockWord(mpu, block + 10, info.st_size);
+      putBlockWord(mpu, block + 14, 0);
+      mpu->registers->a= S_ISDIR(info.st_mode) ? 2 : 1;
+      return 0;
+
+    case 0x06:	/* delete */
+      if (stat(name, &info) < 0)
+	{
+	  mpu->registers->a= 0;
+	  return 0;
+	}
+      if (remove(name) < 0)
+	return tubeError(mpu, 195, "Locked");
+      mpu->registers->a= S_ISDIR(info.st_mode) ? 2 : 1;
+      return 0;
 
-  int c= getc(host_file);
-  if (c == EOF)
-  {
-    /* TODO: We should probably raise an OS error if this is an error not just
-     * EOF. For now we treat both the same. */
-    mpu->registers->p |= 1; /* TODO: Not just here, we need a macro or helper
-			       fn for this */
-    return 0;
-  }
-  
-  mpu->registers->a= c;
-  mpu->registers->p &= 0xFE;
-  return 0;
+    case 0xFF:	/* load into memory */
+      if ((fd= open(name, O_RDONLY)) < 0)
+	return tubeError(mpu, 214, "File not found");
+      if ((fstat(fd, &info) < 0) || S_ISDIR(info.st_mode))
+	{
+	  close(fd);
+	  return tubeError(mpu, 214, "File not found");
+	}
+      if (info.st_size > 0x10000 - (getBlockWord(mpu, block + 2) & 0xFFFF))
+	{
+	  close(fd);
+	  return tubeError(mpu, 252, "Bad address");
+	}
+      if (fileTransfer(mpu, fd, 0, getBlockWord(mpu, block + 2), info.st_size) < 0)
+	{
+	  close(fd);
+	  return tubeError(mpu, 202, "Disc fault");
+	}
+      close(fd);
+      putBlockWord(mpu, block + 10, info.st_size);
+      putBlockWord(mpu, block + 14, 0);
+      mpu->registers->a= 1;
+      return 0;
+
+    case 0x01:	/* write catalogue information */
+    case 0x02:	/* write load address */
+    case 0x03:	/* write execution address */
+    case 0x04:	/* write attributes */
+      /* nowhere to keep them: report the object type and carry on */
+      if (stat(name, &info) < 0)
+	mpu->registers->a= 0;
+      else
+	mpu->registers->a= S_ISDIR(info.st_mode) ? 2 : 1;
+      return 0;
+
+    default:
+      {
+	char state[64];
+	M6502_dump(mpu, state);
+	flushOutput();
+	fprintf(stderr, "\nUnsupported OSFILE %02X: %s\n", mpu->registers->a, state);
+	return 0;
+      }
+    }
 }
 
 
@@ -496,6 +1970,8 @@ static int tubeOsfindOpen(M6502 *mpu, const char *mode)
   }
 
   associateBbcFdAndHostFile(bbc_fd, host_file);
+  if (!strcmp(mode, "rb") || !strcmp(mode, "wb"))
+    asyncOpen(bbc_fd, host_file, 'w' == *mode);
   mpu->registers->a= bbc_fd;
   return 0;
 }
@@ -533,7 +2009,7 @@ static int tubeOsfind(M6502 *mpu, word address, byte value)
 	/* TODO: Code like this occurs a lot, factor it out */
 	char state[64];
 	M6502_dump(mpu, state);
-	fflush(stdout);
+	flushOutput();
 	fprintf(stderr, "\nUnsupported OSFIND %02X: %s\n", mpu->registers->a, state);
 
 	/* TODO: Not necessarily best option (what would a real machine do? is it
@@ -559,7 +2035,7 @@ static int tubeEnterLanguage(M6502 *mpu, word address, byte value)
       */
     char state[64];
     M6502_dump(mpu, state);
-    fflush(stdout);
+    flushOutput();
     fprintf(stderr, "\nUnsupported enter language call: %s\n", state);
     fail("ABORT");
 
@@ -569,24 +2045,17 @@ static int tubeEnterLanguage(M6502 *mpu, word address, byte value)
 
 static int doTtraps(int argc, char **argv, M6502 *mpu)
 {
-  unsigned addr;
-  const char *signature= "Acorn 6502 Tube";
-  size_t signature_length= strlen(signature);
-  int found;
-
   /* The tube emulation requires the 2K ROM from 65Tube to be loaded at 0xF800. Refuse
    * to continue if something like it isn't there. To allow for variations, we just
-   * check for a certain string somewhere in the right area.
+   * check for a certain string somewhere in the right area.  A ROM found by -L is
+   * used if nothing is there.
    */
-  found= 0;
-  for (addr= 0xF800;  addr <= (0x10000 - signature_length);  ++addr)
-    if (!memcmp(mpu->memory + addr, signature, signature_length))
-      {
-        found= 1; 
-	break;
-      }
-  if (!found)
-    fail("-T requires Tube emulation ROM to be loaded");
+  if (!romHasTubeSignature(mpu->memory + 0xF800, 0x800))
+    {
+      if (!tubeImage)
+	fail("-T requires Tube emulation ROM to be loaded");
+      memcpy(mpu->memory + 0xF800, tubeImage, tubeSize);
+    }
 
   /* On real hardware the ROM is copied into RAM on startup; all 64K is writeable. So
    * we don't need to write-protect anything. */
@@ -596,7 +2065,10 @@ static int doTtraps(int argc, char **argv, M6502 *mpu)
   M6502_setCallback(mpu, illegal_instruction, 0x23, tubeOsword);
   M6502_setCallback(mpu, illegal_instruction, 0x33, oswrchCommon);
   M6502_setCallback(mpu, illegal_instruction, 0x43, tubeOsrdch);
+  M6502_setCallback(mpu, illegal_instruction, 0x53, tubeOsfile);
   M6502_setCallback(mpu, illegal_instruction, 0x73, tubeOsbget);
+  M6502_setCallback(mpu, illegal_instruction, 0x83, tubeOsbput);
+  M6502_setCallback(mpu, illegal_instruction, 0x93, tubeOsgbpb);
   M6502_setCallback(mpu, illegal_instruction, 0xA3, tubeOsfind);
   M6502_setCallback(mpu, illegal_instruction, 0xB3, tubeQuit);
   M6502_setCallback(mpu, illegal_instruction, 0xC3, tubeEnterLanguage);
@@ -613,21 +2085,38 @@ static void usage(int status)
   fprintf(stream, "\n");
   fprintf(stream, "usage: %s [option ...]\n", program);
   fprintf(stream, "       %s [option ...] -B [image ...]\n", program);
+  fprintf(stream, "  -A file           -- write a map of memory accesses to file on exit\n");
   fprintf(stream, "  -B                -- minimal Acorn 'BBC Model B' compatibility\n");
+  fprintf(stream, "  -b addr           -- report registers each time PC reaches addr\n");
+  fprintf(stream, "  -C file           -- merge coverage into file on exit\n");
   fprintf(stream, "  -c                -- next argument is command to run on Tube startup\n"); /* TODO: This is not documented in run6502.1 */
+  fprintf(stream, "  -D interval       -- check the interpreter against M6502_step every interval insns\n");
   fprintf(stream, "  -d addr last      -- dump memory between addr and last\n");
+  fprintf(stream, "  -E file           -- write coverage and branch counts as text on exit\n");
+  fprintf(stream, "  -e addr           -- add an entry point for -F\n");
+  fprintf(stream, "  -F addr last file -- print the control flow of addr to last, cached in file\n");
   fprintf(stream, "  -G addr           -- emulate getchar(3) at addr\n");
+  fprintf(stream, "  -H interval mb    -- keep history for reverse execution at breakpoints\n");
   fprintf(stream, "  -h                -- help (print this message)\n");
   fprintf(stream, "  -I addr           -- set IRQ vector\n");
+  fprintf(stream, "  -K                -- read the keyboard in raw mode on its own thread\n");
+  fprintf(stream, "  -L dir            -- map ROM images from dir into paged ROM slots\n");
   fprintf(stream, "  -l addr file      -- load file at addr\n");
   fprintf(stream, "  -M addr           -- emulate memory-mapped stdio at addr\n");
+  fprintf(stream, "  -m name           -- keep memory and registers in shared memory /name\n");
   fprintf(stream, "  -N addr           -- set NMI vector\n");
+  fprintf(stream, "  -O                -- pass unknown *commands to system(3)\n");
   fprintf(stream, "  -P addr           -- emulate putchar(3) at addr\n");
   fprintf(stream, "  -R addr           -- set RST vector\n");
+  fprintf(stream, "  -r addr last      -- report reads of memory between addr and last\n");
+  fprintf(stream, "  -S                -- print performance counters on exit\n");
   fprintf(stream, "  -s addr last file -- save memory from addr to last in file\n");
   fprintf(stream, "  -T                -- Acorn 6502 Tube emulation\n");
+  fprintf(stream, "  -U                -- asynchronous Tube file I/O (io_uring)\n");
   fprintf(stream, "  -v                -- print version number then exit\n");
+  fprintf(stream, "  -V name addr last -- print memory of the machine running with -m name\n");
   fprintf(stream, "  -w                -- write memory to file run6502.out on exit\n");
+  fprintf(stream, "  -W addr last      -- report writes to memory between addr and last\n");
   fprintf(stream, "  -X addr           -- terminate emulation if PC reaches addr\n");
   fprintf(stream, "  -x                -- exit without further ado\n");
   fprintf(stream, "  image             -- '-l 8000 image' in available ROM slot\n");
@@ -694,6 +2183,175 @@ static void writeMemory(void)
 }
 
 
+/* -C and -E write coverage at exit, however the program gets there */
+
+static const char     *coverage_path= 0;
+static const char     *coverage_text= 0;
+static M6502_Coverage *coverage= 0;
+
+
+static void writeCoverage(void)
+{
+  M6502_Coverage *c= coverage;
+  coverage= 0;			/* once only */
+  if (!c)
+    return;
+  if (coverage_path)
+    {
+      /* runs in parallel merge into the same file one at a time, under a
+       * lock on a file of its own (the merged file is replaced, not
+       * rewritten, so that readers never see it half written) */
+      size_t length= strlen(coverage_path) + 32;
+      char  *lock= malloc(length), *temp= malloc(length);
+      int    fd;
+      if (!lock || !temp)
+	fail("out of memory");
+      sprintf(lock, "%s.lock", coverage_path);
+      sprintf(temp, "%s.%ld", coverage_path, (long)getpid());
+      if ((fd= open(lock, O_RDWR | O_CREAT, 0666)) < 0)
+	pfail(lock);
+      while (flock(fd, LOCK_EX) < 0)
+	if (EINTR != errno)
+	  pfail(lock);
+      if (!M6502_loadCoverage(c, coverage_path) && errno != ENOENT)
+	pfail(coverage_path);
+      if (!M6502_saveCoverage(c, temp))
+	pfail(temp);
+      if (rename(temp, coverage_path) < 0)
+	{
+	  unlink(temp);
+	  pfail(coverage_path);
+	}
+      close(fd);
+      free(temp);
+      free(lock);
+    }
+  if (coverage_text)
+    {
+      FILE *file= fopen(coverage_text, "w");
+      if (!file)
+	pfail(coverage_text);
+      M6502_printCoverage(c, file);
+      fclose(file);
+    }
+}
+
+
+static int doCoverage(int argc, char **argv, M6502 *mpu)	/* -C file */
+{
+  if (argc < 2) usage(1);
+  coverage_path= argv[1];
+  return 1;
+}
+
+
+static int doCoverageText(int argc, char **argv, M6502 *mpu)	/* -E file */
+{
+  if (argc < 2) usage(1);
+  coverage_text= argv[1];
+  return 1;
+}
+
+
+/* -S prints performance counters at exit, however the program gets there */
+
+static M6502 *stats_mpu= 0;
+
+
+static void printStats(void)
+{
+  static const char *kinds[M6502_CallbackKinds]= { "read", "write", "call", "illegal" };
+  M6502_Stats stats;
+  uint64_t    inside= 0;
+  int	      i;
+
+  if (!stats_mpu)
+    return;
+  flushOutput();
+  if (!M6502_getStats(stats_mpu, &stats))
+    {
+      fprintf(stderr, "%s: statistics not available (build lib6502 with -DM6502_STATS)\n", program);
+      stats_mpu= 0;
+      return;
+    }
+  stats_mpu= 0;			/* once only */
+  for (i= 0;  i < M6502_CallbackKinds;  ++i)
+    inside += stats.callbackTime[i];
+  fprintf(stderr, "%s: %llu instructions, %llu cycles in %.3f s (%.2f MIPS)\n", program,
+	  (unsigned long long)stats.insns, (unsigned long long)stats.cycles, stats.runTime / 1e9,
+	  stats.runTime ? stats.insns * 1e3 / stats.runTime : 0.0);
+  fprintf(stderr, "  interpreting %.3f s, callbacks %.3f s\n",
+	  (stats.runTime - inside) / 1e9, inside / 1e9);
+  for (i= 0;  i < M6502_CallbackKinds;  ++i)
+    if (stats.callbacks[i])
+      fprintf(stderr, "  %-8s %12llu callbacks %10.3f s\n", kinds[i],
+	      (unsigned long long)stats.callbacks[i], stats.callbackTime[i] / 1e9);
+}
+
+
+static int doStats(int argc, char **argv, M6502 *mpu)	/* -S */
+{
+  if (!stats_mpu)
+    atexit(printStats);
+  stats_mpu= mpu;
+  return 0;
+}
+
+
+/* -A writes a 256x256 map of memory accesses at exit: a row per page and
+ * a column per address, each character showing (on a log4 scale) how
+ * often the address was read or written; then the totals per page */
+
+static const char    *heatmap_path= 0;
+static M6502_Heatmap *heatmap= 0;
+
+
+static void writeHeatmap(void)
+{
+  static const char shades[]= " .:-=+*#%@";
+  M6502_Heatmap *h= heatmap;
+  FILE		*file;
+  unsigned	 page, addr;
+
+  heatmap= 0;			/* once only */
+  if (!h)
+    return;
+  if (!(file= fopen(heatmap_path, "w")))
+    pfail(heatmap_path);
+  fprintf(file, "# accesses per address: ' ' none, '.' 1-3, ':' 4-15, ... '@' 65536 or more\n");
+  for (page= 0;  page < 0x100;  ++page)
+    {
+      fprintf(file, "%02X ", page);
+      for (addr= page << 8;  addr < (page + 1) << 8;  ++addr)
+	{
+	  uint64_t n= (uint64_t)h->addresses[addr][0] + h->addresses[addr][1];
+	  int	   shade= 0;
+	  while (n && shade < (int)sizeof(shades) - 2)
+	    {
+	      ++shade;
+	      n >>= 2;
+	    }
+	  putc(shades[shade], file);
+	}
+      putc('\n', file);
+    }
+  fprintf(file, "# page reads writes\n");
+  for (page= 0;  page < 0x100;  ++page)
+    if (h->pages[page][0] || h->pages[page][1])
+      fprintf(file, "%02X %llu %llu\n", page,
+	      (unsigned long long)h->pages[page][0], (unsigned long long)h->pages[page][1]);
+  fclose(file);
+}
+
+
+static int doHeatmap(int argc, char **argv, M6502 *mpu)	/* -A file */
+{
+  if (argc < 2) usage(1);
+  heatmap_path= argv[1];
+  return 1;
+}
+
+
 /* TODO: Although -s is a startup option, we could make -w defer the action of -s,
  * respecting its parameters when the time comes to save, instead of using a
  * hard-coded address range and filename.
@@ -716,6 +2374,128 @@ static unsigned long htol(char *hex)
 }
 
 
+/* -m name puts the memory and registers in the POSIX shared memory object
+ * /name, where run6502 -V (or anything else that maps it) can watch them
+ * live without copying or slowing the emulator.  Memory is always current;
+ * the registers are as of the most recent callback or trap.
+ */
+
+#define SHARED_MAGIC	"run6502m"
+
+struct sharedMachine
+{
+  char		  magic[8];
+  M6502_Registers registers;
+  byte		  memory[0x10000];
+};
+
+static char *shared_name= 0;
+
+
+static void sharedUnlink(void)
+{
+  if (shared_name)
+    shm_unlink(shared_name);
+}
+
+
+static void (*sharedSignals[NSIG])(int);
+
+static void sharedSignal(int signum)
+{
+  sharedUnlink();
+  signal(signum, sharedSignals[signum]);
+  raise(signum);
+}
+
+
+static char *sharedName(const char *name)
+{
+  char *path= malloc(strlen(name) + 2);
+  if (!path) fail("out of memory");
+  sprintf(path, "%s%s", ('/' == *name) ? "" : "/", name);
+  return path;
+}
+
+
+static int doShared(int argc, char **argv, M6502 *mpu)	/* -m name */
+{
+  struct sharedMachine *shared;
+  int fd;
+
+  if (argc < 2) usage(1);
+  if (shared_name) fail("-m given twice");
+  shared_name= sharedName(argv[1]);
+  if ((fd= shm_open(shared_name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    pfail(argv[1]);
+  atexit(sharedUnlink);
+  sharedSignals[SIGINT]=  signal(SIGINT,  sharedSignal);
+  sharedSignals[SIGTERM]= signal(SIGTERM, sharedSignal);
+  sharedSignals[SIGHUP]=  signal(SIGHUP,  sharedSignal);
+  if (ftruncate(fd, sizeof(*shared)) < 0)
+    pfail(argv[1]);
+  shared= mmap(0, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == shared)
+    pfail(argv[1]);
+
+  /* anything loaded so far moves with the memory */
+  memcpy(shared->memory, mpu->memory, sizeof(shared->memory));
+  shared->registers= *mpu->registers;
+  if (mpu->flags & M6502_MemoryAllocated)    free(mpu->memory);
+  if (mpu->flags & M6502_RegistersAllocated) free(mpu->registers);
+  mpu->flags &= ~(M6502_MemoryAllocated | M6502_RegistersAllocated);
+  mpu->memory= shared->memory;
+  mpu->registers= &shared->registers;
+  memcpy(shared->magic, SHARED_MAGIC, sizeof(shared->magic));
+  return 1;
+}
+
+
+/* -V name addr last: print the registers and a hex dump of the memory of the
+ * emulator running with -m name, then exit */
+static int doView(int argc, char **argv, M6502 *mpu)
+{
+  struct sharedMachine *shared;
+  M6502		        view;
+  M6502_Registers       registers;
+  char		       *name, state[64];
+  unsigned		addr, last;
+  int			fd;
+
+  if (argc < 4) usage(1);
+  addr= htol(argv[2]);
+  last= ('+' == *argv[3]) ? addr + htol(1 + argv[3]) : htol(argv[3]);
+  name= sharedName(argv[1]);
+  if ((fd= shm_open(name, O_RDONLY, 0)) < 0)
+    pfail(argv[1]);
+  shared= mmap(0, sizeof(*shared), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if ((MAP_FAILED == shared) || memcmp(shared->magic, SHARED_MAGIC, sizeof(shared->magic)))
+    fail("%s: not a run6502 -m machine", argv[1]);
+
+  registers= shared->registers;
+  view.registers= &registers;
+  M6502_dump(&view, state);
+  printf("%s\n", state);
+  while (addr < last)
+    {
+      unsigned i;
+      printf("%04X ", addr);
+      for (i= 0;  i < 16;  ++i)
+	if (addr + i < last) printf(" %02X", shared->memory[(addr + i) & 0xFFFF]);
+	else		     printf("   ");
+      printf("  ");
+      for (i= 0;  (i < 16) && (addr + i < last);  ++i)
+	putchar(isprint(shared->memory[(addr + i) & 0xFFFF]) ? shared->memory[(addr + i) & 0xFFFF] : '.');
+      putchar('\n');
+      addr += 16;
+    }
+  exit(0);
+  return 3;
+}
+
+
 static int loadInterpreter(M6502 *mpu, word start, const char *path)
 {
   FILE   *file= 0;
@@ -746,6 +2526,54 @@ static int doLoadInterpreter(int argc, char **argv, M6502 *mpu)
 }
 
 
+static int doLibrary(int argc, char **argv, M6502 *mpu)	/* -L dir */
+{
+  DIR		*dir;
+  struct dirent *entry;
+  char	       **names= 0;
+  int		 count= 0, i;
+
+  if (argc < 2) usage(1);
+  if (!(dir= opendir(argv[1])))
+    pfail(argv[1]);
+  while ((entry= readdir(dir)))
+    if ('.' != entry->d_name[0])
+      {
+	if (!(names= realloc(names, sizeof(*names) * (count + 1))))
+	  fail("out of memory");
+	names[count]= malloc(strlen(argv[1]) + strlen(entry->d_name) + 2);
+	sprintf(names[count++], "%s/%s", argv[1], entry->d_name);
+      }
+  closedir(dir);
+  qsort(names, count, sizeof(*names), romNameOrder);
+
+  for (i= 0;  i < count;  ++i)
+    {
+      size_t size;
+      const byte *image= mapImage(names[i], &size);
+      if (!image)
+	{
+	  free(names[i]);
+	  continue;
+	}
+      if (romIsSideways(image, size) && (bankNext >= 0))
+	bank[bankNext--]= image;
+      else if (!tubeImage && (size <= 0x800) && romHasTubeSignature(image, size))
+	{
+	  tubeImage= image;
+	  tubeSize= size;
+	}
+      else if (size >= 0x4000)
+	munmap((void *)image, 0x4000);
+      else
+	free((void *)image);
+      free(names[i]);
+    }
+  free(names);
+  return 1;
+}
+
+
 static int doLoad(int argc, char **argv, M6502 *mpu)	/* -l addr file */
 {
   if (argc < 3) usage(1);
@@ -779,8 +2607,8 @@ doVEC(RST);
 #undef doVEC
 
 
-static int gTrap(M6502 *mpu, word addr, byte data)	{ mpu->registers->a= getchar();  rts; }
-static int pTrap(M6502 *mpu, word addr, byte data)	{ putchar(mpu->registers->a);  rts; }
+static int gTrap(M6502 *mpu, word addr, byte data)	{ mpu->registers->a= readKey();  rts; }
+static int pTrap(M6502 *mpu, word addr, byte data)	{ outputByte(mpu->registers->a);  rts; }
 
 static int doGtrap(int argc, char **argv, M6502 *mpu)
 {
@@ -801,8 +2629,8 @@ static int doPtrap(int argc, char **argv, M6502 *mpu)
 }
 
 
-static int mTrapRead(M6502 *mpu, word addr, byte data)	{ return getchar(); }
-static int mTrapWrite(M6502 *mpu, word addr, byte data)	{ return putchar(data); }
+static int mTrapRead(M6502 *mpu, word addr, byte data)	{ return readKey(); }
+static int mTrapWrite(M6502 *mpu, word addr, byte data)	{ outputByte(data);  return data; }
 
 static int doMtrap(int argc, char **argv, M6502 *mpu)
 {
@@ -815,7 +2643,17 @@ static int doMtrap(int argc, char **argv, M6502 *mpu)
 }
 
 
-static int xTrap(M6502 *mpu, word addr, byte data)	{ exit(0);  return 0; }
+static unsigned checkInterval= 0;	/* -D: instructions between comparisons */
+
+/* when checking, stop instead so that the last interval is compared */
+
+static int xTrap(M6502 *mpu, word addr, byte data)
+{
+  if (!checkInterval)
+    exit(0);
+  mpu->trace->limit= 0;
+  return 0;
+}
 
 static int doXtrap(int argc, char **argv, M6502 *mpu)
 {
@@ -827,6 +2665,155 @@ static int doXtrap(int argc, char **argv, M6502 *mpu)
 }
 
 
+/* Breakpoints and watchpoints are planted after everything has been loaded
+ * and trapped, otherwise later options would overwrite them.
+ */
+static struct { int type; unsigned first, last; } watches[64];
+static int nwatches= 0;
+
+
+static unsigned history= 0;		/* -H: instructions between checkpoints */
+static size_t	historyBudget= 0;
+
+
+static void where(M6502 *mpu, const char *what, word addr)
+{
+  char insn[64], state[64];
+  M6502_disassemble(mpu, addr, insn);
+  M6502_dump(mpu, state);
+  flushOutput();
+  fprintf(stderr, "\n%s %04X %s\n%s\n", what, addr, insn, state);
+}
+
+
+/* with -H each breakpoint prompts for what to do next, reading from the
+ * terminal since the program may be using stdin */
+
+static FILE *console(void)
+{
+  static FILE *tty= 0;
+  if (!tty && !(tty= fopen("/dev/tty", "r")))
+    tty= stdin;
+  return tty;
+}
+
+
+static int bHandler(M6502 *mpu, word addr, byte data)
+{
+  int moved= 0;
+  where(mpu, "break", addr);
+  if (!history)
+    return 0;
+  for (;;)
+    {
+      char line[64];
+      fprintf(stderr, "[c]ontinue [s]tep [b]ack [r]everse-continue [q]uit? ");
+      if (!fgets(line, sizeof(line), console()))
+	exit(0);
+      switch (*line)
+	{
+	case 'c':
+	case '\n':
+	  return moved ? mpu->registers->pc : 0;
+	case 's':
+	  M6502_step(mpu);
+	  break;
+	case 'b':
+	  if (!M6502_reverseStep(mpu))
+	    fprintf(stderr, "start of history\n");
+	  break;
+	case 'r':
+	  if (!M6502_reverseContinue(mpu))
+	    fprintf(stderr, "start of history\n");
+	  break;
+	case 'q':
+	  exit(0);
+	default:
+	  continue;
+	}
+      moved= 1;
+      where(mpu, "at", mpu->registers->pc);
+    }
+}
+
+
+static void watchHit(M6502 *mpu, const char *access, word addr, byte data)
+{
+  char state[64];
+  M6502_dump(mpu, state);
+  flushOutput();
+  fprintf(stderr, "\n%s %04X=%02X\n%s\n", access, addr, data, state);
+}
+
+static int rHandler(M6502 *mpu, word addr, byte data)	{ watchHit(mpu, "read",  addr, data);  return 0; }
+static int wHandler(M6502 *mpu, word addr, byte data)	{ watchHit(mpu, "write", addr, data);  return 0; }
+
+
+static int addWatch(int type, unsigned first, unsigned last)
+{
+  if (nwatches == sizeof(watches) / sizeof(*watches))
+    fail("too many breakpoints and watchpoints");
+  watches[nwatches].type = type;
+  watches[nwatches].first= first;
+  watches[nwatches].last = last;
+  ++nwatches;
+  return 0;
+}
+
+
+static int doBreak(int argc, char **argv, M6502 *mpu)	/* -b addr */
+{
+  unsigned addr= 0;
+  if (argc < 2) usage(1);
+  addr= htol(argv[1]);
+  addWatch(0, addr, addr + 1);
+  return 1;
+}
+
+
+static int doWatch(int argc, char **argv, M6502 *mpu, int type)	/* -r/-W addr last */
+{
+  unsigned addr= 0, last= 0;
+  if (argc < 3) usage(1);
+  addr= htol(argv[1]);
+  last= ('+' == *argv[2]) ? addr + htol(1 + argv[2]) : htol(argv[2]);
+  addWatch(type, addr, last);
+  return 2;
+}
+
+
+static void plantWatches(M6502 *mpu)
+{
+  int i;
+  for (i= 0;  i < nwatches;  ++i)
+    switch (watches[i].type)
+      {
+      case 0:			M6502_setBreakpoint(mpu, watches[i].first, bHandler);					break;
+      case M6502_WatchRead:	M6502_setWatchpoint(mpu, M6502_WatchRead,  watches[i].first, watches[i].last, rHandler);	break;
+      case M6502_WatchWrite:	M6502_setWatchpoint(mpu, M6502_WatchWrite, watches[i].first, watches[i].last, wHandler);	break;
+      }
+}
+
+
+static int doHistory(int argc, char **argv, M6502 *mpu)	/* -H interval megabytes */
+{
+  if (argc < 3) usage(1);
+  history= strtoul(argv[1], 0, 10);
+  historyBudget= (size_t)strtoul(argv[2], 0, 10) << 20;
+  if (!history) fail("bad history interval: %s", argv[1]);
+  return 2;
+}
+
+
+static int doCheck(int argc, char **argv, M6502 *mpu)	/* -D interval */
+{
+  if (argc < 2) usage(1);
+  checkInterval= strtoul(argv[1], 0, 10);
+  if (!checkInterval) fail("bad check interval: %s", argv[1]);
+  return 1;
+}
+
+
 static int doTubeCommand(int argc, char **argv, M6502 *mpu)
 {
   if (argc < 2) usage(1);
@@ -843,22 +2830,45 @@ static int doDisassemble(int argc, char **argv, M6502 *mpu)
   last= ('+' == *argv[2]) ? addr + htol(1 + argv[2]) : htol(argv[2]);
   while (addr < last)
     {
-      char insn[64];
-      int  i= 0, size= M6502_disassemble(mpu, addr, insn);
-      printf("%04X ", addr);
-      while (i++ < size)  printf("%02X", mpu->memory[addr + i - 1]);
-      while (i++ < 4)     printf("  ");
-      putchar(' ');
-      i= 0;
-      while (i++ < size)  putchar(isgraph(mpu->memory[addr + i - 1]) ? mpu->memory[addr + i - 1] : ' ');
-      while (i++ < 4)     putchar(' ');
-      printf(" %s\n", insn);
-      addr += size;
+      char   lines[4096];
+      size_t size= M6502_disassembleRange(mpu, &addr, last, lines, sizeof(lines));
+      fwrite(lines, 1, size, stdout);
     }
   return 2;
 }
 
 
+static uint16_t flowEntries[64];
+static unsigned flowEntryCount= 0;
+
+static int doEntry(int argc, char **argv, M6502 *mpu)	/* -e addr */
+{
+  if (argc < 2) usage(1);
+  if (flowEntryCount == sizeof(flowEntries) / sizeof(*flowEntries))
+    fail("too many entry points");
+  flowEntries[flowEntryCount++]= htol(argv[1]);
+  return 1;
+}
+
+
+static int doFlow(int argc, char **argv, M6502 *mpu)	/* -F addr last file */
+{
+  unsigned    addr= 0, last= 0;
+  M6502_Flow *flow;
+  if (argc < 4) usage(1);
+  addr= htol(argv[1]);
+  last= ('+' == *argv[2]) ? addr + htol(1 + argv[2]) : htol(argv[2]);
+  if (!(flow= M6502_loadFlow(mpu, addr, last, flowEntries, flowEntryCount, argv[3])))
+    {
+      flow= M6502_flow(mpu, addr, last, flowEntries, flowEntryCount);
+      if (!M6502_saveFlow(flow, argv[3])) pfail(argv[3]);
+    }
+  M6502_printFlow(flow, stdout);
+  M6502_deleteFlow(flow);
+  return 3;
+}
+
+
 int main(int argc, char **argv)
 {
   M6502 *mpu= M6502_new(0, 0, 0);
@@ -866,6 +2876,7 @@ int main(int argc, char **argv)
   int tTraps= 0;
 
   program= argv[0];
+  initOutput();
 
   if ((2 == argc) && ('-' != *argv[1]))
     {
@@ -877,36 +2888,48 @@ int main(int argc, char **argv)
     while (++argv, --argc > 0)
       {
 	int n= 0;
-	if      (!strcmp(*argv, "-B"))  bTraps= 1;
+	if      (!strcmp(*argv, "-A"))	n= doHeatmap(argc, argv, mpu);
+	else if (!strcmp(*argv, "-B"))  bTraps= 1;
+	else if (!strcmp(*argv, "-b"))	n= doBreak(argc, argv, mpu);
+	else if (!strcmp(*argv, "-C"))	n= doCoverage(argc, argv, mpu);
         else if (!strcmp(*argv, "-c"))  n= doTubeCommand(argc, argv, mpu);
+	else if (!strcmp(*argv, "-D"))	n= doCheck(argc, argv, mpu);
 	else if (!strcmp(*argv, "-d"))	n= doDisassemble(argc, argv, mpu);
+	else if (!strcmp(*argv, "-E"))	n= doCoverageText(argc, argv, mpu);
+	else if (!strcmp(*argv, "-e"))	n= doEntry(argc, argv, mpu);
+	else if (!strcmp(*argv, "-F"))	n= doFlow(argc, argv, mpu);
 	else if (!strcmp(*argv, "-G"))	n= doGtrap(argc, argv, mpu);
+	else if (!strcmp(*argv, "-H"))	n= doHistory(argc, argv, mpu);
 	else if (!strcmp(*argv, "-h"))	n= doHelp(argc, argv, mpu);
 	else if (!strcmp(*argv, "-i"))	n= doLoadInterpreter(argc, argv, mpu);
 	else if (!strcmp(*argv, "-I"))	n= doIRQ(argc, argv, mpu);
+	else if (!strcmp(*argv, "-K"))	initKeyboard();
+	else if (!strcmp(*argv, "-L"))	n= doLibrary(argc, argv, mpu);
 	else if (!strcmp(*argv, "-l"))	n= doLoad(argc, argv, mpu);
 	else if (!strcmp(*argv, "-M"))	n= doMtrap(argc, argv, mpu);
+	else if (!strcmp(*argv, "-m"))	n= doShared(argc, argv, mpu);
 	else if (!strcmp(*argv, "-N"))	n= doNMI(argc, argv, mpu);
+	else if (!strcmp(*argv, "-O"))	star_system= 1;
 	else if (!strcmp(*argv, "-P"))	n= doPtrap(argc, argv, mpu);
 	else if (!strcmp(*argv, "-R"))	n= doRST(argc, argv, mpu);
+	else if (!strcmp(*argv, "-r"))	n= doWatch(argc, argv, mpu, M6502_WatchRead);
+	else if (!strcmp(*argv, "-S"))	n= doStats(argc, argv, mpu);
 	else if (!strcmp(*argv, "-s"))	n= doSave(argc, argv, mpu);
 	else if (!strcmp(*argv, "-T"))  tTraps= 1;
+	else if (!strcmp(*argv, "-U"))	n= doAsync(argc, argv, mpu);
 	else if (!strcmp(*argv, "-v"))	n= doVersion(argc, argv, mpu);
+	else if (!strcmp(*argv, "-V"))	n= doView(argc, argv, mpu);
 	else if (!strcmp(*argv, "-w"))  n= doExitWrite(argc, argv, mpu);
+	else if (!strcmp(*argv, "-W"))	n= doWatch(argc, argv, mpu, M6502_WatchWrite);
 	else if (!strcmp(*argv, "-X"))	n= doXtrap(argc, argv, mpu);
 	else if (!strcmp(*argv, "-x"))	exit(0);
 	else if ('-' == **argv)		usage(1);
 	else
 	  {
-	    /* doBtraps() left 0x8000+0x4000 in bank 0, so load */
+	    /* doBtraps() leaves 0x8000+0x4000 in bank 0, so map */
 	    /* additional images starting at 15 and work down */
-	    static int bankSel= 0x0F;
 	    if (!bTraps)			usage(1);
-	    if (bankSel < 0)			fail("too many images");
-	    if (!load(mpu, 0x8000, argv[0]))	pfail(argv[0]);
-	    memcpy(bank[bankSel--],
-		   0x8000 + mpu->memory,
-		   0x4000);
+	    mapBank(argv[0]);
 	    n= 1;
 	  }
 	argc -= n;
@@ -924,11 +2947,34 @@ int main(int argc, char **argv)
   else if (tTraps)
     doTtraps(0, 0, mpu);
 
+  plantWatches(mpu);
+
+  if (coverage_path || coverage_text)
+    {
+      coverage= M6502_coverage(mpu, coverage_text ? M6502_CoverCounts : 0);
+      atexit(writeCoverage);
+    }
+
+  if (heatmap_path)
+    {
+      heatmap= M6502_heatmap(mpu);
+      memset(heatmap->detailed, 1, sizeof(heatmap->detailed));
+      atexit(writeHeatmap);
+    }
+
   M6502_reset(mpu);
-  M6502_run(mpu);
+  if (history)
+    M6502_setHistory(mpu, history, historyBudget);
+  if (!checkInterval)
+    M6502_run(mpu);
+  else if (M6502_check(mpu, M6502_stepEngine, checkInterval, stderr))
+    fail("%s: the interpreters disagree", program);
 
   if (exit_write)
     writeMemory();
+  writeCoverage();
+  writeHeatmap();
+  printStats();
   exit_write_mpu= 0; M6502_delete(mpu);
 
   return 0;
@@ -0,0 +1,437 @@
+/* tube6502.c -- Acorn Tube ULA connecting two lib6502 processors	-*- C -*- */
+
+/* Copyright (c) 2005 Ian Piumarta
+ *
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the 'Software'),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, provided that the above copyright notice(s) and this
+ * permission notice appear in all copies of the Software and that both the
+ * above copyright notice(s) and this permission notice appear in supporting
+ * documentation.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS'.  USE ENTIRELY AT YOUR OWN RISK.
+ */
+
+/* The Tube ULA has four registers on each side, each a FIFO in each
+ * direction (R1 parasite to host holds 24 bytes, R3 two if flag V is set
+ * and otherwise one, the rest one).
+ * Every FIFO has exactly one writer and one reader, each running on its
+ * own processor's thread, so they are lock-free single-producer
+ * single-consumer rings.  Clearing them (flag T) cannot move the head of
+ * a ring that the other thread reads, so the host records the tail it is
+ * to move to and the reader moves it there; until it does, both sides
+ * count from the recorded tail.  The host sees them at 0xFEE0-0xFEE7 and the
+ * parasite at 0xFEF8-0xFEFF: even addresses are status (and, on the host
+ * side, the control flags SPVMJIQ), odd addresses data.
+ *
+ * After every register access the interrupt lines are recomputed.  A
+ * processor is interrupted from the other thread by posting the request
+ * and lowering its trace limit: the traced interpreter stops at the
+ * next instruction boundary and tubeExpired() takes the interrupt.  An IRQ
+ * that arrives while interrupts are disabled is retried every few
+ * instructions for as long as its line stays asserted.  Whenever the trace
+ * limit holds a value of ours rather than the client's, the client's is
+ * kept aside; if the client stores a limit of its own meanwhile (to stop
+ * the run from a callback, say) that one is honoured instead.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "lib6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+enum {
+  flagQ= 1 << 0,	/* parasite IRQ from host-to-parasite R1 */
+  flagI= 1 << 1,	/* parasite IRQ from host-to-parasite R4 */
+  flagJ= 1 << 2,	/* host IRQ from parasite-to-host R4 */
+  flagM= 1 << 3,	/* parasite NMI from R3 */
+  flagV= 1 << 4,	/* R3 holds two bytes */
+  flagP= 1 << 5,	/* parasite reset */
+  flagT= 1 << 6,	/* clear all FIFOs */
+  flagS= 1 << 7		/* not used */
+};
+
+enum {
+  pendingIRQ=   1 << 0,
+  pendingNMI=   1 << 1,
+  pendingReset= 1 << 2,
+  pendingStop=  1 << 3
+};
+
+#define RETRY	16	/* instructions between attempts at a held-off IRQ */
+#define POSTED	1	/* a limit that expires at the next instruction but is
+			 * not the 0 that clients use to stop the run */
+
+struct fifo
+{
+  byte	   data[24];
+  unsigned size;
+  unsigned head;	/* advanced by the reader */
+  unsigned tail;	/* advanced by the writer */
+  unsigned flush;	/* the tail when last cleared */
+  unsigned clears;	/* advanced by clear() */
+  unsigned cleared;	/* clears the reader has applied to head */
+  byte	   last;	/* what an empty FIFO reads as */
+};
+
+struct side
+{
+  M6502	     *mpu;
+  M6502_Tube *tube;
+  int	      pending;	/* interrupts posted to this processor */
+  int	      irq;	/* its IRQ line */
+  int	      nmi;	/* its NMI line, for edge detection */
+  uint64_t    limit;	/* the client's trace limit, while lowered */
+  uint64_t    ours;	/* what we lowered it to */
+  int	      lowered;	/* non-zero while the trace limit is ours */
+  pthread_mutex_t lock;	/* for the three above */
+  int	    (*expired)(M6502 *mpu);
+};
+
+struct _M6502_Tube
+{
+  struct fifo toParasite[4];
+  struct fifo toHost[4];
+  byte	      flags;
+  struct side host;
+  struct side parasite;
+};
+
+
+#define load(P)		__atomic_load_n(&(P), __ATOMIC_ACQUIRE)
+#define store(P, V)	__atomic_store_n(&(P), (V), __ATOMIC_RELEASE)
+
+/* the head, or where a clear that the reader has yet to apply will put it */
+
+static unsigned first(struct fifo *f)
+{
+  unsigned head= load(f->head);
+  if (load(f->clears) != load(f->cleared))
+    {
+      unsigned flush= load(f->flush);
+      if ((int)(flush - head) > 0)
+	head= flush;
+    }
+  return head;
+}
+
+static unsigned count(struct fifo *f)	{ return load(f->tail) - first(f); }
+
+/* how many bytes f holds just now: R3 is a one-byte FIFO unless flag V
+ * is set */
+
+static unsigned capacity(M6502_Tube *tube, struct fifo *f)
+{
+  if ((f == &tube->toParasite[2]) || (f == &tube->toHost[2]))
+    return (load(tube->flags) & flagV) ? 2 : 1;
+  return f->size;
+}
+
+static void put(struct fifo *f, unsigned capacity, byte value)
+{
+  unsigned tail= f->tail;
+  if (tail - first(f) < capacity)
+    {
+      f->data[tail % f->size]= value;
+      store(f->tail, tail + 1);
+    }
+}
+
+static byte get(struct fifo *f)
+{
+  unsigned clears= load(f->clears), head= f->head;
+  if (clears != f->cleared)
+    {
+      unsigned flush= load(f->flush);
+      if ((int)(flush - head) > 0)
+	store(f->head, head= flush);
+      store(f->cleared, clears);
+    }
+  if (head != load(f->tail))
+    {
+      f->last= f->data[head % f->size];
+      store(f->head, head + 1);
+    }
+  return f->last;
+}
+
+static void flush(struct fifo *f)
+{
+  store(f->flush, load(f->tail));
+  store(f->clears, f->clears + 1);
+}
+
+static void clear(M6502_Tube *tube)
+{
+  int i;
+  for (i= 0;  i < 4;  ++i)
+    {
+      flush(&tube->toParasite[i]);
+      flush(&tube->toHost[i]);
+    }
+}
+
+
+/* put ours in place of the client's trace limit (with the side locked) */
+
+static void lower(struct side *side, uint64_t limit)
+{
+  M6502_Trace *trace= side->mpu->trace;
+  uint64_t     current= load(trace->limit);
+
+  if (!side->lowered || current != side->ours)
+    side->limit= current;
+  side->ours= limit;
+  side->lowered= 1;
+  store(trace->limit, limit);
+}
+
+
+/* the client's trace limit, which the trace then gets back (ditto) */
+
+static uint64_t restore(struct side *side)
+{
+  M6502_Trace *trace= side->mpu->trace;
+  uint64_t     current= load(trace->limit);
+
+  if (side->lowered && current == side->ours)
+    current= side->limit;
+  side->lowered= 0;
+  store(trace->limit, current);
+  return current;
+}
+
+
+static void post(struct side *side, int what)
+{
+  pthread_mutex_lock(&side->lock);
+  __atomic_or_fetch(&side->pending, what, __ATOMIC_ACQ_REL);
+  lower(side, POSTED);
+  pthread_mutex_unlock(&side->lock);
+}
+
+
+/* recompute the interrupt lines after any change to the FIFOs or flags */
+
+static void signal(M6502_Tube *tube)
+{
+  byte flags= load(tube->flags);
+  unsigned r3= capacity(tube, &tube->toParasite[2]);
+  int hostIRQ, parasiteIRQ, parasiteNMI;
+
+  hostIRQ=     (flags & flagJ) && count(&tube->toHost[3]);
+  parasiteIRQ= ((flags & flagQ) && count(&tube->toParasite[0]))
+	    || ((flags & flagI) && count(&tube->toParasite[3]));
+  parasiteNMI= (flags & flagM)
+	    && ((count(&tube->toParasite[2]) >= r3) || !count(&tube->toHost[2]));
+
+  if (hostIRQ != __atomic_exchange_n(&tube->host.irq, hostIRQ, __ATOMIC_ACQ_REL) && hostIRQ)
+    post(&tube->host, pendingIRQ);
+  if (parasiteIRQ != __atomic_exchange_n(&tube->parasite.irq, parasiteIRQ, __ATOMIC_ACQ_REL) && parasiteIRQ)
+    post(&tube->parasite, pendingIRQ);
+  if (parasiteNMI != __atomic_exchange_n(&tube->parasite.nmi, parasiteNMI, __ATOMIC_ACQ_REL) && parasiteNMI)
+    post(&tube->parasite, pendingNMI);
+}
+
+
+/* host registers */
+
+static int hostRead(M6502 *mpu, word address, byte data)
+{
+  M6502_Tube *tube= mpu->tube;
+  int	      reg= (address >> 1) & 3;
+  byte	      value;
+
+  if (address & 1)
+    value= get(&tube->toHost[reg]);
+  else
+    {
+      struct fifo *in= &tube->toHost[reg], *out= &tube->toParasite[reg];
+      value= (count(in) ? 0x80 : 0) | ((count(out) < capacity(tube, out)) ? 0x40 : 0);
+      if (!reg)
+	value |= load(tube->flags) & 0x3F;
+    }
+  signal(tube);
+  return value;
+}
+
+
+static int hostWrite(M6502 *mpu, word address, byte data)
+{
+  M6502_Tube *tube= mpu->tube;
+  int	      reg= (address >> 1) & 3;
+
+  if (address & 1)
+    put(&tube->toParasite[reg], capacity(tube, &tube->toParasite[reg]), data);
+  else if (!reg)
+    {
+      /* bit 7 says whether the flags in bits 6-0 are set or cleared */
+      byte flags= load(tube->flags);
+      flags= (data & 0x80) ? (flags | (data & 0x7F)) : (flags & ~(data & 0x7F));
+      store(tube->flags, flags);
+      if (flags & flagT)
+	clear(tube);
+      if ((data & 0x80) && (data & flagP))
+	post(&tube->parasite, pendingReset);
+    }
+  signal(tube);
+  return data;
+}
+
+
+/* parasite registers */
+
+static int parasiteRead(M6502 *mpu, word address, byte data)
+{
+  M6502_Tube *tube= mpu->tube;
+  int	      reg= (address >> 1) & 3;
+  byte	      value;
+
+  if (address & 1)
+    value= get(&tube->toParasite[reg]);
+  else
+    {
+      struct fifo *in= &tube->toParasite[reg], *out= &tube->toHost[reg];
+      value= (count(in) ? 0x80 : 0) | ((count(out) < capacity(tube, out)) ? 0x40 : 0);
+      if (!reg)
+	value |= load(tube->flags) & 0x3F;
+    }
+  signal(tube);
+  return value;
+}
+
+
+static int parasiteWrite(M6502 *mpu, word address, byte data)
+{
+  M6502_Tube *tube= mpu->tube;
+  int	      reg= (address >> 1) & 3;
+
+  if (address & 1)
+    put(&tube->toHost[reg], capacity(tube, &tube->toHost[reg]), data);
+  signal(tube);
+  return data;
+}
+
+
+/* called by the traced interpreter when insns reaches its limit, which
+ * post() lowers to zero to interrupt it from the other thread */
+
+static int tubeExpired(M6502 *mpu)
+{
+  M6502_Tube  *tube= mpu->tube;
+  M6502_Trace *trace= mpu->trace;
+  struct side *side= (mpu == tube->host.mpu) ? &tube->host : &tube->parasite;
+  uint64_t     limit;
+  int	       pending;
+
+  /* restore the limit before taking the requests, so none is lost */
+  pthread_mutex_lock(&side->lock);
+  limit= restore(side);
+  pending= __atomic_exchange_n(&side->pending, 0, __ATOMIC_ACQ_REL);
+  pthread_mutex_unlock(&side->lock);
+
+  if (pending & pendingStop)
+    return 0;
+  if (pending & pendingReset)
+    M6502_reset(mpu);
+  if (pending & pendingNMI)
+    M6502_nmi(mpu);
+  if (load(side->irq) && !(mpu->registers->p & 0x04))
+    M6502_irq(mpu);
+
+  if (trace->insns >= limit)
+    {
+      if (!side->expired || !side->expired(mpu))
+	return 0;
+      limit= trace->limit;	/* which the handler may have moved */
+    }
+
+  /* a level-triggered IRQ that is still asserted (held off by the I flag,
+   * or not cleared by its handler) is looked at again shortly */
+  pthread_mutex_lock(&side->lock);
+  if (load(side->irq) && trace->insns + RETRY < limit)
+    lower(side, trace->insns + RETRY);
+  if (load(side->pending))
+    lower(side, POSTED);
+  pthread_mutex_unlock(&side->lock);
+  return 1;
+}
+
+
+static void attach(M6502_Tube *tube, struct side *side, M6502 *mpu, word base, M6502_Callback reader, M6502_Callback writer)
+{
+  M6502_Trace *trace= M6502_trace(mpu);
+  unsigned     address;
+
+  side->mpu=	 mpu;
+  side->tube=	 tube;
+  side->expired= trace->expired;
+  pthread_mutex_init(&side->lock, 0);
+  trace->expired= tubeExpired;
+  mpu->tube=	 tube;
+  for (address= base;  address < base + 8u;  ++address)
+    {
+      M6502_setCallback(mpu, read,  address, reader);
+      M6502_setCallback(mpu, write, address, writer);
+    }
+}
+
+
+M6502_Tube *M6502_newTube(M6502 *host, M6502 *parasite)
+{
+  M6502_Tube *tube= calloc(1, sizeof(M6502_Tube));
+  int	      i;
+
+  if (!tube)
+    return 0;
+  for (i= 0;  i < 4;  ++i)
+    tube->toParasite[i].size= tube->toHost[i].size= 1;
+  tube->toHost[0].size= 24;
+  tube->toHost[2].size= tube->toParasite[2].size= 2;
+  attach(tube, &tube->host,     host,     0xFEE0, hostRead,     hostWrite);
+  attach(tube, &tube->parasite, parasite, 0xFEF8, parasiteRead, parasiteWrite);
+  return tube;
+}
+
+
+static void *runParasite(void *arg)
+{
+  M6502_run((M6502 *)arg);
+  return 0;
+}
+
+
+void M6502_runTube(M6502_Tube *tube)
+{
+  pthread_t thread;
+
+  if (pthread_create(&thread, 0, runParasite, tube->parasite.mpu))
+    return;
+  M6502_run(tube->host.mpu);
+  post(&tube->parasite, pendingStop);
+  pthread_join(thread, 0);
+}
+
+
+void M6502_deleteTube(M6502_Tube *tube)
+{
+  struct side *sides[2]= { &tube->host, &tube->parasite };
+  int i;
+  for (i= 0;  i < 2;  ++i)
+    {
+      M6502 *mpu= sides[i]->mpu;
+      mpu->trace->expired= sides[i]->expired;
+      restore(sides[i]);
+      pthread_mutex_destroy(&sides[i]->lock);
+      mpu->tube=	   0;
+    }
+  free(tube);
+}